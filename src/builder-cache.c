@@ -35,6 +35,7 @@
 #include "builder-utils.h"
 #include "builder-cache.h"
 #include "builder-context.h"
+#include "builder-path-table.h"
 
 struct BuilderCache
 {
@@ -46,7 +47,10 @@ struct BuilderCache
   char       *stage;
   GHashTable *unused_stages;
   char       *last_parent;
+  char       *stage_parent;
+  gboolean    stage_committed;
   char       *current_checksum;
+  BuilderResourceUsage usage;
   OstreeRepo *repo;
   gboolean    disabled;
   OstreeRepoDevInoCache *devino_to_csum_cache;
@@ -70,10 +74,10 @@ enum {
 #define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
                                    "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
 
-static GPtrArray   *builder_cache_get_changes_to (BuilderCache *self,
-                                                  GFile        *current_root,
-                                                  GPtrArray   **removals,
-                                                  GError      **error);
+static BuilderPathTable *builder_cache_get_changes_to (BuilderCache *self,
+                                                       GFile        *current_root,
+                                                       GPtrArray   **removals,
+                                                       GError      **error);
 
 
 static void
@@ -87,6 +91,7 @@ builder_cache_finalize (GObject *object)
   g_checksum_free (self->checksum);
   g_free (self->branch);
   g_free (self->last_parent);
+  g_free (self->stage_parent);
   g_free (self->stage);
   g_free (self->current_checksum);
   if (self->unused_stages)
@@ -210,6 +215,25 @@ builder_cache_get_checksum (BuilderCache *self)
   return self->checksum;
 }
 
+OstreeRepo *
+builder_cache_get_repo (BuilderCache *self)
+{
+  return self->repo;
+}
+
+const char *
+builder_cache_get_last_commit (BuilderCache *self)
+{
+  return self->last_parent;
+}
+
+/* The checksum of the stage last looked up, which its commit is for */
+const char *
+builder_cache_get_stage_checksum (BuilderCache *self)
+{
+  return self->current_checksum;
+}
+
 static void
 append_escaped_stage (GString *s,
                       const char *stage)
@@ -442,6 +466,57 @@ checkout:
   return FALSE;
 }
 
+/* Records what building the current stage cost, to be stored with
+   its next commit. */
+void
+builder_cache_set_usage (BuilderCache               *self,
+                         const BuilderResourceUsage *usage)
+{
+  self->usage = *usage;
+}
+
+/* Looks up what the last build of the stage cost, whatever its
+   checksum was. If stage is NULL this is the current stage. Returns
+   FALSE if it was never built, or by a version that didn't record it. */
+gboolean
+builder_cache_get_stage_usage (BuilderCache         *self,
+                               const char           *stage,
+                               BuilderResourceUsage *out_usage)
+{
+  g_autofree char *ref = NULL;
+  g_autofree char *commit = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) commit_metadata = NULL;
+
+  if (stage == NULL)
+    stage = self->stage;
+  if (stage == NULL)
+    return FALSE;
+
+  ref = get_ref (self, stage);
+  if (!ostree_repo_resolve_rev (self->repo, ref, TRUE, &commit, NULL) ||
+      commit == NULL)
+    return FALSE;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                 &variant, NULL))
+    return FALSE;
+
+  commit_metadata = g_variant_get_child_value (variant, 0);
+
+  memset (out_usage, 0, sizeof (*out_usage));
+  if (!g_variant_lookup (commit_metadata, "wall-time", "t", &out_usage->wall_time))
+    return FALSE;
+
+  g_variant_lookup (commit_metadata, "user-time", "t", &out_usage->user_time);
+  g_variant_lookup (commit_metadata, "system-time", "t", &out_usage->system_time);
+  g_variant_lookup (commit_metadata, "max-rss", "t", &out_usage->max_rss);
+  g_variant_lookup (commit_metadata, "bytes-read", "t", &out_usage->bytes_read);
+  g_variant_lookup (commit_metadata, "bytes-written", "t", &out_usage->bytes_written);
+
+  return TRUE;
+}
+
 static gboolean
 mtree_empty (OstreeMutableTree *mtree)
 {
@@ -584,7 +659,8 @@ builder_cache_commit (BuilderCache *self,
   g_autofree char *ref = NULL;
   g_autoptr(GFile) last_root = NULL;
   g_autoptr(GFile) new_root = NULL;
-  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(BuilderPathTable) changes = NULL;
+  g_autoptr(GBytes) changes_bytes = NULL;
   g_autoptr(GPtrArray) removals = NULL;
   g_autoptr(GVariantDict) metadata_dict = NULL;
   g_autoptr(GVariant) metadata = NULL;
@@ -618,18 +694,32 @@ builder_cache_commit (BuilderCache *self,
   if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
     goto out;
 
-  changes = builder_cache_get_changes_to (self, root, &removals, NULL);
+  changes = builder_cache_get_changes_to (self, root, &removals, error);
+  if (changes == NULL)
+    goto out;
 
   metadata_dict = g_variant_dict_new (NULL);
 
-  changesv = g_variant_ref_sink (g_variant_new_strv ((const gchar * const  *) changes->pdata, changes->len));
+  /* Older versions don't know this, and fall back to diffing the commits */
+  changes_bytes = builder_path_table_get_bytes (changes);
+  changesv = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, changes_bytes, TRUE));
   changesvz = flatpak_variant_compress (changesv);
-  g_variant_dict_insert_value (metadata_dict, "changesz", changesvz);
+  g_variant_dict_insert_value (metadata_dict, "changestablez", changesvz);
 
   removalsv = g_variant_ref_sink (g_variant_new_strv ((const gchar * const  *) removals->pdata, removals->len));
   removalsvz = flatpak_variant_compress (removalsv);
   g_variant_dict_insert_value (metadata_dict, "removalsz", removalsvz);
 
+  if (self->usage.wall_time != 0)
+    {
+      g_variant_dict_insert (metadata_dict, "wall-time", "t", self->usage.wall_time);
+      g_variant_dict_insert (metadata_dict, "user-time", "t", self->usage.user_time);
+      g_variant_dict_insert (metadata_dict, "system-time", "t", self->usage.system_time);
+      g_variant_dict_insert (metadata_dict, "max-rss", "t", self->usage.max_rss);
+      g_variant_dict_insert (metadata_dict, "bytes-read", "t", self->usage.bytes_read);
+      g_variant_dict_insert (metadata_dict, "bytes-written", "t", self->usage.bytes_written);
+    }
+
   metadata = g_variant_ref_sink (g_variant_dict_end (metadata_dict));
 
   current = self->current_checksum;
@@ -665,8 +755,11 @@ builder_cache_commit (BuilderCache *self,
       !builder_cache_checkout (self, new_commit_checksum, FALSE, error))
     goto out;
 
-  g_free (self->last_parent);
+  g_free (self->stage_parent);
+  self->stage_parent = g_steal_pointer (&self->last_parent);
+  self->stage_committed = TRUE;
   self->last_parent = g_steal_pointer (&commit_checksum);
+  memset (&self->usage, 0, sizeof (self->usage));
 
   res = TRUE;
 
@@ -682,6 +775,33 @@ out:
   return res;
 }
 
+/* Goes back to the state the last committed stage was built on, so
+ * that it can be built again and committed in place of it. */
+gboolean
+builder_cache_rewind_stage (BuilderCache *self,
+                            GError      **error)
+{
+  if (!self->stage_committed)
+    return flatpak_fail (error, "No stage to rewind");
+
+  g_print ("Rewinding stage %s\n", self->stage);
+
+  if (!flatpak_rm_rf (self->app_dir, NULL, error))
+    return FALSE;
+
+  if (!flatpak_mkdir_p (self->app_dir, NULL, error))
+    return FALSE;
+
+  if (self->stage_parent &&
+      !builder_cache_checkout (self, self->stage_parent, FALSE, error))
+    return FALSE;
+
+  g_free (self->last_parent);
+  self->last_parent = g_strdup (self->stage_parent);
+
+  return TRUE;
+}
+
 typedef struct {
   dev_t dev;
   ino_t ino;
@@ -983,9 +1103,9 @@ diff_dirs (OstreeRepoDevInoCache *devino_to_csum_cache,
 }
 
 gboolean
-builder_cache_get_outstanding_changes (BuilderCache *self,
-                                       GPtrArray   **changed_out,
-                                       GError      **error)
+builder_cache_get_outstanding_changes (BuilderCache      *self,
+                                       BuilderPathTable **changed_out,
+                                       GError           **error)
 {
   g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_object_unref);
   g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
@@ -1011,18 +1131,13 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
     }
 
   if (changed_out)
-    *changed_out = g_steal_pointer (&changed_paths);
+    *changed_out = builder_path_table_new ((const char * const *) changed_paths->pdata,
+                                           changed_paths->len);
 
   return TRUE;
 }
 
-static int
-cmpstringp (const void *p1, const void *p2)
-{
-  return strcmp (*(char * const *) p1, *(char * const *) p2);
-}
-
-static GPtrArray *
+static BuilderPathTable *
 get_changes (BuilderCache *self,
              GFile       *from,
              GFile       *to,
@@ -1057,8 +1172,6 @@ get_changes (BuilderCache *self,
       g_ptr_array_add (changed_paths, path);
     }
 
-  g_ptr_array_sort (changed_paths, cmpstringp);
-
   if (removed_out)
     {
       GPtrArray *removed_paths = g_ptr_array_new_with_free_func (g_free);
@@ -1071,12 +1184,13 @@ get_changes (BuilderCache *self,
       *removed_out = removed_paths;
     }
 
-  return g_steal_pointer (&changed_paths);
+  return builder_path_table_new ((const char * const *) changed_paths->pdata,
+                                 changed_paths->len);
 }
 
 
 /* This returns removals too */
-static GPtrArray *
+static BuilderPathTable *
 get_all_changes (BuilderCache *self,
                  GFile       *from,
                  GFile       *to,
@@ -1116,13 +1230,12 @@ get_all_changes (BuilderCache *self,
       g_ptr_array_add (changed_paths, path);
     }
 
-  g_ptr_array_sort (changed_paths, cmpstringp);
-
-  return g_steal_pointer (&changed_paths);
+  return builder_path_table_new ((const char * const *) changed_paths->pdata,
+                                 changed_paths->len);
 }
 
 /* This returns removals too */
-GPtrArray *
+BuilderPathTable *
 builder_cache_get_all_changes (BuilderCache *self,
                                GError      **error)
 {
@@ -1148,7 +1261,7 @@ builder_cache_get_all_changes (BuilderCache *self,
   return get_all_changes (self, init_root, finish_root, error);
 }
 
-static GPtrArray   *
+static BuilderPathTable *
 builder_cache_get_changes_to (BuilderCache *self,
                               GFile        *current_root,
                               GPtrArray   **removals,
@@ -1163,7 +1276,7 @@ builder_cache_get_changes_to (BuilderCache *self,
   return get_changes (self, parent_root, current_root, removals, error);
 }
 
-GPtrArray   *
+BuilderPathTable *
 builder_cache_get_changes (BuilderCache *self,
                            GError      **error)
 {
@@ -1174,6 +1287,7 @@ builder_cache_get_changes (BuilderCache *self,
   g_autofree char *parent_commit = NULL;
   g_autoptr(GVariant) changesz_v = NULL;
   g_autoptr(GVariant) changes_v = NULL;
+  g_autoptr(GVariant) table_v = NULL;
 
   if (!ostree_repo_read_commit (self->repo, self->last_parent, &current_root, NULL, NULL, error))
     return NULL;
@@ -1183,6 +1297,18 @@ builder_cache_get_changes (BuilderCache *self,
     return NULL;
 
   commit_metadata = g_variant_get_child_value (variant, 0);
+
+  changesz_v = g_variant_lookup_value (commit_metadata, "changestablez", G_VARIANT_TYPE_BYTESTRING);
+  if (changesz_v)
+    {
+      g_autoptr(GBytes) table_bytes = NULL;
+
+      table_v = flatpak_variant_uncompress (changesz_v, G_VARIANT_TYPE_BYTESTRING);
+      table_bytes = g_variant_get_data_as_bytes (table_v);
+      return builder_path_table_new_from_bytes (table_bytes, error);
+    }
+
+  /* Written by older versions */
   changesz_v = g_variant_lookup_value (commit_metadata, "changesz", G_VARIANT_TYPE_BYTESTRING);
 
   if (changesz_v)
@@ -1192,17 +1318,10 @@ builder_cache_get_changes (BuilderCache *self,
 
   if (changes_v)
     {
-      g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
-      int i;
-
-      for (i = 0; i < g_variant_n_children (changes_v); i++)
-        {
-          char *str;
-          g_variant_get_child (changes_v, i, "s", &str);
-          g_ptr_array_add (changed_paths, str);
-        }
+      gsize n_paths;
+      g_autofree const char **paths = g_variant_get_strv (changes_v, &n_paths);
 
-      return g_steal_pointer (&changed_paths);
+      return builder_path_table_new (paths, n_paths);
     }
 
   parent_commit = ostree_commit_get_parent (variant);
@@ -1215,7 +1334,7 @@ builder_cache_get_changes (BuilderCache *self,
   return get_changes (self, parent_root, current_root, NULL, error);
 }
 
-GPtrArray   *
+BuilderPathTable *
 builder_cache_get_files (BuilderCache *self,
                          GError      **error)
 {
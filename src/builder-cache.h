@@ -23,6 +23,10 @@
 
 #include <gio/gio.h>
 #include <libglnx.h>
+#include <ostree.h>
+
+#include "builder-path-table.h"
+#include "builder-utils.h"
 
 G_BEGIN_DECLS
 
@@ -42,6 +46,9 @@ void          builder_cache_disable_lookups (BuilderCache *self);
 gboolean      builder_cache_open (BuilderCache *self,
                                   GError      **error);
 GChecksum *   builder_cache_get_checksum (BuilderCache *self);
+OstreeRepo *  builder_cache_get_repo (BuilderCache *self);
+const char *  builder_cache_get_last_commit (BuilderCache *self);
+const char *  builder_cache_get_stage_checksum (BuilderCache *self);
 gboolean      builder_cache_lookup (BuilderCache *self,
                                     const char   *stage);
 void          builder_cache_ensure_checkout (BuilderCache *self);
@@ -49,15 +56,22 @@ gboolean      builder_cache_has_checkout (BuilderCache *self);
 gboolean      builder_cache_commit (BuilderCache *self,
                                     const char   *body,
                                     GError      **error);
-gboolean      builder_cache_get_outstanding_changes (BuilderCache *self,
-                                                     GPtrArray   **changed_out,
-                                                     GError      **error);
-GPtrArray   *builder_cache_get_files (BuilderCache *self,
-                                      GError      **error);
-GPtrArray   *builder_cache_get_changes (BuilderCache *self,
-                                        GError      **error);
-GPtrArray   *builder_cache_get_all_changes (BuilderCache *self,
-                                            GError      **error);
+gboolean      builder_cache_rewind_stage (BuilderCache *self,
+                                          GError      **error);
+void          builder_cache_set_usage (BuilderCache               *self,
+                                       const BuilderResourceUsage *usage);
+gboolean      builder_cache_get_stage_usage (BuilderCache         *self,
+                                             const char           *stage,
+                                             BuilderResourceUsage *out_usage);
+gboolean      builder_cache_get_outstanding_changes (BuilderCache      *self,
+                                                     BuilderPathTable **changed_out,
+                                                     GError           **error);
+BuilderPathTable *builder_cache_get_files (BuilderCache *self,
+                                           GError      **error);
+BuilderPathTable *builder_cache_get_changes (BuilderCache *self,
+                                             GError      **error);
+BuilderPathTable *builder_cache_get_all_changes (BuilderCache *self,
+                                                 GError      **error);
 gboolean      builder_gc (BuilderCache *self,
                           gboolean      prune_unused_stages,
                           GError      **error);
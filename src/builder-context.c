@@ -26,10 +26,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <linux/magic.h>
 #include <sys/prctl.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <glib/gi18n.h>
 #include "builder-flatpak-utils.h"
@@ -64,15 +75,38 @@ struct BuilderContext
   GFile          *build_dir;
   GFile          *cache_dir;
   GFile          *checksums_dir;
+  GFile          *build_sizes_dir;
+  GFile          *failed_builds_dir;
+  GFile          *license_files_dir;
+  GFile          *tmpfs_build_dir;
+  GFile          *trash_dir;
+  GThread        *reaper_thread;
+  GMutex          reaper_lock;
+  GCond           reaper_cond;
+  GCancellable   *reaper_cancellable;
+  gboolean        reaper_pending;
+  GHashTable     *tmpfs_reservations;
+  guint64         tmpfs_reserved;
+  guint64         build_dir_tmpfs_size;
   GFile          *ccache_dir;
+  GFile          *jobserver_dir;
+  int             jobserver_fd;
   GFile          *rofiles_dir;
   GFile          *rofiles_allocated_dir;
   GLnxLockFile   rofiles_file_lock;
+  GFile          *overlay_dir;
+  GLnxLockFile   overlay_file_lock;
+  GPid            overlay_pid;
 
   BuilderOptions *options;
   gboolean        keep_build_dirs;
   gboolean        delete_build_dirs;
+  gboolean        extract_ahead;
+  gboolean        resume_failed;
+  gboolean        batch_commands;
+  gboolean        use_jobserver;
   int             jobs;
+  BuilderResourceUsage build_usage;
   char          **cleanup;
   char          **cleanup_platform;
   gboolean        use_ccache;
@@ -84,6 +118,8 @@ struct BuilderContext
   gboolean        rebuild_on_sdk_change;
   gboolean        use_rofiles;
   gboolean        have_rofiles;
+  gboolean        use_overlayfs;
+  gboolean        have_overlayfs;
   gboolean        run_tests;
   gboolean        no_shallow_clone;
   gboolean        opt_export_only;
@@ -116,14 +152,48 @@ builder_context_finalize (GObject *object)
 {
   BuilderContext *self = (BuilderContext *) object;
 
+  /* Whatever is left in the trash is removed on the next run */
+  if (self->reaper_thread)
+    {
+      g_cancellable_cancel (self->reaper_cancellable);
+      g_mutex_lock (&self->reaper_lock);
+      g_cond_signal (&self->reaper_cond);
+      g_mutex_unlock (&self->reaper_lock);
+      g_thread_join (self->reaper_thread);
+    }
+  g_clear_object (&self->reaper_cancellable);
+  g_mutex_clear (&self->reaper_lock);
+  g_cond_clear (&self->reaper_cond);
+  g_clear_object (&self->trash_dir);
+
   g_clear_object (&self->state_dir);
   g_clear_object (&self->download_dir);
   g_clear_object (&self->build_dir);
   g_clear_object (&self->cache_dir);
   g_clear_object (&self->checksums_dir);
+  g_clear_object (&self->build_sizes_dir);
+  g_clear_object (&self->failed_builds_dir);
+  g_clear_object (&self->license_files_dir);
+  if (self->tmpfs_build_dir)
+    (void) flatpak_rm_rf (self->tmpfs_build_dir, NULL, NULL);
+  g_clear_object (&self->tmpfs_build_dir);
+  g_clear_pointer (&self->tmpfs_reservations, g_hash_table_unref);
   g_clear_object (&self->rofiles_dir);
   g_clear_object (&self->ccache_dir);
+  glnx_close_fd (&self->jobserver_fd);
+  if (self->jobserver_dir)
+    (void) flatpak_rm_rf (self->jobserver_dir, NULL, NULL);
+  g_clear_object (&self->jobserver_dir);
   g_clear_object (&self->rofiles_allocated_dir);
+  if (self->overlay_pid > 0)
+    {
+      kill (self->overlay_pid, SIGKILL);
+      waitpid (self->overlay_pid, NULL, 0);
+    }
+  if (self->overlay_dir)
+    (void) flatpak_rm_rf (self->overlay_dir, NULL, NULL);
+  g_clear_object (&self->overlay_dir);
+  glnx_release_lock_file (&self->overlay_file_lock);
   g_clear_object (&self->app_dir);
   g_clear_object (&self->run_dir);
   g_clear_object (&self->base_dir);
@@ -213,8 +283,12 @@ builder_context_constructed (GObject *object)
   self->state_dir = g_file_resolve_relative_path (self->run_dir, self->state_subdir ? self->state_subdir : ".flatpak-builder");
   self->download_dir = g_file_get_child (self->state_dir, "downloads");
   self->build_dir = g_file_get_child (self->state_dir, "build");
+  self->trash_dir = g_file_get_child (self->build_dir, ".trash");
   self->cache_dir = g_file_get_child (self->state_dir, "cache");
   self->checksums_dir = g_file_get_child (self->state_dir, "checksums");
+  self->build_sizes_dir = g_file_get_child (self->state_dir, "build-sizes");
+  self->failed_builds_dir = g_file_get_child (self->state_dir, "failed-builds");
+  self->license_files_dir = g_file_get_child (self->state_dir, "license-files");
 
   // Check, if CCACHE_DIR is set in environment and use it, instead of subdir of state_dir
   const char * env_ccache_dir = g_getenv ("CCACHE_DIR");
@@ -269,8 +343,19 @@ builder_context_init (BuilderContext *self)
   g_autofree char *path = NULL;
 
   self->rofiles_file_lock = init;
+  self->overlay_file_lock = init;
+  self->jobserver_fd = -1;
+  self->tmpfs_reservations = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                    g_object_unref, g_free);
+  g_mutex_init (&self->reaper_lock);
+  g_cond_init (&self->reaper_cond);
   path = g_find_program_in_path ("rofiles-fuse");
   self->have_rofiles = path != NULL;
+  g_clear_pointer (&path, g_free);
+  /* The mount lives in a namespace of a child process, and only
+     commands started from here can join it */
+  path = g_find_program_in_path ("nsenter");
+  self->have_overlayfs = path != NULL && !flatpak_is_in_sandbox ();
 }
 
 GFile *
@@ -561,13 +646,45 @@ builder_context_set_checksum_for (BuilderContext  *self,
   return g_file_set_contents (flatpak_file_get_path_cached (checksum_file), checksum, -1, error);
 }
 
+static GFile *
+allocate_subdir_in (GFile       *parent,
+                    const char  *name,
+                    GError     **error)
+{
+  g_autoptr(GError) my_error = NULL;
+  int count;
+
+  for (count = 1; count < 1000; count++)
+    {
+      g_autofree char *buildname = NULL;
+      g_autoptr(GFile) subdir = NULL;
+
+      buildname = g_strdup_printf ("%s-%d", name, count);
+      subdir = g_file_get_child (parent, buildname);
+
+      if (g_file_make_directory (subdir, NULL, &my_error))
+        return g_steal_pointer (&subdir);
+      else
+        {
+          if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return NULL;
+            }
+          g_clear_error (&my_error);
+          /* Already exists, try again */
+        }
+    }
+
+  flatpak_fail (error, "Unable to allocate build dir for %s\n", name);
+  return NULL;
+}
+
 GFile *
 builder_context_allocate_build_subdir (BuilderContext *self,
                                        const char *name,
                                        GError **error)
 {
-  g_autoptr(GError) my_error = NULL;
-  int count;
   g_autoptr (GFile) cachedir_tag = g_file_get_child (self->state_dir, "CACHEDIR.TAG");
 
   if (!flatpak_mkdir_p (self->build_dir,
@@ -583,32 +700,374 @@ builder_context_allocate_build_subdir (BuilderContext *self,
                                 NULL, NULL, error))
     return NULL;
 
-  for (count = 1; count < 1000; count++)
+  return allocate_subdir_in (self->build_dir, name, error);
+}
+
+/* From linux/ioprio.h, which older kernel headers don't have */
+#define BUILDER_IOPRIO_WHO_PROCESS 1
+#define BUILDER_IOPRIO_CLASS_IDLE 3
+#define BUILDER_IOPRIO_CLASS_SHIFT 13
+
+/* Runs with idle priority, removing everything in the trash dir
+   whenever woken up by builder_context_empty_trash() */
+static gpointer
+reaper_thread (gpointer data)
+{
+  BuilderContext *self = data;
+  pid_t tid = syscall (SYS_gettid);
+
+  /* Both only affect this thread. The nice value only lowers the IO
+     priority with schedulers like BFQ, so the idle IO class is set too,
+     which keeps the unlinks from competing with the next module's IO. */
+  (void) setpriority (PRIO_PROCESS, tid, 19);
+  (void) syscall (SYS_ioprio_set, BUILDER_IOPRIO_WHO_PROCESS, tid,
+                  BUILDER_IOPRIO_CLASS_IDLE << BUILDER_IOPRIO_CLASS_SHIFT);
+
+  while (!g_cancellable_is_cancelled (self->reaper_cancellable))
     {
-      g_autofree char *buildname = NULL;
-      g_autoptr(GFile) subdir = NULL;
+      g_auto(GLnxDirFdIterator) iter = { 0 };
+      g_autoptr(GError) my_error = NULL;
+      struct dirent *dent;
 
-      buildname = g_strdup_printf ("%s-%d", name, count);
-      subdir = g_file_get_child (self->build_dir, buildname);
+      g_mutex_lock (&self->reaper_lock);
+      while (!self->reaper_pending &&
+             !g_cancellable_is_cancelled (self->reaper_cancellable))
+        g_cond_wait (&self->reaper_cond, &self->reaper_lock);
+      self->reaper_pending = FALSE;
+      g_mutex_unlock (&self->reaper_lock);
 
-      if (g_file_make_directory (subdir, NULL, &my_error))
-        return g_steal_pointer (&subdir);
-      else
+      if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (self->trash_dir),
+                                        FALSE, &iter, &my_error))
+        continue;
+
+      while (glnx_dirfd_iterator_next_dent (&iter, &dent, self->reaper_cancellable, &my_error) &&
+             dent != NULL)
         {
-          if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+          if (!glnx_shutil_rm_rf_at (iter.fd, dent->d_name, self->reaper_cancellable, &my_error))
             {
-              g_propagate_error (error, g_steal_pointer (&my_error));
-              return NULL;
+              if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                g_warning ("Failed to remove %s from %s: %s", dent->d_name,
+                           flatpak_file_get_path_cached (self->trash_dir), my_error->message);
+              g_clear_error (&my_error);
             }
-          g_clear_error (&my_error);
-          /* Already exists, try again */
         }
     }
 
-  flatpak_fail (error, "Unable to allocate build dir for %s\n", name);
   return NULL;
 }
 
+/* Starts removing the contents of the trash dir in the background.
+   Called at startup to finish what an earlier run left behind. */
+void
+builder_context_empty_trash (BuilderContext *self)
+{
+  if (self->reaper_thread == NULL)
+    {
+      if (!g_file_query_exists (self->trash_dir, NULL))
+        return;
+
+      self->reaper_cancellable = g_cancellable_new ();
+      self->reaper_thread = g_thread_new ("reaper", reaper_thread, self);
+    }
+
+  g_mutex_lock (&self->reaper_lock);
+  self->reaper_pending = TRUE;
+  g_cond_signal (&self->reaper_cond);
+  g_mutex_unlock (&self->reaper_lock);
+}
+
+/* Removes a build dir without waiting for it. It is renamed into the
+   trash dir, which is emptied by a background thread. Dirs on another
+   filesystem, like tmpfs build dirs, are removed right away. */
+gboolean
+builder_context_trash_build_subdir (BuilderContext *self,
+                                    GFile          *subdir,
+                                    GError        **error)
+{
+  g_autofree char *basename = g_file_get_basename (subdir);
+  g_autofree char *template = NULL;
+
+  if (!flatpak_mkdir_p (self->trash_dir, NULL, error))
+    return FALSE;
+
+  /* A unique name, as the same module can be built and trashed again
+     before the reaper gets to it. The rename replaces the empty dir. */
+  template = g_strdup_printf ("%s/%s-XXXXXX", flatpak_file_get_path_cached (self->trash_dir), basename);
+  if (g_mkdtemp (template) == NULL)
+    return glnx_throw_errno_prefix (error, "mkdtemp");
+
+  if (rename (flatpak_file_get_path_cached (subdir), template) != 0)
+    {
+      int errsv = errno;
+
+      (void) rmdir (template);
+      if (errsv != EXDEV)
+        return glnx_throw_errno_prefix (error, "rename %s", flatpak_file_get_path_cached (subdir));
+
+      return flatpak_rm_rf (subdir, NULL, error);
+    }
+
+  builder_context_empty_trash (self);
+
+  return TRUE;
+}
+
+/* Returns the directory holding tmpfs build dirs, creating it on
+   first use. This is below an existing tmpfs, as we can't mount one
+   without privileges. */
+static GFile *
+ensure_tmpfs_build_dir (BuilderContext *self)
+{
+  const char *candidates[] = { g_get_tmp_dir (), g_get_user_runtime_dir (), NULL };
+  int i;
+
+  if (self->tmpfs_build_dir != NULL)
+    return self->tmpfs_build_dir;
+
+  for (i = 0; candidates[i] != NULL; i++)
+    {
+      g_autofree char *template = NULL;
+      struct statfs stfs;
+
+      if (statfs (candidates[i], &stfs) != 0 || stfs.f_type != TMPFS_MAGIC)
+        continue;
+
+      template = g_build_filename (candidates[i], "flatpak-builder-XXXXXX", NULL);
+      if (g_mkdtemp (template) == NULL)
+        continue;
+
+      self->tmpfs_build_dir = g_file_new_for_path (template);
+      return self->tmpfs_build_dir;
+    }
+
+  g_warning ("No tmpfs found for --build-dir-tmpfs, building on disk");
+  self->build_dir_tmpfs_size = 0;
+  return NULL;
+}
+
+/* Like builder_context_allocate_build_subdir(), but puts the build dir
+   on tmpfs if the size it used last time fits in what is left of the
+   tmpfs budget. Modules we have no size for yet are built on disk. */
+GFile *
+builder_context_allocate_module_build_subdir (BuilderContext *self,
+                                              const char     *name,
+                                              GError        **error)
+{
+  g_autoptr(GFile) subdir = NULL;
+  GFile *tmpfs_dir;
+  struct statfs stfs;
+  guint64 estimate;
+
+  if (self->build_dir_tmpfs_size == 0 ||
+      !builder_context_get_build_size_for (self, name, &estimate))
+    return builder_context_allocate_build_subdir (self, name, error);
+
+  if (self->tmpfs_reserved + estimate > self->build_dir_tmpfs_size)
+    {
+      g_autofree char *size_str = g_format_size (estimate);
+      g_print ("Building %s on disk, it needs %s which exceeds the tmpfs budget\n", name, size_str);
+      return builder_context_allocate_build_subdir (self, name, error);
+    }
+
+  tmpfs_dir = ensure_tmpfs_build_dir (self);
+  if (tmpfs_dir == NULL)
+    return builder_context_allocate_build_subdir (self, name, error);
+
+  if (statfs (flatpak_file_get_path_cached (tmpfs_dir), &stfs) != 0 ||
+      (guint64) stfs.f_bavail * stfs.f_bsize < estimate)
+    {
+      g_print ("Building %s on disk, not enough free space on tmpfs\n", name);
+      return builder_context_allocate_build_subdir (self, name, error);
+    }
+
+  subdir = allocate_subdir_in (tmpfs_dir, name, error);
+  if (subdir == NULL)
+    return NULL;
+
+  self->tmpfs_reserved += estimate;
+  g_hash_table_insert (self->tmpfs_reservations, g_object_ref (subdir),
+                       g_memdup2 (&estimate, sizeof (estimate)));
+
+  return g_steal_pointer (&subdir);
+}
+
+gboolean
+builder_context_build_subdir_is_tmpfs (BuilderContext *self,
+                                       GFile          *subdir)
+{
+  return g_hash_table_contains (self->tmpfs_reservations, subdir);
+}
+
+/* Called when a build dir from builder_context_allocate_module_build_subdir()
+   is removed or moved away, returning its space to the tmpfs budget */
+void
+builder_context_release_build_subdir (BuilderContext *self,
+                                      GFile          *subdir)
+{
+  guint64 *reserved = g_hash_table_lookup (self->tmpfs_reservations, subdir);
+
+  if (reserved == NULL)
+    return;
+
+  self->tmpfs_reserved -= *reserved;
+  g_hash_table_remove (self->tmpfs_reservations, subdir);
+}
+
+gboolean
+builder_context_get_build_size_for (BuilderContext *self,
+                                    const char     *name,
+                                    guint64        *out_size)
+{
+  g_autofree char *size_name = g_strdup_printf ("%s-%s", builder_context_get_arch (self), name);
+  g_autoptr(GFile) size_file = g_file_get_child (self->build_sizes_dir, size_name);
+  g_autofree gchar *contents = NULL;
+
+  if (!g_file_get_contents (flatpak_file_get_path_cached (size_file), &contents, NULL, NULL))
+    return FALSE;
+
+  return g_ascii_string_to_unsigned (contents, 10, 0, G_MAXUINT64, out_size, NULL);
+}
+
+gboolean
+builder_context_set_build_size_for (BuilderContext  *self,
+                                    const char      *name,
+                                    guint64          size,
+                                    GError         **error)
+{
+  g_autofree char *size_name = g_strdup_printf ("%s-%s", builder_context_get_arch (self), name);
+  g_autoptr(GFile) size_file = g_file_get_child (self->build_sizes_dir, size_name);
+  g_autofree char *contents = g_strdup_printf ("%" G_GUINT64_FORMAT, size);
+
+  if (!flatpak_mkdir_p (self->build_sizes_dir,
+                        NULL, error))
+    return FALSE;
+
+  return g_file_set_contents (flatpak_file_get_path_cached (size_file), contents, -1, error);
+}
+
+/* Remembers the build dir of a module that failed to build, so that
+   a later build of the same stage can pick up where it stopped */
+gboolean
+builder_context_set_failed_build (BuilderContext  *self,
+                                  const char      *name,
+                                  const char      *checksum,
+                                  GFile           *build_subdir,
+                                  GError         **error)
+{
+  g_autofree char *failed_name = g_strdup_printf ("%s-%s", builder_context_get_arch (self), name);
+  g_autoptr(GFile) failed_file = g_file_get_child (self->failed_builds_dir, failed_name);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *basename = g_file_get_basename (build_subdir);
+  g_autoptr(GFile) parent = g_file_get_parent (build_subdir);
+
+  /* Only build dirs on disk survive until the next run */
+  if (parent == NULL || !g_file_equal (parent, self->build_dir))
+    return flatpak_fail (error, "Build dir %s is not in %s", flatpak_file_get_path_cached (build_subdir),
+                         flatpak_file_get_path_cached (self->build_dir));
+
+  g_key_file_set_string (keyfile, "Failed Build", "checksum", checksum);
+  g_key_file_set_string (keyfile, "Failed Build", "build-dir", basename);
+
+  if (!flatpak_mkdir_p (self->failed_builds_dir,
+                        NULL, error))
+    return FALSE;
+
+  return g_key_file_save_to_file (keyfile, flatpak_file_get_path_cached (failed_file), error);
+}
+
+/* Returns the build dir recorded by builder_context_set_failed_build()
+   if it was for the same stage checksum. Either way the record is gone
+   afterwards, as the build dir is then either reused or stale. */
+GFile *
+builder_context_take_failed_build (BuilderContext *self,
+                                   const char     *name,
+                                   const char     *checksum)
+{
+  g_autofree char *failed_name = g_strdup_printf ("%s-%s", builder_context_get_arch (self), name);
+  g_autoptr(GFile) failed_file = g_file_get_child (self->failed_builds_dir, failed_name);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *failed_checksum = NULL;
+  g_autofree char *basename = NULL;
+  g_autoptr(GFile) build_subdir = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, flatpak_file_get_path_cached (failed_file),
+                                  G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  (void) unlink (flatpak_file_get_path_cached (failed_file));
+
+  failed_checksum = g_key_file_get_string (keyfile, "Failed Build", "checksum", NULL);
+  basename = g_key_file_get_string (keyfile, "Failed Build", "build-dir", NULL);
+  if (g_strcmp0 (failed_checksum, checksum) != 0 ||
+      basename == NULL || strchr (basename, '/') != NULL ||
+      strcmp (basename, ".") == 0 || strcmp (basename, "..") == 0)
+    return NULL;
+
+  build_subdir = g_file_get_child (self->build_dir, basename);
+  if (g_file_query_file_type (build_subdir, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) != G_FILE_TYPE_DIRECTORY)
+    return NULL;
+
+  return g_steal_pointer (&build_subdir);
+}
+
+/* Returns the license files found by the last build of the module,
+   relative to the source dir, if that build had this checksum. Only
+   the last build is remembered, so this doesn't grow with every
+   build. */
+char **
+builder_context_get_license_files (BuilderContext *self,
+                                   const char     *name,
+                                   const char     *checksum)
+{
+  g_autoptr(GFile) license_file = g_file_get_child (self->license_files_dir, name);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *file_checksum = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, flatpak_file_get_path_cached (license_file),
+                                  G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  file_checksum = g_key_file_get_string (keyfile, "License Files", "checksum", NULL);
+  if (g_strcmp0 (file_checksum, checksum) != 0)
+    return NULL;
+
+  return g_key_file_get_string_list (keyfile, "License Files", "paths", NULL, NULL);
+}
+
+gboolean
+builder_context_set_license_files (BuilderContext     *self,
+                                   const char         *name,
+                                   const char         *checksum,
+                                   const char * const *paths,
+                                   GError            **error)
+{
+  g_autoptr(GFile) license_file = g_file_get_child (self->license_files_dir, name);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+
+  g_key_file_set_string (keyfile, "License Files", "checksum", checksum);
+  g_key_file_set_string_list (keyfile, "License Files", "paths",
+                              paths, g_strv_length ((char **) paths));
+
+  if (!flatpak_mkdir_p (self->license_files_dir,
+                        NULL, error))
+    return FALSE;
+
+  return g_key_file_save_to_file (keyfile, flatpak_file_get_path_cached (license_file), error);
+}
+
+void
+builder_context_set_build_dir_tmpfs_size (BuilderContext *self,
+                                          guint64         size)
+{
+  self->build_dir_tmpfs_size = size;
+}
+
+guint64
+builder_context_get_build_dir_tmpfs_size (BuilderContext *self)
+{
+  return self->build_dir_tmpfs_size;
+}
+
 GFile *
 builder_context_get_ccache_dir (BuilderContext *self)
 {
@@ -712,6 +1171,115 @@ builder_context_set_jobs (BuilderContext *self,
   self->jobs = jobs;
 }
 
+void
+builder_context_set_jobserver (BuilderContext *self,
+                               gboolean        use_jobserver)
+{
+  self->use_jobserver = use_jobserver;
+}
+
+gboolean
+builder_context_get_jobserver (BuilderContext *self)
+{
+  return self->use_jobserver;
+}
+
+/* The directory with the jobserver FIFO, once it has been created by
+   builder_context_refill_jobserver() */
+GFile *
+builder_context_get_jobserver_dir (BuilderContext *self)
+{
+  return self->jobserver_dir;
+}
+
+/* Creates a GNU make jobserver on first use, and otherwise sets the
+   number of tokens again, as tokens are lost when a build is killed
+   while holding some, and the jobs may differ between modules. Must
+   only be called when no build is running. Every client runs one job
+   without a token, so there is one token less than jobs. */
+gboolean
+builder_context_refill_jobserver (BuilderContext *self,
+                                  int             jobs,
+                                  GError        **error)
+{
+  int wanted = jobs - 1;
+  int available = 0;
+
+  if (self->jobserver_fd == -1)
+    {
+      g_autofree char *dir_path = NULL;
+      g_autofree char *fifo_path = NULL;
+
+      /* In the state dir rather than /tmp, as builds may run on the host */
+      if (!flatpak_mkdir_p (self->state_dir, NULL, error))
+        return FALSE;
+
+      dir_path = g_build_filename (flatpak_file_get_path_cached (self->state_dir),
+                                   "jobserver-XXXXXX", NULL);
+      if (g_mkdtemp (dir_path) == NULL)
+        return glnx_throw_errno_prefix (error, "Can't create jobserver dir");
+      self->jobserver_dir = g_file_new_for_path (dir_path);
+
+      fifo_path = g_build_filename (dir_path, "fifo", NULL);
+      if (mkfifo (fifo_path, 0600) != 0)
+        return glnx_throw_errno_prefix (error, "Can't create jobserver fifo");
+
+      /* Opened for writing too, so reads never see EOF between builds */
+      self->jobserver_fd = open (fifo_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      if (self->jobserver_fd == -1)
+        return glnx_throw_errno_prefix (error, "Can't open jobserver fifo");
+    }
+
+  if (ioctl (self->jobserver_fd, FIONREAD, &available) != 0)
+    return glnx_throw_errno_prefix (error, "Can't query jobserver fifo");
+
+  while (available < wanted)
+    {
+      char tokens[64];
+      int n = MIN (wanted - available, (int) sizeof (tokens));
+      gssize res;
+
+      memset (tokens, '+', n);
+      res = TEMP_FAILURE_RETRY (write (self->jobserver_fd, tokens, n));
+      if (res < 0)
+        return glnx_throw_errno_prefix (error, "Can't write to jobserver fifo");
+
+      available += res;
+    }
+
+  while (available > wanted)
+    {
+      char tokens[64];
+      int n = MIN (available - wanted, (int) sizeof (tokens));
+      gssize res;
+
+      res = TEMP_FAILURE_RETRY (read (self->jobserver_fd, tokens, n));
+      if (res < 0)
+        return glnx_throw_errno_prefix (error, "Can't read from jobserver fifo");
+
+      available -= res;
+    }
+
+  return TRUE;
+}
+
+/* What the build commands used since the last call to
+   builder_context_take_build_usage() */
+BuilderResourceUsage *
+builder_context_get_build_usage (BuilderContext *self)
+{
+  return &self->build_usage;
+}
+
+void
+builder_context_take_build_usage (BuilderContext       *self,
+                                  BuilderResourceUsage *out_usage)
+{
+  if (out_usage)
+    *out_usage = self->build_usage;
+  memset (&self->build_usage, 0, sizeof (self->build_usage));
+}
+
 void
 builder_context_set_keep_build_dirs (BuilderContext *self,
                                      gboolean        keep_build_dirs)
@@ -766,6 +1334,45 @@ builder_context_get_delete_build_dirs (BuilderContext *self)
   return self->delete_build_dirs;
 }
 
+void
+builder_context_set_extract_ahead (BuilderContext *self,
+                                   gboolean        extract_ahead)
+{
+  self->extract_ahead = extract_ahead;
+}
+
+gboolean
+builder_context_get_extract_ahead (BuilderContext *self)
+{
+  return self->extract_ahead;
+}
+
+void
+builder_context_set_resume_failed (BuilderContext *self,
+                                   gboolean        resume_failed)
+{
+  self->resume_failed = resume_failed;
+}
+
+gboolean
+builder_context_get_resume_failed (BuilderContext *self)
+{
+  return self->resume_failed;
+}
+
+void
+builder_context_set_batch_commands (BuilderContext *self,
+                                    gboolean        batch_commands)
+{
+  self->batch_commands = batch_commands;
+}
+
+gboolean
+builder_context_get_batch_commands (BuilderContext *self)
+{
+  return self->batch_commands;
+}
+
 void
 builder_context_set_sandboxed (BuilderContext *self,
                                gboolean        sandboxed)
@@ -888,6 +1495,421 @@ rofiles_child_setup (gpointer user_data)
     }
 }
 
+/* Only async-signal-safe calls, as this runs in a forked child */
+static gboolean
+overlay_write_file (const char *path,
+                    const char *contents)
+{
+  int fd = open (path, O_WRONLY | O_CLOEXEC);
+  ssize_t len = strlen (contents);
+  gboolean res;
+
+  if (fd < 0)
+    return FALSE;
+
+  res = write (fd, contents, len) == len;
+  close (fd);
+
+  return res;
+}
+
+/* Removes the overlay dirs left behind by builds that died, which
+   nothing holds the lock of anymore. Their changes never made it into
+   the app dir, so they are dropped. */
+static gboolean
+remove_stale_overlay_dirs (int      overlay_base_dfd,
+                           GError **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (overlay_base_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *lock_name = NULL;
+      g_auto(GLnxLockFile) lock = { 0, };
+      g_autoptr(GError) local_error = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!g_str_has_prefix (dent->d_name, "overlay-") ||
+          dent->d_type != DT_DIR)
+        continue;
+
+      lock_name = g_strconcat (dent->d_name, "-lock", NULL);
+      if (!glnx_make_lock_file (dfd_iter.fd, lock_name, LOCK_EX | LOCK_NB,
+                                &lock, &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            continue;
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      if (!glnx_shutil_rm_rf_at (dfd_iter.fd, dent->d_name, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Instead of passing every write through FUSE, the app dir is covered
+   by an overlayfs with a fresh upper dir. Unprivileged users can only
+   mount that in their own user namespace, so a child process sets one
+   up and keeps it alive. Everything else reaches the mount through
+   /proc/<pid>/root, and the sandbox enters the namespace, see
+   builder_context_add_build_wrapper(). */
+static gboolean
+enable_overlayfs (BuilderContext *self,
+                  GError        **error)
+{
+  g_autoptr(GFile) overlay_base = g_file_get_child (self->state_dir, "overlay");
+  const char *app_dir_path = flatpak_file_get_path_cached (self->app_dir);
+  glnx_autofd int overlay_base_dfd = -1;
+  glnx_autofd int overlay_dfd = -1;
+  g_autofree char *tmpdir_name = NULL;
+  g_autofree char *overlay_path = NULL;
+  g_autofree char *upper_path = NULL;
+  g_autofree char *work_path = NULL;
+  g_autofree char *options = NULL;
+  g_autofree char *uid_map = g_strdup_printf ("%d %d 1\n", getuid (), getuid ());
+  g_autofree char *gid_map = g_strdup_printf ("%d %d 1\n", getgid (), getgid ());
+  g_autofree char *mounted_path = NULL;
+  int child_errno = 0;
+  int pipefd[2];
+  ssize_t res;
+  pid_t child;
+
+  if (!flatpak_mkdir_p (overlay_base, NULL, error))
+    return FALSE;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (overlay_base),
+                       TRUE, &overlay_base_dfd, error))
+    return FALSE;
+
+  if (!remove_stale_overlay_dirs (overlay_base_dfd, error))
+    return FALSE;
+
+  /* The lock tells the next run that the dir is still in use */
+  if (!flatpak_allocate_tmpdir (overlay_base_dfd, NULL, "overlay-",
+                                &tmpdir_name, &overlay_dfd,
+                                &self->overlay_file_lock,
+                                NULL, NULL, error))
+    return FALSE;
+
+  overlay_path = g_build_filename (flatpak_file_get_path_cached (overlay_base), tmpdir_name, NULL);
+  upper_path = g_build_filename (overlay_path, "upper", NULL);
+  work_path = g_build_filename (overlay_path, "work", NULL);
+
+  /* Another run may have given up on it after we looked */
+  if (!glnx_shutil_rm_rf_at (overlay_dfd, "upper", NULL, error) ||
+      !glnx_shutil_rm_rf_at (overlay_dfd, "work", NULL, error))
+    return FALSE;
+
+  if (mkdirat (overlay_dfd, "upper", 0755) != 0 || mkdirat (overlay_dfd, "work", 0755) != 0)
+    return glnx_throw_errno_prefix (error, "Can't create overlayfs dirs in %s", overlay_path);
+
+  /* These are separators in the mount options */
+  if (strpbrk (app_dir_path, ",:\\") != NULL || strpbrk (overlay_path, ",:\\") != NULL)
+    return flatpak_fail (error, "Can't use overlayfs with paths containing ',', ':' or '\\'");
+
+  options = g_strdup_printf ("lowerdir=%s,upperdir=%s,workdir=%s,userxattr",
+                             app_dir_path, upper_path, work_path);
+
+  if (pipe2 (pipefd, O_CLOEXEC) != 0)
+    return glnx_throw_errno_prefix (error, "pipe");
+
+  child = fork ();
+  if (child == -1)
+    {
+      glnx_set_error_from_errno (error);
+      close (pipefd[0]);
+      close (pipefd[1]);
+      return FALSE;
+    }
+
+  if (child == 0)
+    {
+      /* In child */
+      prctl (PR_SET_PDEATHSIG, SIGKILL);
+      close (pipefd[0]);
+
+      if (unshare (CLONE_NEWUSER | CLONE_NEWNS) != 0 ||
+          !overlay_write_file ("/proc/self/setgroups", "deny") ||
+          !overlay_write_file ("/proc/self/uid_map", uid_map) ||
+          !overlay_write_file ("/proc/self/gid_map", gid_map) ||
+          mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+          mount ("overlay", app_dir_path, "overlay", 0, options) != 0)
+        child_errno = errno;
+
+      if (write (pipefd[1], &child_errno, sizeof child_errno) != sizeof child_errno ||
+          child_errno != 0)
+        _exit (1);
+      close (pipefd[1]);
+
+      while (TRUE)
+        pause ();
+
+      _exit (0);
+    }
+
+  close (pipefd[1]);
+  do
+    res = read (pipefd[0], &child_errno, sizeof child_errno);
+  while (res == -1 && errno == EINTR);
+  close (pipefd[0]);
+
+  if (res != sizeof child_errno || child_errno != 0)
+    {
+      kill (child, SIGKILL);
+      waitpid (child, NULL, 0);
+      (void) glnx_shutil_rm_rf_at (AT_FDCWD, overlay_path, NULL, NULL);
+      glnx_release_lock_file (&self->overlay_file_lock);
+
+      errno = res == sizeof child_errno ? child_errno : EIO;
+      return glnx_throw_errno_prefix (error, "Can't mount overlayfs over %s", app_dir_path);
+    }
+
+  mounted_path = g_strdup_printf ("/proc/%d/root%s", child, app_dir_path);
+
+  self->overlay_pid = child;
+  self->overlay_dir = g_file_new_for_path (overlay_path);
+  self->rofiles_dir = g_file_new_for_path (mounted_path);
+
+  return TRUE;
+}
+
+static gboolean
+overlay_dir_is_opaque (int         dfd,
+                       const char *name)
+{
+  glnx_autofd int fd = -1;
+  char value = 0;
+
+  fd = openat (dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  return fgetxattr (fd, "user.overlay.opaque", &value, 1) == 1 && value == 'y';
+}
+
+static gboolean
+remove_overlay_xattr (int                dfd,
+                      const char        *name,
+                      const char        *path,
+                      const struct stat *st,
+                      const char        *xattr,
+                      GError           **error)
+{
+  int res, errsv;
+
+  if (lremovexattr (path, xattr) == 0)
+    return TRUE;
+
+  /* User xattrs need write access, which the file might not give */
+  if (errno != EACCES || (st->st_mode & S_IWUSR) != 0 ||
+      fchmodat (dfd, name, (st->st_mode | S_IWUSR) & 07777, 0) != 0)
+    return glnx_throw_errno_prefix (error, "Can't remove %s from %s", xattr, name);
+
+  res = lremovexattr (path, xattr);
+  errsv = errno;
+  (void) fchmodat (dfd, name, st->st_mode & 07777, 0);
+  if (res != 0)
+    {
+      errno = errsv;
+      return glnx_throw_errno_prefix (error, "Can't remove %s from %s", xattr, name);
+    }
+
+  return TRUE;
+}
+
+/* Removes the user.overlay.* xattrs that overlayfs keeps its state in
+   (opaque, origin, redirect, impure, ...) from a file moved out of the
+   upper dir, and for directories from everything in them */
+static gboolean
+strip_overlay_xattrs (int         dfd,
+                      const char *name,
+                      GError    **error)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *xattrs = NULL;
+  struct stat st;
+  ssize_t size;
+  char *p;
+
+  if (!glnx_fstatat (dfd, name, &st, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+
+  /* User xattrs can only be set on files and dirs */
+  if (!S_ISREG (st.st_mode) && !S_ISDIR (st.st_mode))
+    return TRUE;
+
+  path = g_strdup_printf ("/proc/self/fd/%d/%s", dfd, name);
+
+  size = llistxattr (path, NULL, 0);
+  if (size < 0)
+    return glnx_throw_errno_prefix (error, "Can't list xattrs of %s", name);
+
+  if (size > 0)
+    {
+      xattrs = g_malloc (size);
+      size = llistxattr (path, xattrs, size);
+      if (size < 0)
+        return glnx_throw_errno_prefix (error, "Can't list xattrs of %s", name);
+
+      for (p = xattrs; p < xattrs + size; p += strlen (p) + 1)
+        {
+          if (g_str_has_prefix (p, "user.overlay.") &&
+              !remove_overlay_xattr (dfd, name, path, &st, p, error))
+            return FALSE;
+        }
+    }
+
+  if (S_ISDIR (st.st_mode))
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &dfd_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+            return FALSE;
+
+          if (dent == NULL)
+            break;
+
+          if (!strip_overlay_xattrs (dfd_iter.fd, dent->d_name, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Applies the changes recorded in an overlayfs upper dir to the dir
+   below it. Files are moved, so anything hardlinked into the cache is
+   replaced rather than modified. */
+static gboolean
+merge_overlay_upper (int      upper_dfd,
+                     int      dest_dfd,
+                     GError **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (upper_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat st;
+      struct stat dest_st;
+      gboolean dest_exists;
+      gboolean opaque = FALSE;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      dest_exists = fstatat (dest_dfd, dent->d_name, &dest_st, AT_SYMLINK_NOFOLLOW) == 0;
+
+      /* Whiteout, i.e. removed */
+      if (S_ISCHR (st.st_mode) && st.st_rdev == makedev (0, 0))
+        {
+          if (!glnx_shutil_rm_rf_at (dest_dfd, dent->d_name, NULL, error))
+            return FALSE;
+          continue;
+        }
+
+      if (S_ISDIR (st.st_mode))
+        {
+          opaque = overlay_dir_is_opaque (dfd_iter.fd, dent->d_name);
+
+          /* Copied up, so merge what changed below it */
+          if (!opaque && dest_exists && S_ISDIR (dest_st.st_mode))
+            {
+              glnx_autofd int sub_upper_dfd = -1;
+              glnx_autofd int sub_dest_dfd = -1;
+
+              if (!glnx_opendirat (dfd_iter.fd, dent->d_name, FALSE, &sub_upper_dfd, error) ||
+                  !glnx_opendirat (dest_dfd, dent->d_name, FALSE, &sub_dest_dfd, error))
+                return FALSE;
+
+              if (fchmod (sub_dest_dfd, st.st_mode & 07777) != 0)
+                return glnx_throw_errno_prefix (error, "fchmod %s", dent->d_name);
+
+              if (!merge_overlay_upper (sub_upper_dfd, sub_dest_dfd, error))
+                return FALSE;
+              continue;
+            }
+        }
+
+      /* New or replaced, the upper version is all there is */
+      if (dest_exists && (S_ISDIR (dest_st.st_mode) || opaque) &&
+          !glnx_shutil_rm_rf_at (dest_dfd, dent->d_name, NULL, error))
+        return FALSE;
+
+      if (!glnx_renameat (dfd_iter.fd, dent->d_name, dest_dfd, dent->d_name, error))
+        return FALSE;
+
+      if (!strip_overlay_xattrs (dest_dfd, dent->d_name, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+disable_overlayfs (BuilderContext *self,
+                   GError        **error)
+{
+  g_autoptr(GFile) overlay_dir = g_steal_pointer (&self->overlay_dir);
+  g_autoptr(GFile) upper_dir = g_file_get_child (overlay_dir, "upper");
+  glnx_autofd int upper_dfd = -1;
+  glnx_autofd int app_dfd = -1;
+
+  /* The mount goes away with the namespace */
+  kill (self->overlay_pid, SIGKILL);
+  while (waitpid (self->overlay_pid, NULL, 0) == -1 && errno == EINTR)
+    ;
+  self->overlay_pid = 0;
+
+  g_clear_object (&self->rofiles_dir);
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (upper_dir), FALSE, &upper_dfd, error) ||
+      !glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir), FALSE, &app_dfd, error))
+    return FALSE;
+
+  if (!merge_overlay_upper (upper_dfd, app_dfd, error))
+    {
+      g_prefix_error (error, "Failed to apply overlayfs changes to %s: ",
+                      flatpak_file_get_path_cached (self->app_dir));
+      return FALSE;
+    }
+
+  if (!flatpak_rm_rf (overlay_dir, NULL, error))
+    return FALSE;
+
+  glnx_release_lock_file (&self->overlay_file_lock);
+
+  return TRUE;
+}
+
 gboolean
 builder_context_enable_rofiles (BuilderContext *self,
                                 GError        **error)
@@ -915,14 +1937,17 @@ builder_context_enable_rofiles (BuilderContext *self,
   if (!self->use_rofiles)
     return TRUE;
 
+  g_assert (self->rofiles_dir == NULL);
+
+  if (self->use_overlayfs && self->have_overlayfs)
+    return enable_overlayfs (self, error);
+
   if (!self->have_rofiles)
     {
       g_warning ("rofiles-fuse not available, doing without");
       return TRUE;
     }
 
-  g_assert (self->rofiles_dir == NULL);
-
   if (self->rofiles_allocated_dir == NULL)
     {
       rofiles_base = g_file_get_child (self->state_dir, "rofiles");
@@ -1006,6 +2031,9 @@ builder_context_disable_rofiles (BuilderContext *self,
   if (!self->use_rofiles)
     return TRUE;
 
+  if (self->overlay_pid > 0)
+    return disable_overlayfs (self, error);
+
   if (!self->have_rofiles)
     return TRUE;
 
@@ -1042,6 +2070,33 @@ builder_context_set_use_rofiles (BuilderContext *self,
   self->use_rofiles = use_rofiles;
 }
 
+void
+builder_context_set_use_overlayfs (BuilderContext *self,
+                                   gboolean        use_overlayfs)
+{
+  self->use_overlayfs = use_overlayfs;
+
+  if (use_overlayfs && !self->have_overlayfs)
+    g_warning ("overlayfs protection needs nsenter on the host, using rofiles-fuse");
+}
+
+/* Commands that write to the app dir through flatpak build need to
+   run in the namespace the overlayfs is mounted in */
+void
+builder_context_add_build_wrapper (BuilderContext *self,
+                                   GPtrArray      *args)
+{
+  if (self->overlay_pid <= 0)
+    return;
+
+  g_ptr_array_add (args, g_strdup ("nsenter"));
+  g_ptr_array_add (args, g_strdup_printf ("--target=%d", self->overlay_pid));
+  g_ptr_array_add (args, g_strdup ("--user"));
+  g_ptr_array_add (args, g_strdup ("--mount"));
+  g_ptr_array_add (args, g_strdup ("--preserve-credentials"));
+  g_ptr_array_add (args, g_strdup ("--"));
+}
+
 gboolean
 builder_context_get_run_tests (BuilderContext *self)
 {
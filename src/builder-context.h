@@ -70,6 +70,43 @@ GFile *         builder_context_get_build_dir (BuilderContext *self);
 GFile *         builder_context_allocate_build_subdir (BuilderContext *self,
                                                        const char *name,
                                                        GError **error);
+GFile *         builder_context_allocate_module_build_subdir (BuilderContext *self,
+                                                              const char     *name,
+                                                              GError        **error);
+gboolean        builder_context_build_subdir_is_tmpfs (BuilderContext *self,
+                                                       GFile          *subdir);
+gboolean        builder_context_trash_build_subdir (BuilderContext *self,
+                                                    GFile          *subdir,
+                                                    GError        **error);
+void            builder_context_empty_trash (BuilderContext *self);
+void            builder_context_release_build_subdir (BuilderContext *self,
+                                                      GFile          *subdir);
+void            builder_context_set_build_dir_tmpfs_size (BuilderContext *self,
+                                                          guint64         size);
+guint64         builder_context_get_build_dir_tmpfs_size (BuilderContext *self);
+gboolean        builder_context_get_build_size_for (BuilderContext *self,
+                                                    const char     *name,
+                                                    guint64        *out_size);
+gboolean        builder_context_set_build_size_for (BuilderContext  *self,
+                                                    const char      *name,
+                                                    guint64          size,
+                                                    GError         **error);
+gboolean        builder_context_set_failed_build (BuilderContext  *self,
+                                                  const char      *name,
+                                                  const char      *checksum,
+                                                  GFile           *build_subdir,
+                                                  GError         **error);
+GFile *         builder_context_take_failed_build (BuilderContext *self,
+                                                   const char     *name,
+                                                   const char     *checksum);
+char **         builder_context_get_license_files (BuilderContext *self,
+                                                   const char     *name,
+                                                   const char     *checksum);
+gboolean        builder_context_set_license_files (BuilderContext     *self,
+                                                   const char         *name,
+                                                   const char         *checksum,
+                                                   const char * const *paths,
+                                                   GError            **error);
 GFile *         builder_context_get_ccache_dir (BuilderContext *self);
 GFile *         builder_context_get_download_dir (BuilderContext *self);
 GPtrArray *     builder_context_get_sources_dirs (BuilderContext *self);
@@ -108,12 +145,31 @@ void            builder_context_set_stop_at (BuilderContext *self,
 int             builder_context_get_jobs (BuilderContext *self);
 void            builder_context_set_jobs (BuilderContext *self,
                                           int n_jobs);
+void            builder_context_set_jobserver (BuilderContext *self,
+                                               gboolean        use_jobserver);
+gboolean        builder_context_get_jobserver (BuilderContext *self);
+GFile *         builder_context_get_jobserver_dir (BuilderContext *self);
+gboolean        builder_context_refill_jobserver (BuilderContext *self,
+                                                  int             jobs,
+                                                  GError        **error);
+BuilderResourceUsage *builder_context_get_build_usage (BuilderContext *self);
+void            builder_context_take_build_usage (BuilderContext       *self,
+                                                  BuilderResourceUsage *out_usage);
 void            builder_context_set_keep_build_dirs (BuilderContext *self,
                                                      gboolean        keep_build_dirs);
 gboolean        builder_context_get_delete_build_dirs (BuilderContext *self);
 void            builder_context_set_delete_build_dirs (BuilderContext *self,
                                                        gboolean        delete_build_dirs);
 gboolean        builder_context_get_keep_build_dirs (BuilderContext *self);
+void            builder_context_set_extract_ahead (BuilderContext *self,
+                                                   gboolean        extract_ahead);
+gboolean        builder_context_get_extract_ahead (BuilderContext *self);
+void            builder_context_set_resume_failed (BuilderContext *self,
+                                                   gboolean        resume_failed);
+gboolean        builder_context_get_resume_failed (BuilderContext *self);
+void            builder_context_set_batch_commands (BuilderContext *self,
+                                                    gboolean        batch_commands);
+gboolean        builder_context_get_batch_commands (BuilderContext *self);
 void            builder_context_set_sandboxed (BuilderContext *self,
                                                gboolean        sandboxed);
 gboolean        builder_context_ensure_file_sandboxed (BuilderContext *self,
@@ -168,6 +224,10 @@ gboolean        builder_context_get_rofiles_active (BuilderContext *self);
 gboolean        builder_context_get_use_rofiles (BuilderContext *self);
 void            builder_context_set_use_rofiles (BuilderContext *self,
                                                  gboolean use_rofiles);
+void            builder_context_set_use_overlayfs (BuilderContext *self,
+                                                   gboolean        use_overlayfs);
+void            builder_context_add_build_wrapper (BuilderContext *self,
+                                                   GPtrArray      *args);
 gboolean        builder_context_get_run_tests (BuilderContext *self);
 void            builder_context_set_run_tests (BuilderContext *self,
                                                gboolean run_tests);
@@ -0,0 +1,1124 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gio/gio.h>
+#include <ostree.h>
+#include "libglnx.h"
+
+#include "builder-flatpak-utils.h"
+#include "builder-utils.h"
+#include "builder-export.h"
+
+/* Exporting from the cache builds the exported commits out of the
+ * objects of the last cache commit, which are already checksummed.
+ * The commit is walked once for all refs, and unfiltered subtrees are
+ * reused as-is, so only directories that --exclude/--include patterns
+ * apply to, or that lead to the files of a ref, are walked at all. */
+
+typedef struct
+{
+  OstreeRepo *src;
+  OstreeRepo *dest;
+  GHashTable *imported;
+} ExportWalk;
+
+/* One exported ref while its tree is being built */
+typedef struct
+{
+  BuilderExportRef  *ref;
+  char              *files_path;
+  char              *id;
+  char              *full_ref;
+  char              *metadata_contents;
+  OstreeMutableTree *root;
+  OstreeMutableTree *files_mtree;
+} ExportTarget;
+
+BuilderExportRef *
+builder_export_ref_new (gboolean    runtime,
+                        const char *metadata,
+                        const char *files,
+                        const char *branch)
+{
+  BuilderExportRef *ref = g_new0 (BuilderExportRef, 1);
+
+  ref->runtime = runtime;
+  ref->metadata = g_strdup (metadata ? metadata : "metadata");
+  ref->files = g_strdup (files);
+  ref->branch = g_strdup (branch);
+  ref->excludes = g_ptr_array_new_with_free_func (g_free);
+  ref->includes = g_ptr_array_new_with_free_func (g_free);
+
+  return ref;
+}
+
+void
+builder_export_ref_free (BuilderExportRef *ref)
+{
+  g_free (ref->metadata);
+  g_free (ref->files);
+  g_free (ref->branch);
+  g_ptr_array_unref (ref->excludes);
+  g_ptr_array_unref (ref->includes);
+  g_free (ref);
+}
+
+void
+builder_export_ref_add_exclude (BuilderExportRef *ref,
+                                const char       *pattern)
+{
+  g_ptr_array_add (ref->excludes, g_strdup (pattern));
+}
+
+void
+builder_export_ref_add_include (BuilderExportRef *ref,
+                                const char       *pattern)
+{
+  g_ptr_array_add (ref->includes, g_strdup (pattern));
+}
+
+static gboolean
+import_object (ExportWalk       *walk,
+               OstreeObjectType  type,
+               const char       *checksum,
+               GError          **error)
+{
+  g_autofree char *key = ostree_object_to_string (checksum, type);
+  gboolean has_object;
+
+  if (g_hash_table_contains (walk->imported, key))
+    return TRUE;
+
+  if (!ostree_repo_has_object (walk->dest, type, checksum, &has_object, NULL, error))
+    return FALSE;
+
+  /* The cache repo is written by us, so we trust it and skip verifying
+     the checksums again */
+  if (!has_object &&
+      !ostree_repo_import_object_from_with_trust (walk->dest, walk->src, type, checksum,
+                                                  TRUE, NULL, error))
+    return FALSE;
+
+  g_hash_table_add (walk->imported, g_steal_pointer (&key));
+  return TRUE;
+}
+
+static gboolean
+import_dirtree (ExportWalk  *walk,
+                const char  *dirtree,
+                const char  *dirmeta,
+                GError     **error)
+{
+  g_autofree char *key = ostree_object_to_string (dirtree, OSTREE_OBJECT_TYPE_DIR_TREE);
+  g_autoptr(GVariant) tree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gboolean has_object;
+  gsize i;
+
+  if (!import_object (walk, OSTREE_OBJECT_TYPE_DIR_META, dirmeta, error))
+    return FALSE;
+
+  if (g_hash_table_contains (walk->imported, key))
+    return TRUE;
+
+  /* Trees are written after their children, so if we have the tree
+     we have everything below it */
+  if (!ostree_repo_has_object (walk->dest, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree,
+                               &has_object, NULL, error))
+    return FALSE;
+
+  if (!has_object)
+    {
+      if (!ostree_repo_load_variant (walk->src, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree,
+                                     &tree, error))
+        return FALSE;
+
+      files = g_variant_get_child_value (tree, 0);
+      for (i = 0; i < g_variant_n_children (files); i++)
+        {
+          g_autoptr(GVariant) csum_v = NULL;
+          g_autofree char *checksum = NULL;
+
+          g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+          checksum = ostree_checksum_from_bytes_v (csum_v);
+
+          if (!import_object (walk, OSTREE_OBJECT_TYPE_FILE, checksum, error))
+            return FALSE;
+        }
+
+      dirs = g_variant_get_child_value (tree, 1);
+      for (i = 0; i < g_variant_n_children (dirs); i++)
+        {
+          g_autoptr(GVariant) tree_csum_v = NULL;
+          g_autoptr(GVariant) meta_csum_v = NULL;
+          g_autofree char *tree_csum = NULL;
+          g_autofree char *meta_csum = NULL;
+
+          g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, &meta_csum_v);
+          tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+          meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+          if (!import_dirtree (walk, tree_csum, meta_csum, error))
+            return FALSE;
+        }
+
+      if (!import_object (walk, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree, error))
+        return FALSE;
+    }
+
+  g_hash_table_add (walk->imported, g_steal_pointer (&key));
+  return TRUE;
+}
+
+static gboolean
+matches_patterns (GPtrArray  *patterns,
+                  const char *path)
+{
+  guint i;
+
+  for (i = 0; i < patterns->len; i++)
+    {
+      if (flatpak_path_match_prefix (patterns->pdata[i], path) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Same rule as the flatpak build-export commit filter */
+static gboolean
+path_is_excluded (BuilderExportRef *ref,
+                  const char       *path)
+{
+  return matches_patterns (ref->excludes, path) &&
+    !matches_patterns (ref->includes, path);
+}
+
+/* Conservatively checks if an exclude pattern could match anything
+   below dir, by comparing the part of the pattern before the first
+   wildcard */
+static gboolean
+excludes_may_apply_below (BuilderExportRef *ref,
+                          const char       *dir)
+{
+  g_autofree char *dir_slash = NULL;
+  guint i;
+
+  while (*dir == '/')
+    dir++;
+  dir_slash = g_strconcat (dir, "/", NULL);
+
+  for (i = 0; i < ref->excludes->len; i++)
+    {
+      const char *pattern = ref->excludes->pdata[i];
+      gsize literal_len, len;
+
+      while (*pattern == '/')
+        pattern++;
+
+      literal_len = strcspn (pattern, "*?[\\");
+      if (*dir == 0)
+        return TRUE;
+
+      len = MIN (literal_len, strlen (dir_slash));
+      if (strncmp (pattern, dir_slash, len) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* TRUE if files_path is somewhere below the directory dir */
+static gboolean
+is_below (const char *files_path,
+          const char *dir)
+{
+  gsize len = strlen (dir);
+
+  return strncmp (files_path, dir, len) == 0 && files_path[len] == '/';
+}
+
+static void
+free_mtrees (OstreeMutableTree **mtrees,
+             guint               n_mtrees)
+{
+  guint i;
+
+  for (i = 0; i < n_mtrees; i++)
+    g_clear_object (&mtrees[i]);
+  g_free (mtrees);
+}
+
+/* Walks the cache commit once for all refs, sorting the files into
+   them. For each target, mtrees has the tree this directory goes to,
+   or NULL if it is not part of the files of that ref. Directories are
+   only loaded if some ref filters them or has its files below them. */
+static gboolean
+export_walk_dir (ExportWalk         *walk,
+                 GPtrArray          *targets,
+                 const char         *dirtree,
+                 const char         *dirmeta,
+                 const char         *path,
+                 OstreeMutableTree **mtrees,
+                 GError            **error)
+{
+  g_autofree gboolean *filtered = g_new0 (gboolean, targets->len);
+  g_autoptr(GVariant) tree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gboolean need_walk = FALSE;
+  guint t;
+  gsize i;
+
+  for (t = 0; t < targets->len; t++)
+    {
+      ExportTarget *target = targets->pdata[t];
+
+      if (mtrees[t] == NULL)
+        {
+          if (is_below (target->files_path, path))
+            need_walk = TRUE;
+          continue;
+        }
+
+      if (!excludes_may_apply_below (target->ref, path + strlen (target->files_path)))
+        {
+          if (!import_dirtree (walk, dirtree, dirmeta, error))
+            return FALSE;
+
+          if (!ostree_mutable_tree_fill_empty_from_dirtree (mtrees[t], walk->dest, dirtree, dirmeta))
+            return flatpak_fail (error, "Failed to export %s", path);
+
+          continue;
+        }
+
+      if (!import_object (walk, OSTREE_OBJECT_TYPE_DIR_META, dirmeta, error))
+        return FALSE;
+
+      ostree_mutable_tree_set_metadata_checksum (mtrees[t], dirmeta);
+      filtered[t] = TRUE;
+      need_walk = TRUE;
+    }
+
+  if (!need_walk)
+    return TRUE;
+
+  if (!ostree_repo_load_variant (walk->src, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree,
+                                 &tree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (tree, 0);
+  for (i = 0; i < g_variant_n_children (files); i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+
+      for (t = 0; t < targets->len; t++)
+        {
+          ExportTarget *target = targets->pdata[t];
+          g_autofree char *child_path = NULL;
+
+          if (!filtered[t])
+            continue;
+
+          child_path = g_strconcat (path + strlen (target->files_path), "/", name, NULL);
+          if (path_is_excluded (target->ref, child_path))
+            {
+              g_debug ("Excluding %s from %s", child_path, target->full_ref);
+              continue;
+            }
+
+          if (checksum == NULL)
+            {
+              checksum = ostree_checksum_from_bytes_v (csum_v);
+              if (!import_object (walk, OSTREE_OBJECT_TYPE_FILE, checksum, error))
+                return FALSE;
+            }
+
+          if (!ostree_mutable_tree_replace_file (mtrees[t], name, checksum, error))
+            return FALSE;
+        }
+    }
+
+  dirs = g_variant_get_child_value (tree, 1);
+  for (i = 0; i < g_variant_n_children (dirs); i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *tree_csum = NULL;
+      g_autofree char *meta_csum = NULL;
+      g_autofree char *child_path = NULL;
+      OstreeMutableTree **child_mtrees = NULL;
+      gboolean need_child = FALSE;
+      gboolean res;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      child_path = g_strconcat (path, "/", name, NULL);
+      child_mtrees = g_new0 (OstreeMutableTree *, targets->len);
+
+      for (t = 0; t < targets->len; t++)
+        {
+          ExportTarget *target = targets->pdata[t];
+
+          if (filtered[t])
+            {
+              const char *relpath = child_path + strlen (target->files_path);
+
+              if (path_is_excluded (target->ref, relpath))
+                {
+                  g_debug ("Excluding %s from %s", relpath, target->full_ref);
+                  continue;
+                }
+
+              if (!ostree_mutable_tree_ensure_dir (mtrees[t], name, &child_mtrees[t], error))
+                {
+                  free_mtrees (child_mtrees, targets->len);
+                  return FALSE;
+                }
+              need_child = TRUE;
+            }
+          else if (mtrees[t] == NULL)
+            {
+              if (strcmp (child_path, target->files_path) == 0)
+                {
+                  child_mtrees[t] = g_object_ref (target->files_mtree);
+                  need_child = TRUE;
+                }
+              else if (is_below (target->files_path, child_path))
+                need_child = TRUE;
+            }
+        }
+
+      res = TRUE;
+      if (need_child)
+        {
+          tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+          meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+          res = export_walk_dir (walk, targets, tree_csum, meta_csum, child_path, child_mtrees, error);
+        }
+
+      free_mtrees (child_mtrees, targets->len);
+      if (!res)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static GFile *
+resolve_in_commit (GFile       *root,
+                   const char  *relpath,
+                   GError     **error)
+{
+  g_auto(GStrv) elements = g_strsplit (relpath, "/", -1);
+  g_autoptr(GFile) file = g_object_ref (root);
+  int i;
+
+  for (i = 0; elements[i] != NULL; i++)
+    {
+      g_autoptr(GFile) child = NULL;
+
+      if (*elements[i] == 0)
+        continue;
+
+      child = g_file_get_child (file, elements[i]);
+      g_set_object (&file, child);
+    }
+
+  if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (file), error))
+    return NULL;
+
+  if (!g_file_query_exists (file, NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No %s in cached build", relpath);
+      return NULL;
+    }
+
+  return g_steal_pointer (&file);
+}
+
+static gboolean
+collect_sizes (ExportWalk  *walk,
+               const char  *dirtree,
+               GHashTable  *seen,
+               guint64     *installed_size,
+               guint64     *download_size,
+               GError     **error)
+{
+  g_autoptr(GVariant) tree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize i;
+
+  if (!ostree_repo_load_variant (walk->dest, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree,
+                                 &tree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (tree, 0);
+  for (i = 0; i < g_variant_n_children (files); i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+      guint64 file_size, storage_size;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (g_hash_table_contains (seen, checksum))
+        continue;
+
+      /* The cache repo stores files uncompressed, so the size of its
+         object is the installed size, and we don't have to open and
+         parse the compressed object in the export repo to get it */
+      if (!ostree_repo_query_object_storage_size (walk->src, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                                  &file_size, NULL, error))
+        return FALSE;
+
+      if (!ostree_repo_query_object_storage_size (walk->dest, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                                  &storage_size, NULL, error))
+        return FALSE;
+
+      *installed_size += file_size;
+      *download_size += storage_size;
+
+      g_hash_table_add (seen, g_steal_pointer (&checksum));
+    }
+
+  dirs = g_variant_get_child_value (tree, 1);
+  for (i = 0; i < g_variant_n_children (dirs); i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autofree char *tree_csum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, NULL);
+      tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+      if (!collect_sizes (walk, tree_csum, seen, installed_size, download_size, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+icon_is_exported (GFile      *dir,
+                  const char *icon)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+
+  dir_enum = g_file_enumerate_children (dir, "standard::name,standard::type",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, NULL);
+  while (dir_enum != NULL)
+    {
+      GFileInfo *info;
+      GFile *child;
+      const char *name;
+      const char *dot;
+
+      if (!g_file_enumerator_iterate (dir_enum, &info, &child, NULL, NULL) ||
+          info == NULL)
+        break;
+
+      name = g_file_info_get_name (info);
+
+      if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (icon_is_exported (child, icon))
+            return TRUE;
+          continue;
+        }
+
+      dot = strrchr (name, '.');
+      if (dot != NULL && strlen (icon) == dot - name &&
+          strncmp (name, icon, dot - name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Checks that the Exec line of an exported file runs something in the
+   app, as flatpak build-export does */
+static gboolean
+exec_binary_exists (GKeyFile   *keyfile,
+                    const char *group,
+                    GFile      *files_dir)
+{
+  g_autofree char *exec = g_key_file_get_string (keyfile, group, "Exec", NULL);
+  g_auto(GStrv) argv = NULL;
+  g_autoptr(GFile) bin = NULL;
+
+  if (exec == NULL || !g_shell_parse_argv (exec, NULL, &argv, NULL) || argv[0] == NULL)
+    return FALSE;
+
+  /* Absolute paths may point into the runtime */
+  if (g_path_is_absolute (argv[0]))
+    return TRUE;
+
+  bin = flatpak_build_file (files_dir, "bin", argv[0], NULL);
+  return g_file_query_exists (bin, NULL);
+}
+
+static gboolean
+validate_desktop_file (GFile      *desktop_file,
+                       GFile      *files_dir,
+                       GFile      *export_dir,
+                       GError    **error)
+{
+  g_autoptr(FlatpakTempDir) tmp_dir = NULL;
+  g_autoptr(GFile) tmp_file = NULL;
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GSubprocess) subp = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *basename = g_file_get_basename (desktop_file);
+  g_autofree char *tmp_path = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *output = NULL;
+  g_autofree char *icon = NULL;
+  gsize len;
+
+  if (!g_file_load_contents (desktop_file, NULL, &contents, &len, NULL, error))
+    return FALSE;
+
+  /* desktop-file-validate needs a file with the right name on disk */
+  tmp_path = g_dir_make_tmp ("flatpak-builder-export-XXXXXX", error);
+  if (tmp_path == NULL)
+    return FALSE;
+  tmp_dir = g_file_new_for_path (tmp_path);
+  tmp_file = g_file_get_child (tmp_dir, basename);
+
+  if (!g_file_replace_contents (tmp_file, contents, len, NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, error))
+    return FALSE;
+
+  subp = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE,
+                           &local_error,
+                           "desktop-file-validate",
+                           "--no-warn-deprecated",
+                           flatpak_file_get_path_cached (tmp_file),
+                           NULL);
+  if (subp == NULL)
+    {
+      if (!g_error_matches (local_error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_print ("desktop-file-validate not found, not validating %s\n", basename);
+    }
+  else
+    {
+      if (!g_subprocess_communicate_utf8 (subp, NULL, NULL, &output, NULL, error))
+        return FALSE;
+
+      if (!g_subprocess_get_successful (subp))
+        return flatpak_fail (error, "Validation of desktop file %s failed:\n%s",
+                             basename, output ? output : "");
+    }
+
+  if (!g_key_file_load_from_data (keyfile, contents, len, G_KEY_FILE_NONE, error))
+    {
+      g_prefix_error (error, "Invalid desktop file %s: ", basename);
+      return FALSE;
+    }
+
+  if (g_key_file_has_key (keyfile, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL) &&
+      !exec_binary_exists (keyfile, G_KEY_FILE_DESKTOP_GROUP, files_dir))
+    g_print ("Warning: Binary not found for Exec line in %s\n", basename);
+
+  icon = g_key_file_get_string (keyfile, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+  if (icon != NULL && !g_path_is_absolute (icon))
+    {
+      g_autoptr(GFile) icons_dir = flatpak_build_file (export_dir, "share", "icons", NULL);
+
+      if (!icon_is_exported (icons_dir, icon))
+        g_print ("Warning: Icon referenced in desktop file but not exported: %s\n", icon);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+validate_service_file (GFile      *service_file,
+                       GFile      *files_dir,
+                       const char *id,
+                       GError    **error)
+{
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *basename = g_file_get_basename (service_file);
+  g_autofree char *expected_name = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *name = NULL;
+  gsize len;
+
+  expected_name = g_strndup (basename, strlen (basename) - strlen (".service"));
+
+  if (!g_file_load_contents (service_file, NULL, &contents, &len, NULL, error))
+    return FALSE;
+
+  if (!g_key_file_load_from_data (keyfile, contents, len, G_KEY_FILE_NONE, error))
+    {
+      g_prefix_error (error, "Invalid service file %s: ", basename);
+      return FALSE;
+    }
+
+  name = g_key_file_get_string (keyfile, "D-BUS Service", "Name", error);
+  if (name == NULL)
+    {
+      g_prefix_error (error, "Invalid service file %s: ", basename);
+      return FALSE;
+    }
+
+  if (strcmp (name, expected_name) != 0)
+    return flatpak_fail (error, "Name in service file %s does not match the file name", basename);
+
+  if (!flatpak_has_name_prefix (name, id))
+    return flatpak_fail (error, "Service file %s does not start with %s", basename, id);
+
+  if (!exec_binary_exists (keyfile, "D-BUS Service", files_dir))
+    return flatpak_fail (error, "Binary not found for Exec line in %s", basename);
+
+  return TRUE;
+}
+
+static GPtrArray *
+list_files_with_suffix (GFile      *dir,
+                        const char *suffix,
+                        GError    **error)
+{
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  dir_enum = g_file_enumerate_children (dir, "standard::name,standard::type",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, &local_error);
+  if (dir_enum == NULL)
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_steal_pointer (&files);
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      GFile *child;
+
+      if (!g_file_enumerator_iterate (dir_enum, &info, &child, NULL, error))
+        return NULL;
+
+      if (info == NULL)
+        break;
+
+      if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+          g_str_has_suffix (g_file_info_get_name (info), suffix))
+        g_ptr_array_add (files, g_object_ref (child));
+    }
+
+  return g_steal_pointer (&files);
+}
+
+/* Exporting from the cache bypasses flatpak build-export, so this
+   does the same checks it does on the exported desktop and D-Bus
+   service files */
+static gboolean
+validate_exports (GFile      *export_dir,
+                  GFile      *files_dir,
+                  const char *id,
+                  GError    **error)
+{
+  g_autoptr(GFile) applications_dir = flatpak_build_file (export_dir, "share", "applications", NULL);
+  g_autoptr(GFile) services_dir = flatpak_build_file (export_dir, "share", "dbus-1", "services", NULL);
+  g_autoptr(GPtrArray) desktop_files = NULL;
+  g_autoptr(GPtrArray) service_files = NULL;
+  guint i;
+
+  desktop_files = list_files_with_suffix (applications_dir, ".desktop", error);
+  if (desktop_files == NULL)
+    return FALSE;
+
+  for (i = 0; i < desktop_files->len; i++)
+    {
+      if (!validate_desktop_file (desktop_files->pdata[i], files_dir, export_dir, error))
+        return FALSE;
+    }
+
+  service_files = list_files_with_suffix (services_dir, ".service", error);
+  if (service_files == NULL)
+    return FALSE;
+
+  for (i = 0; i < service_files->len; i++)
+    {
+      if (!validate_service_file (service_files->pdata[i], files_dir, id, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+export_target_free (ExportTarget *target)
+{
+  g_free (target->files_path);
+  g_free (target->id);
+  g_free (target->full_ref);
+  g_free (target->metadata_contents);
+  g_clear_object (&target->root);
+  g_clear_object (&target->files_mtree);
+  g_free (target);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ExportTarget, export_target_free)
+
+/* Sets up the tree of a ref with everything except its files, which
+   export_walk_dir adds later */
+static ExportTarget *
+prepare_export_target (ExportWalk                 *walk,
+                       GFile                      *src_root,
+                       const BuilderExportOptions *options,
+                       BuilderExportRef           *ref,
+                       GError                    **error)
+{
+  g_autoptr(ExportTarget) target = g_new0 (ExportTarget, 1);
+  g_autoptr(GFile) metadata_file = NULL;
+  g_autoptr(GFile) files_dir = NULL;
+  g_autoptr(GFile) export_dir = NULL;
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  const char *files_path;
+  const char *metadata_checksum;
+  gboolean is_runtime;
+  gsize metadata_size;
+  gsize len;
+
+  target->ref = ref;
+
+  metadata_file = resolve_in_commit (src_root, ref->metadata, error);
+  if (metadata_file == NULL)
+    return NULL;
+
+  if (!g_file_load_contents (metadata_file, NULL, &target->metadata_contents, &metadata_size, NULL, error))
+    return NULL;
+
+  if (!g_key_file_load_from_data (keyfile, target->metadata_contents, metadata_size, G_KEY_FILE_NONE, error))
+    {
+      g_prefix_error (error, "Invalid %s: ", ref->metadata);
+      return NULL;
+    }
+
+  is_runtime = ref->runtime || g_key_file_has_group (keyfile, "Runtime");
+
+  target->id = g_key_file_get_string (keyfile,
+                                      g_key_file_has_group (keyfile, "Runtime") ? "Runtime" : "Application",
+                                      "name", error);
+  if (target->id == NULL)
+    {
+      g_prefix_error (error, "Invalid %s: ", ref->metadata);
+      return NULL;
+    }
+
+  target->full_ref = flatpak_compose_ref (!is_runtime, target->id, ref->branch, options->arch);
+
+  target->root = ostree_mutable_tree_new ();
+
+  if (!import_object (walk, OSTREE_OBJECT_TYPE_DIR_META,
+                      ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (src_root)),
+                      error))
+    return NULL;
+  ostree_mutable_tree_set_metadata_checksum (target->root, ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (src_root)));
+
+  metadata_checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (metadata_file));
+  if (!import_object (walk, OSTREE_OBJECT_TYPE_FILE, metadata_checksum, error))
+    return NULL;
+
+  if (!ostree_mutable_tree_replace_file (target->root, "metadata", metadata_checksum, error))
+    return NULL;
+
+  files_path = ref->files ? ref->files : (is_runtime ? "usr" : "files");
+  files_dir = resolve_in_commit (src_root, files_path, error);
+  if (files_dir == NULL)
+    return NULL;
+
+  /* Normalized like the paths export_walk_dir walks, "/files/share" */
+  while (*files_path == '/')
+    files_path++;
+  target->files_path = g_strconcat ("/", files_path, NULL);
+  len = strlen (target->files_path);
+  while (len > 1 && target->files_path[len - 1] == '/')
+    target->files_path[--len] = 0;
+
+  if (!ostree_mutable_tree_ensure_dir (target->root, "files", &target->files_mtree, error))
+    return NULL;
+
+  if (!is_runtime)
+    {
+      export_dir = g_file_get_child (src_root, "export");
+      if (g_file_query_exists (export_dir, NULL))
+        {
+          g_autoptr(OstreeMutableTree) export_mtree = NULL;
+          const char *export_tree, *export_meta;
+
+          if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (export_dir), error))
+            return NULL;
+
+          if (!validate_exports (export_dir, files_dir, target->id, error))
+            return NULL;
+
+          export_tree = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (export_dir));
+          export_meta = ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (export_dir));
+
+          if (!import_dirtree (walk, export_tree, export_meta, error))
+            return NULL;
+
+          if (!ostree_mutable_tree_ensure_dir (target->root, "export", &export_mtree, error))
+            return NULL;
+
+          if (!ostree_mutable_tree_fill_empty_from_dirtree (export_mtree, walk->dest, export_tree, export_meta))
+            {
+              flatpak_fail (error, "Failed to export %s/export", target->full_ref);
+              return NULL;
+            }
+        }
+    }
+
+  return g_steal_pointer (&target);
+}
+
+static gboolean
+commit_export_target (ExportWalk                 *walk,
+                      const BuilderExportOptions *options,
+                      ExportTarget               *target,
+                      GError                    **error)
+{
+  g_autoptr(GFile) root_file = NULL;
+  g_autoptr(GVariantDict) metadata_dict = NULL;
+  g_autoptr(GVariant) commit_metadata = NULL;
+  g_autoptr(GHashTable) seen = NULL;
+  g_autofree char *parent = NULL;
+  g_autofree char *commit_checksum = NULL;
+  g_autofree char *default_subject = NULL;
+  const char *subject;
+  guint64 installed_size = 0;
+  guint64 download_size = 0;
+  int i;
+
+  if (!ostree_repo_write_mtree (walk->dest, target->root, &root_file, NULL, error))
+    return FALSE;
+
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (!collect_sizes (walk, ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root_file)),
+                      seen, &installed_size, &download_size, error))
+    return FALSE;
+
+  metadata_dict = g_variant_dict_new (NULL);
+  g_variant_dict_insert (metadata_dict, "xa.metadata", "s", target->metadata_contents);
+  g_variant_dict_insert_value (metadata_dict, "xa.installed-size",
+                               g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
+  g_variant_dict_insert_value (metadata_dict, "xa.download-size",
+                               g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+  g_variant_dict_insert_value (metadata_dict, "ostree.ref-binding",
+                               g_variant_new_strv ((const char * const *) &target->full_ref, 1));
+  if (options->collection_id != NULL)
+    g_variant_dict_insert_value (metadata_dict, "ostree.collection-binding",
+                                 g_variant_new_string (options->collection_id));
+  if (options->token_type >= 0)
+    g_variant_dict_insert_value (metadata_dict, "xa.token-type",
+                                 g_variant_new_int32 (GINT32_TO_LE (options->token_type)));
+  commit_metadata = g_variant_ref_sink (g_variant_dict_end (metadata_dict));
+
+  if (!ostree_repo_resolve_rev (walk->dest, target->full_ref, TRUE, &parent, error))
+    return FALSE;
+
+  subject = options->subject;
+  if (subject == NULL)
+    subject = default_subject = g_strdup_printf ("Export %s", target->id);
+
+  if (!ostree_repo_write_commit (walk->dest, parent, subject, options->body, commit_metadata,
+                                 OSTREE_REPO_FILE (root_file), &commit_checksum, NULL, error))
+    return FALSE;
+
+  for (i = 0; options->gpg_key_ids != NULL && options->gpg_key_ids[i] != NULL; i++)
+    {
+      if (!ostree_repo_sign_commit (walk->dest, commit_checksum, options->gpg_key_ids[i],
+                                    options->gpg_homedir, NULL, error))
+        return FALSE;
+    }
+
+  if (options->collection_id != NULL)
+    {
+      const OstreeCollectionRef collection_ref = { (char *) options->collection_id, target->full_ref };
+      ostree_repo_transaction_set_collection_ref (walk->dest, &collection_ref, commit_checksum);
+    }
+  else
+    ostree_repo_transaction_set_ref (walk->dest, NULL, target->full_ref, commit_checksum);
+
+  g_print ("Commit: %s\n", commit_checksum);
+
+  return TRUE;
+}
+
+static OstreeRepo *
+open_export_repo (GFile   *repo_dir,
+                  GError **error)
+{
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_dir);
+
+  if (!g_file_query_exists (repo_dir, NULL))
+    {
+      if (!ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, error))
+        return NULL;
+    }
+  else if (!ostree_repo_open (repo, NULL, error))
+    return NULL;
+
+  return g_steal_pointer (&repo);
+}
+
+static gboolean
+export_targets (ExportWalk                 *walk,
+                GFile                      *src_root,
+                const BuilderExportOptions *options,
+                GPtrArray                  *refs,
+                GError                    **error)
+{
+  g_autoptr(GPtrArray) targets = g_ptr_array_new_with_free_func ((GDestroyNotify) export_target_free);
+  g_autofree OstreeMutableTree **root_mtrees = NULL;
+  guint i;
+
+  for (i = 0; i < refs->len; i++)
+    {
+      ExportTarget *target = prepare_export_target (walk, src_root, options, refs->pdata[i], error);
+
+      if (target == NULL)
+        return FALSE;
+
+      g_ptr_array_add (targets, target);
+    }
+
+  /* The files of a ref are never the root of the commit, so nothing
+     is exported at the root itself */
+  root_mtrees = g_new0 (OstreeMutableTree *, targets->len);
+  if (!export_walk_dir (walk, targets,
+                        ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (src_root)),
+                        ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (src_root)),
+                        "", root_mtrees, error))
+    return FALSE;
+
+  for (i = 0; i < targets->len; i++)
+    {
+      if (!commit_export_target (walk, options, targets->pdata[i], error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* All refs are written in a single transaction from a single walk of
+   the cache commit, sharing the set of already imported objects, so
+   content shared between the refs (or between refs and earlier
+   exports) is only looked at once. */
+gboolean
+builder_export_from_cache (BuilderCache               *cache,
+                           GFile                      *repo_dir,
+                           const BuilderExportOptions *options,
+                           GPtrArray                  *refs,
+                           GError                    **error)
+{
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(GFile) src_root = NULL;
+  g_autoptr(GHashTable) imported = NULL;
+  const char *commit = builder_cache_get_last_commit (cache);
+  ExportWalk walk = { NULL };
+
+  if (commit == NULL)
+    return flatpak_fail (error, "No cached build to export");
+
+  repo = open_export_repo (repo_dir, error);
+  if (repo == NULL)
+    return FALSE;
+
+  if (!ostree_repo_read_commit (builder_cache_get_repo (cache), commit, &src_root, NULL, NULL, error))
+    return FALSE;
+
+  imported = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  walk.src = builder_cache_get_repo (cache);
+  walk.dest = repo;
+  walk.imported = imported;
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, NULL, error))
+    return FALSE;
+
+  if (!export_targets (&walk, src_root, options, refs, error))
+    {
+      if (!ostree_repo_abort_transaction (repo, NULL, NULL))
+        g_warning ("failed to abort transaction");
+      return FALSE;
+    }
+
+  if (!ostree_repo_commit_transaction (repo, NULL, NULL, error))
+    {
+      if (!ostree_repo_abort_transaction (repo, NULL, NULL))
+        g_warning ("failed to abort transaction");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Regenerates the appstream branch and summary, which flatpak
+   build-export --update-appstream does after each export */
+gboolean
+builder_export_update_repo (GFile                      *repo_dir,
+                            const BuilderExportOptions *options,
+                            GError                    **error)
+{
+  g_autoptr(GPtrArray) args = NULL;
+  int i;
+
+  args = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (args, g_strdup ("flatpak"));
+  g_ptr_array_add (args, g_strdup ("build-update-repo"));
+
+  if (options->gpg_homedir)
+    g_ptr_array_add (args, g_strdup_printf ("--gpg-homedir=%s", options->gpg_homedir));
+
+  for (i = 0; options->gpg_key_ids != NULL && options->gpg_key_ids[i] != NULL; i++)
+    g_ptr_array_add (args, g_strdup_printf ("--gpg-sign=%s", options->gpg_key_ids[i]));
+
+  if (options->collection_id)
+    g_ptr_array_add (args, g_strdup_printf ("--collection-id=%s", options->collection_id));
+
+  g_ptr_array_add (args, g_file_get_path (repo_dir));
+  g_ptr_array_add (args, NULL);
+
+  return flatpak_spawnv (NULL, NULL, G_SUBPROCESS_FLAGS_NONE, error,
+                         (const gchar * const *) args->pdata, NULL);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUILDER_EXPORT_H__
+#define __BUILDER_EXPORT_H__
+
+#include <gio/gio.h>
+
+#include "builder-cache.h"
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  const char  *arch;
+  const char  *subject;
+  const char  *body;
+  const char  *collection_id;
+  gint32       token_type;
+  const char **gpg_key_ids;
+  const char  *gpg_homedir;
+} BuilderExportOptions;
+
+/* Mirrors the arguments of flatpak build-export for one ref */
+typedef struct
+{
+  gboolean   runtime;
+  char      *metadata;
+  char      *files;
+  char      *branch;
+  GPtrArray *excludes;
+  GPtrArray *includes;
+} BuilderExportRef;
+
+BuilderExportRef *builder_export_ref_new (gboolean    runtime,
+                                          const char *metadata,
+                                          const char *files,
+                                          const char *branch);
+void              builder_export_ref_free (BuilderExportRef *ref);
+void              builder_export_ref_add_exclude (BuilderExportRef *ref,
+                                                  const char       *pattern);
+void              builder_export_ref_add_include (BuilderExportRef *ref,
+                                                  const char       *pattern);
+
+gboolean          builder_export_from_cache (BuilderCache               *cache,
+                                             GFile                      *repo_dir,
+                                             const BuilderExportOptions *options,
+                                             GPtrArray                  *refs,
+                                             GError                    **error);
+gboolean          builder_export_update_repo (GFile                      *repo_dir,
+                                              const BuilderExportOptions *options,
+                                              GError                    **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderExportRef, builder_export_ref_free)
+
+G_END_DECLS
+
+#endif /* __BUILDER_EXPORT_H__ */
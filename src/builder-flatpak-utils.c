@@ -603,7 +603,9 @@ flatpak_spawnv (GFile                *dir,
   if (subp == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  /* Use the thread-default context so that this can run on worker
+   * threads without iterating the main thread's context. */
+  loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
 
   data.loop = loop;
   data.refs = 1;
@@ -760,14 +762,112 @@ flatpak_file_is_in (GFile *file,
     g_file_has_prefix (canonical_file, canonical_toplevel);
 }
 
-gboolean
-flatpak_cp_a (GFile         *src,
-              GFile         *dest,
-              GFile         *keep_in_toplevel,
-              FlatpakCpFlags flags,
-              GPtrArray     *skip_files,
-              GCancellable  *cancellable,
-              GError       **error)
+/* Regular files are copied on a pool of threads, while the tree is
+   walked and the directories are created in order. */
+#define CP_MAX_THREADS 8
+
+typedef struct
+{
+  GThreadPool *pool;
+  GMutex       lock;
+  GError      *error;
+  gboolean     failed;
+} CpState;
+
+typedef struct
+{
+  GFile   *src;
+  GFile   *dest;
+  gboolean no_chown;
+} CpFileJob;
+
+/* Lets the kernel clone or copy the data (FICLONE, copy_file_range,
+   sendfile) and only falls back to read/write when it can't */
+static gboolean
+copy_regular_file (GFile   *src,
+                   GFile   *dest,
+                   GError **error)
+{
+  const char *src_path = flatpak_file_get_path_cached (src);
+  const char *dest_path = flatpak_file_get_path_cached (dest);
+  glnx_autofd int src_fd = -1;
+  glnx_autofd int dest_fd = -1;
+  struct stat stbuf;
+
+  if (!glnx_openat_rdonly (AT_FDCWD, src_path, FALSE, &src_fd, error))
+    return FALSE;
+
+  if (!glnx_fstat (src_fd, &stbuf, error))
+    return FALSE;
+
+  dest_fd = TEMP_FAILURE_RETRY (open (dest_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+                                      stbuf.st_mode & 07777));
+  if (dest_fd == -1)
+    return glnx_throw_errno_prefix (error, "open(%s)", dest_path);
+
+  if (glnx_regfile_copy_bytes (src_fd, dest_fd, (off_t) -1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying %s", src_path);
+
+  /* Like g_file_copy(), keep the permissions whatever the umask is */
+  if (fchmod (dest_fd, stbuf.st_mode & 07777) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod(%s)", dest_path);
+
+  return TRUE;
+}
+
+static void
+cp_file_job_free (CpFileJob *job)
+{
+  g_object_unref (job->src);
+  g_object_unref (job->dest);
+  g_free (job);
+}
+
+static void
+cp_file_job_run (gpointer data,
+                 gpointer user_data)
+{
+  CpFileJob *job = data;
+  CpState *state = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+  gboolean res;
+
+  g_mutex_lock (&state->lock);
+  failed = state->failed;
+  g_mutex_unlock (&state->lock);
+
+  if (!failed)
+    {
+      if (job->no_chown)
+        res = copy_regular_file (job->src, job->dest, &local_error);
+      else
+        res = g_file_copy (job->src, job->dest,
+                           G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                           NULL, NULL, NULL, &local_error);
+
+      if (!res)
+        {
+          g_mutex_lock (&state->lock);
+          state->failed = TRUE;
+          if (state->error == NULL)
+            state->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&state->lock);
+        }
+    }
+
+  cp_file_job_free (job);
+}
+
+static gboolean
+cp_a (GFile         *src,
+      GFile         *dest,
+      GFile         *keep_in_toplevel,
+      FlatpakCpFlags flags,
+      GPtrArray     *skip_files,
+      CpState       *state,
+      GCancellable  *cancellable,
+      GError       **error)
 {
   gboolean ret = FALSE;
   GFileEnumerator *enumerator = NULL;
@@ -867,10 +967,26 @@ flatpak_cp_a (GFile         *src,
         }
       else if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
         {
-          if (!flatpak_cp_a (src_child, dest_child, keep_in_toplevel, flags, skip_files,
-                             cancellable, error))
+          if (!cp_a (src_child, dest_child, keep_in_toplevel, flags, skip_files,
+                     state, cancellable, error))
             goto out;
         }
+      else if (state->pool != NULL &&
+               g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR)
+        {
+          CpFileJob *job = g_new0 (CpFileJob, 1);
+
+          (void) unlink (flatpak_file_get_path_cached (dest_child));
+
+          job->src = g_object_ref (src_child);
+          job->dest = g_object_ref (dest_child);
+          job->no_chown = no_chown;
+          if (!g_thread_pool_push (state->pool, job, error))
+            {
+              cp_file_job_free (job);
+              goto out;
+            }
+        }
       else
         {
           (void) unlink (flatpak_file_get_path_cached (dest_child));
@@ -914,6 +1030,62 @@ out:
   return ret;
 }
 
+gboolean
+flatpak_cp_a (GFile         *src,
+              GFile         *dest,
+              GFile         *keep_in_toplevel,
+              FlatpakCpFlags flags,
+              GPtrArray     *skip_files,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  CpState state = { NULL };
+  gboolean res;
+
+  g_mutex_init (&state.lock);
+
+  /* Moves are renames, and the source dirs are removed as we go */
+  if ((flags & FLATPAK_CP_FLAGS_MOVE) == 0)
+    {
+      state.pool = g_thread_pool_new (cp_file_job_run, &state,
+                                      MIN (g_get_num_processors (), CP_MAX_THREADS),
+                                      FALSE, error);
+      if (state.pool == NULL)
+        {
+          g_mutex_clear (&state.lock);
+          return FALSE;
+        }
+    }
+
+  res = cp_a (src, dest, keep_in_toplevel, flags, skip_files, &state, cancellable, error);
+
+  if (state.pool != NULL)
+    {
+      if (!res)
+        {
+          g_mutex_lock (&state.lock);
+          state.failed = TRUE;
+          g_mutex_unlock (&state.lock);
+        }
+
+      /* Waits for the queued copies */
+      g_thread_pool_free (state.pool, FALSE, TRUE);
+    }
+
+  if (state.error != NULL)
+    {
+      if (res)
+        g_propagate_error (error, g_steal_pointer (&state.error));
+      else
+        g_clear_error (&state.error);
+      res = FALSE;
+    }
+
+  g_mutex_clear (&state.lock);
+
+  return res;
+}
+
 gboolean
 flatpak_zero_mtime (int parent_dfd,
                     const char *rel_path,
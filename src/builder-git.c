@@ -736,6 +736,75 @@ builder_git_mirror_repo (const char     *repo_location,
   return TRUE;
 }
 
+/* Writes the objects of ref_object into a pack in mirror_dir, cutting
+   the history at commit the same way a fetch --depth 1 does. This
+   only reads what the ref needs, rather than having git fetch
+   negotiate and rewrite them. */
+static gboolean
+git_pack_ref_objects (GFile      *cache_mirror_dir,
+                      GFile      *mirror_dir,
+                      const char *ref_object,
+                      const char *commit,
+                      GError    **error)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GSubprocess) subp = NULL;
+  g_autoptr(GFile) pack_base = g_file_resolve_relative_path (mirror_dir, "objects/pack/pack");
+  g_autoptr(GFile) shallow = g_file_get_child (mirror_dir, "shallow");
+  g_autofree char *input = NULL;
+  g_autofree char *commit_contents = NULL;
+  g_autofree char *shallow_contents = NULL;
+  g_autofree char *new_contents = NULL;
+  g_auto(GStrv) shallow_commits = NULL;
+  g_autoptr(GError) my_error = NULL;
+
+  input = g_strdup_printf ("--shallow %s\n%s\n", commit, ref_object);
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                                        G_SUBPROCESS_FLAGS_STDOUT_SILENCE);
+  g_subprocess_launcher_set_cwd (launcher, flatpak_file_get_path_cached (cache_mirror_dir));
+  subp = g_subprocess_launcher_spawn (launcher, error,
+                                      "git", "pack-objects", "--revs", "-q",
+                                      flatpak_file_get_path_cached (pack_base), NULL);
+  if (subp == NULL)
+    return FALSE;
+
+  if (!g_subprocess_communicate_utf8 (subp, input, NULL, NULL, NULL, error))
+    return FALSE;
+
+  if (!g_subprocess_get_successful (subp))
+    return flatpak_fail (error, "Failed to pack %s", ref_object);
+
+  /* A root commit has no history to cut */
+  if (!git (cache_mirror_dir, &commit_contents, 0, error,
+            "cat-file", "commit", commit, NULL))
+    return FALSE;
+
+  if (strstr (commit_contents, "\nparent ") == NULL)
+    return TRUE;
+
+  if (!g_file_load_contents (shallow, NULL, &shallow_contents, NULL, NULL, &my_error))
+    {
+      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+      shallow_contents = g_strdup ("");
+    }
+
+  shallow_commits = g_strsplit (shallow_contents, "\n", -1);
+  if (g_strv_contains ((const char * const *) shallow_commits, commit))
+    return TRUE;
+
+  new_contents = g_strconcat (shallow_contents, commit, "\n", NULL);
+  if (!g_file_replace_contents (shallow, new_contents, strlen (new_contents),
+                                NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 /* In contrast with builder_git_mirror_repo this always does a shallow
    mirror. However, it only works for sources that are local, because
    it handles the case builder_git_mirror_repo fails at by creating refs
@@ -754,7 +823,9 @@ builder_git_shallow_mirror_ref (const char     *repo_location,
   g_autofree char *file_name = NULL;
   g_autofree char *destination_file_path = NULL;
   g_autofree char *full_ref = NULL;
-  g_autofree char *full_ref_colon_full_ref = NULL;
+  g_autofree char *ref_object = NULL;
+  g_autofree char *ref_commit = NULL;
+  g_autofree char *peeled_full_ref = NULL;
 
   cache_mirror_dir = git_get_mirror_dir (repo_location, context);
 
@@ -794,9 +865,24 @@ builder_git_shallow_mirror_ref (const char     *repo_location,
         return FALSE;
     }
 
-  full_ref_colon_full_ref = g_strdup_printf ("%s:%s", full_ref, full_ref);
+  if (!git (cache_mirror_dir, &ref_object, 0, error,
+            "rev-parse", full_ref, NULL))
+    return FALSE;
+  g_strchomp (ref_object);
+
+  peeled_full_ref = g_strdup_printf ("%s^{commit}", full_ref);
+  if (!git (cache_mirror_dir, &ref_commit, 0, error,
+            "rev-parse", peeled_full_ref, NULL))
+    return FALSE;
+  g_strchomp (ref_commit);
+
+  if (!git (mirror_dir, NULL, G_SUBPROCESS_FLAGS_STDERR_SILENCE, NULL,
+            "cat-file", "-e", ref_object, NULL) &&
+      !git_pack_ref_objects (cache_mirror_dir, mirror_dir, ref_object, ref_commit, error))
+    return FALSE;
+
   if (!git (mirror_dir, NULL, 0, error,
-            "fetch", "--depth", "1", "origin", full_ref_colon_full_ref, NULL))
+            "update-ref", full_ref, ref_object, NULL))
     return FALSE;
 
   if (!builder_git_run_lfs (mirror_dir, flags, error,
@@ -34,6 +34,7 @@
 #include "builder-manifest.h"
 #include "builder-utils.h"
 #include "builder-git.h"
+#include "builder-export.h"
 
 #define SOURCE_DATE_EPOCH_DISABLE   G_GINT64_CONSTANT (0)   /* Disable setting SOURCE_DATE_EPOCH entirely */
 #define SOURCE_DATE_EPOCH_DEFAULT   G_GINT64_CONSTANT (-1)  /* Default when --override-source-date-epoch is not passed */
@@ -44,21 +45,28 @@ static gboolean opt_run;
 static gboolean opt_disable_cache;
 static gboolean opt_disable_tests;
 static gboolean opt_disable_rofiles;
+static char *opt_protection_backend;
 static gboolean opt_download_only;
 static gboolean opt_no_shallow_clone;
 static gboolean opt_bundle_sources;
 static gboolean opt_build_only;
 static gboolean opt_finish_only;
 static gboolean opt_export_only;
+static gboolean opt_export_from_cache;
 static gboolean opt_show_deps;
 static gboolean opt_show_manifest;
 static gboolean opt_disable_download;
+static gboolean opt_download_while_building;
 static gboolean opt_disable_updates;
 static gboolean opt_ccache; /* deprecated, kept for compat */
 static gboolean opt_no_ccache;
 static gboolean opt_require_changes;
 static gboolean opt_keep_build_dirs;
 static gboolean opt_delete_build_dirs;
+static gboolean opt_extract_ahead;
+static gboolean opt_resume_failed;
+static gboolean opt_batch_commands;
+static char *opt_build_dir_tmpfs;
 static gboolean opt_force_clean;
 static gboolean opt_allow_missing_runtimes;
 static gboolean opt_sandboxed;
@@ -70,6 +78,7 @@ static char *opt_from_git;
 static char *opt_from_git_branch;
 static char *opt_stop_at;
 static char *opt_build_shell;
+static char *opt_watch;
 static char *opt_arch;
 static char *opt_default_branch;
 static char *opt_repo;
@@ -84,6 +93,8 @@ static char **opt_sources_urls;
 static char **opt_add_tags;
 static char **opt_remove_tags;
 static int opt_jobs;
+static gboolean opt_jobserver;
+static gboolean opt_report_resources;
 static char *opt_mirror_screenshots_url;
 static char **opt_install_deps_from;
 static gboolean opt_install_deps_only;
@@ -108,7 +119,9 @@ static GOptionEntry entries[] = {
   { "disable-cache", 0, 0, G_OPTION_ARG_NONE, &opt_disable_cache, "Disable cache lookups", NULL },
   { "disable-tests", 0, 0, G_OPTION_ARG_NONE, &opt_disable_tests, "Don't run tests", NULL },
   { "disable-rofiles-fuse", 0, 0, G_OPTION_ARG_NONE, &opt_disable_rofiles, "Disable rofiles-fuse use", NULL },
+  { "protection-backend", 0, 0, G_OPTION_ARG_STRING, &opt_protection_backend, "How to protect the cache from writes to the app dir (rofiles-fuse or overlayfs)", "BACKEND" },
   { "disable-download", 0, 0, G_OPTION_ARG_NONE, &opt_disable_download, "Don't download any new sources", NULL },
+  { "download-while-building", 0, 0, G_OPTION_ARG_NONE, &opt_download_while_building, "Download sources of later modules while building", NULL },
   { "disable-updates", 0, 0, G_OPTION_ARG_NONE, &opt_disable_updates, "Only download missing sources, never update to latest vcs version", NULL },
   { "download-only", 0, 0, G_OPTION_ARG_NONE, &opt_download_only, "Only download sources, don't build", NULL },
   { "bundle-sources", 0, 0, G_OPTION_ARG_NONE, &opt_bundle_sources, "Bundle module sources as runtime", NULL },
@@ -117,12 +130,17 @@ static GOptionEntry entries[] = {
   { "build-only", 0, 0, G_OPTION_ARG_NONE, &opt_build_only, "Stop after build, don't run clean and finish phases", NULL },
   { "finish-only", 0, 0, G_OPTION_ARG_NONE, &opt_finish_only, "Only run clean and finish and export phases", NULL },
   { "export-only", 0, 0, G_OPTION_ARG_NONE, &opt_export_only, "Only run export phase", NULL },
+  { "export-from-cache", 0, 0, G_OPTION_ARG_NONE, &opt_export_from_cache, "Export directly from the build cache", NULL },
   { "allow-missing-runtimes", 0, 0, G_OPTION_ARG_NONE, &opt_allow_missing_runtimes, "Don't fail if runtime and sdk missing", NULL },
   { "show-deps", 0, 0, G_OPTION_ARG_NONE, &opt_show_deps, "List the dependencies of the json file (see --show-deps --help)", NULL },
   { "show-manifest", 0, 0, G_OPTION_ARG_NONE, &opt_show_manifest, "Print out the manifest file in standard json format (see --show-manifest --help)", NULL },
   { "require-changes", 0, 0, G_OPTION_ARG_NONE, &opt_require_changes, "Don't create app dir or export if no changes", NULL },
   { "keep-build-dirs", 0, 0, G_OPTION_ARG_NONE, &opt_keep_build_dirs, "Don't remove build directories after install", NULL },
   { "delete-build-dirs", 0, 0, G_OPTION_ARG_NONE, &opt_delete_build_dirs, "Always remove build directories, even after build failure", NULL },
+  { "extract-ahead", 0, 0, G_OPTION_ARG_NONE, &opt_extract_ahead, "Extract the sources of the next module while building", NULL },
+  { "resume-failed", 0, 0, G_OPTION_ARG_NONE, &opt_resume_failed, "Continue a failed module build in its existing build directory", NULL },
+  { "batch-commands", 0, 0, G_OPTION_ARG_NONE, &opt_batch_commands, "Run the build-commands and post-install of a module in one sandbox each", NULL },
+  { "build-dir-tmpfs", 0, 0, G_OPTION_ARG_STRING, &opt_build_dir_tmpfs, "Build modules on tmpfs, using at most SIZE", "SIZE" },
   { "repo", 0, 0, G_OPTION_ARG_STRING, &opt_repo, "Repo to export into", "DIR"},
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, "One line subject (passed to build-export)", "SUBJECT" },
   { "body", 'b', 0, G_OPTION_ARG_STRING, &opt_body, "Full description (passed to build-export)", "BODY" },
@@ -134,9 +152,12 @@ static GOptionEntry entries[] = {
   { "sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_sandboxed, "Enforce sandboxing, disabling build-args", NULL },
   { "stop-at", 0, 0, G_OPTION_ARG_STRING, &opt_stop_at, "Stop building at this module (implies --build-only)", "MODULENAME"},
   { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, "Number of parallel jobs to build (default=NCPU)", "JOBS"},
+  { "jobserver", 0, 0, G_OPTION_ARG_NONE, &opt_jobserver, "Share the jobs between all build tools with a make jobserver", NULL},
+  { "report-resources", 0, 0, G_OPTION_ARG_NONE, &opt_report_resources, "Print the time, memory and I/O each module took to build", NULL},
   { "rebuild-on-sdk-change", 0, 0, G_OPTION_ARG_NONE, &opt_rebuild_on_sdk_change, "Rebuild if sdk changes", NULL },
   { "skip-if-unchanged", 0, 0, G_OPTION_ARG_NONE, &opt_skip_if_unchanged, "Don't do anything if the json didn't change", NULL },
   { "build-shell", 0, 0, G_OPTION_ARG_STRING, &opt_build_shell, "Extract and prepare sources for module, then start build shell", "MODULENAME"},
+  { "watch", 0, 0, G_OPTION_ARG_STRING, &opt_watch, "Build up to module, then rebuild it when its dir sources change (implies --build-only)", "MODULENAME"},
   { "from-git", 0, 0, G_OPTION_ARG_STRING, &opt_from_git, "Get input files from git repo", "URL"},
   { "from-git-branch", 0, 0, G_OPTION_ARG_STRING, &opt_from_git_branch, "Branch to use in --from-git", "BRANCH"},
   { "mirror-screenshots-url", 0, 0, G_OPTION_ARG_STRING, &opt_mirror_screenshots_url, "Download and rewrite screenshots to match this url", "URL"},
@@ -204,6 +225,86 @@ usage (GOptionContext *context, const char *message)
 
 static const char skip_arg[] = "skip";
 
+/* Set when --export-from-cache applies to this run. The refs are
+   queued by do_export and all written at once by flush_export_refs */
+static BuilderCache *export_cache = NULL;
+static GPtrArray *export_refs = NULL;
+
+/* Exporting from the cache only handles the arguments below, and
+   doesn't generate the extra data commit metadata, so anything else
+   goes through flatpak build-export */
+static gboolean
+can_export_from_cache (const gchar *directory,
+                       GPtrArray   *extra_args)
+{
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *metadata_path = NULL;
+  const char *metadata = "metadata";
+  guint i;
+
+  for (i = 0; i < extra_args->len; i++)
+    {
+      const char *arg = extra_args->pdata[i];
+
+      if (g_str_has_prefix (arg, "--metadata="))
+        metadata = arg + strlen ("--metadata=");
+      else if (!g_str_has_prefix (arg, "--files=") &&
+               !g_str_has_prefix (arg, "--exclude=") &&
+               !g_str_has_prefix (arg, "--include="))
+        {
+          g_print ("NOTE: %s is not supported with --export-from-cache, using flatpak build-export\n", arg);
+          return FALSE;
+        }
+    }
+
+  metadata_path = g_build_filename (directory, metadata, NULL);
+  if (g_key_file_load_from_file (keyfile, metadata_path, G_KEY_FILE_NONE, NULL) &&
+      g_key_file_has_group (keyfile, "Extra Data"))
+    {
+      g_print ("NOTE: %s has extra data, using flatpak build-export\n", metadata);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+queue_export_from_cache (gboolean     runtime,
+                         const gchar *branch,
+                         GPtrArray   *extra_args)
+{
+  BuilderExportRef *ref;
+  const char *metadata = NULL;
+  const char *files = NULL;
+  guint i;
+
+  for (i = 0; i < extra_args->len; i++)
+    {
+      const char *arg = extra_args->pdata[i];
+
+      if (g_str_has_prefix (arg, "--metadata="))
+        metadata = arg + strlen ("--metadata=");
+      else if (g_str_has_prefix (arg, "--files="))
+        files = arg + strlen ("--files=");
+    }
+
+  ref = builder_export_ref_new (runtime, metadata, files, branch);
+
+  for (i = 0; i < extra_args->len; i++)
+    {
+      const char *arg = extra_args->pdata[i];
+
+      if (g_str_has_prefix (arg, "--exclude="))
+        builder_export_ref_add_exclude (ref, arg + strlen ("--exclude="));
+      else if (g_str_has_prefix (arg, "--include="))
+        builder_export_ref_add_include (ref, arg + strlen ("--include="));
+    }
+
+  if (export_refs == NULL)
+    export_refs = g_ptr_array_new_with_free_func ((GDestroyNotify) builder_export_ref_free);
+  g_ptr_array_add (export_refs, ref);
+}
+
 static gboolean
 do_export (BuilderContext *build_context,
            GError        **error,
@@ -221,6 +322,27 @@ do_export (BuilderContext *build_context,
   int i;
 
   g_autoptr(GPtrArray) args = NULL;
+  g_autoptr(GPtrArray) extra_args = NULL;
+
+  /* Additional flags. */
+  extra_args = g_ptr_array_new_with_free_func (g_free);
+  va_start (ap, token_type);
+  while ((arg = va_arg (ap, const gchar *)))
+    if (arg != skip_arg)
+      g_ptr_array_add (extra_args, g_strdup ((gchar *) arg));
+  va_end (ap);
+
+  if (exclude_dirs)
+    {
+      for (i = 0; exclude_dirs[i] != NULL; i++)
+        g_ptr_array_add (extra_args, g_strdup_printf ("--exclude=/%s/*", exclude_dirs[i]));
+    }
+
+  if (export_cache != NULL && can_export_from_cache (directory, extra_args))
+    {
+      queue_export_from_cache (runtime, branch, extra_args);
+      return TRUE;
+    }
 
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
@@ -251,18 +373,8 @@ do_export (BuilderContext *build_context,
   if (token_type >= 0)
     g_ptr_array_add (args, g_strdup_printf ("--token-type=%d", token_type));
 
-  /* Additional flags. */
-  va_start (ap, token_type);
-  while ((arg = va_arg (ap, const gchar *)))
-    if (arg != skip_arg)
-      g_ptr_array_add (args, g_strdup ((gchar *) arg));
-  va_end (ap);
-
-  if (exclude_dirs)
-    {
-      for (i = 0; exclude_dirs[i] != NULL; i++)
-        g_ptr_array_add (args, g_strdup_printf ("--exclude=/%s/*", exclude_dirs[i]));
-    }
+  for (i = 0; i < extra_args->len; i++)
+    g_ptr_array_add (args, g_strdup (extra_args->pdata[i]));
 
   /* Mandatory positional arguments. */
   g_ptr_array_add (args, g_strdup (location));
@@ -349,6 +461,42 @@ out:
   return ret;
 }
 
+static gboolean
+flush_export_refs (BuilderContext *build_context,
+                   GFile          *export_repo,
+                   const char     *app_dir_path,
+                   const gchar    *collection_id,
+                   gint32          token_type,
+                   GError        **error)
+{
+  BuilderExportOptions options = { NULL };
+
+  options.arch = builder_context_get_arch (build_context);
+  options.subject = opt_subject;
+  options.body = opt_body;
+  options.collection_id = collection_id;
+  options.token_type = token_type;
+  options.gpg_key_ids = (const char **) opt_key_ids;
+  options.gpg_homedir = opt_gpg_homedir;
+
+  if (export_refs != NULL &&
+      !builder_export_from_cache (export_cache, export_repo, &options, export_refs, error))
+    return FALSE;
+
+  g_clear_pointer (&export_refs, g_ptr_array_unref);
+
+  /* Deferred until the repo exists */
+  if (opt_mirror_screenshots_url &&
+      !commit_screenshot_ref (flatpak_file_get_path_cached (export_repo),
+                              app_dir_path, options.arch, error))
+    {
+      g_prefix_error (error, "Failed to commit screenshot ref: ");
+      return FALSE;
+    }
+
+  return builder_export_update_repo (export_repo, &options, error);
+}
+
 static gboolean
 do_install (BuilderContext *build_context,
             const gchar    *repodir,
@@ -599,6 +747,14 @@ main (int    argc,
       return 1;
     }
 
+  if (opt_protection_backend != NULL &&
+      strcmp (opt_protection_backend, "rofiles-fuse") != 0 &&
+      strcmp (opt_protection_backend, "overlayfs") != 0)
+    {
+      g_printerr ("--protection-backend must be rofiles-fuse or overlayfs\n");
+      return 1;
+    }
+
   if (app_dir_path)
     app_dir = g_file_new_for_path (app_dir_path);
   cwd = g_get_current_dir ();
@@ -607,12 +763,32 @@ main (int    argc,
   build_context = builder_context_new (cwd_dir, app_dir, opt_state_dir);
 
   builder_context_set_use_rofiles (build_context, !opt_disable_rofiles);
+  builder_context_set_use_overlayfs (build_context, g_strcmp0 (opt_protection_backend, "overlayfs") == 0);
   builder_context_set_run_tests (build_context, !opt_disable_tests);
   builder_context_set_no_shallow_clone (build_context, opt_no_shallow_clone);
   builder_context_set_keep_build_dirs (build_context, opt_keep_build_dirs);
   builder_context_set_delete_build_dirs (build_context, opt_delete_build_dirs);
+  builder_context_set_extract_ahead (build_context, opt_extract_ahead);
+  builder_context_set_resume_failed (build_context, opt_resume_failed);
+  builder_context_set_batch_commands (build_context, opt_batch_commands);
+  builder_context_empty_trash (build_context);
+
+  if (opt_build_dir_tmpfs)
+    {
+      guint64 tmpfs_size;
+
+      if (!builder_parse_size (opt_build_dir_tmpfs, &tmpfs_size, &error))
+        {
+          g_printerr ("Invalid value for --build-dir-tmpfs: %s\n", error->message);
+          return 1;
+        }
+
+      builder_context_set_build_dir_tmpfs_size (build_context, tmpfs_size);
+    }
+
   builder_context_set_sandboxed (build_context, opt_sandboxed);
   builder_context_set_jobs (build_context, opt_jobs);
+  builder_context_set_jobserver (build_context, opt_jobserver);
   builder_context_set_rebuild_on_sdk_change (build_context, opt_rebuild_on_sdk_change);
   builder_context_set_bundle_sources (build_context, opt_bundle_sources);
   builder_context_set_opt_export_only (build_context, opt_export_only);
@@ -693,6 +869,9 @@ main (int    argc,
       builder_context_set_stop_at (build_context, opt_stop_at);
     }
 
+  if (opt_watch)
+    opt_build_only = TRUE;
+
   if (opt_from_git)
     {
       g_autofree char *manifest_dirname = g_path_get_dirname (manifest_rel_path);
@@ -820,6 +999,10 @@ main (int    argc,
   if (opt_run && !is_run)
     return usage (context, "Can't use --run after a non-option");
 
+  if (opt_watch &&
+      (opt_build_shell || opt_stop_at || opt_download_only || opt_finish_only || opt_export_only))
+    return usage (context, "Can't use --watch with --build-shell, --stop-at, --download-only, --finish-only or --export-only");
+
   if (is_show_deps)
     {
       if (!builder_manifest_show_deps (manifest, build_context, &error))
@@ -972,11 +1155,21 @@ main (int    argc,
 
   if (!opt_finish_only &&
       !opt_export_only &&
-      !opt_disable_download &&
-      !builder_manifest_download (manifest, !opt_disable_updates, opt_build_shell, build_context, &error))
+      !opt_disable_download)
     {
-      g_printerr ("Failed to download sources: %s\n", error->message);
-      return 1;
+      if (opt_download_while_building && !opt_download_only && !opt_build_shell)
+        {
+          if (!builder_manifest_start_download (manifest, !opt_disable_updates, build_context, &error))
+            {
+              g_printerr ("Failed to download sources: %s\n", error->message);
+              return 1;
+            }
+        }
+      else if (!builder_manifest_download (manifest, !opt_disable_updates, opt_build_shell, build_context, &error))
+        {
+          g_printerr ("Failed to download sources: %s\n", error->message);
+          return 1;
+        }
     }
 
   if (opt_download_only)
@@ -1041,11 +1234,25 @@ main (int    argc,
             }
         }
 
+      if (opt_watch)
+        {
+          if (!builder_manifest_watch (manifest, cache, build_context, opt_watch, &error))
+            {
+              g_printerr ("Error: %s\n", error->message);
+              return 1;
+            }
+
+          return 0;
+        }
+
       if (!builder_manifest_build (manifest, cache, build_context, &error))
         {
           g_printerr ("Error: %s\n", error->message);
           return 1;
         }
+
+      if (opt_report_resources)
+        builder_manifest_report_resources (manifest, cache);
     }
 
   if (!opt_build_only && !opt_export_only)
@@ -1102,6 +1309,13 @@ main (int    argc,
       if (opt_body == NULL)
         opt_body = get_default_build_body (manifest_sha256);
 
+      /* In --export-only mode the app dir may not match the cache */
+      if (opt_export_from_cache && !opt_export_only &&
+          builder_cache_get_last_commit (cache) != NULL)
+        export_cache = cache;
+      else if (opt_export_from_cache)
+        g_printerr ("NOTE: No cached build to export, ignoring --export-from-cache\n");
+
       if (!do_export (build_context, &error,
                       FALSE,
                       flatpak_file_get_path_cached (export_repo),
@@ -1117,7 +1331,7 @@ main (int    argc,
           return 1;
         }
 
-      if (opt_mirror_screenshots_url &&
+      if (opt_mirror_screenshots_url && export_cache == NULL &&
           !commit_screenshot_ref (flatpak_file_get_path_cached (export_repo),
                                   app_dir_path,
                                   builder_context_get_arch (build_context),
@@ -1295,6 +1509,16 @@ main (int    argc,
               return 1;
             }
         }
+
+      if (export_cache != NULL &&
+          !flush_export_refs (build_context, export_repo, app_dir_path,
+                              builder_manifest_get_collection_id (manifest),
+                              builder_manifest_get_token_type (manifest),
+                              &error))
+        {
+          g_printerr ("Export failed: %s\n", error->message);
+          return 1;
+        }
     }
 
   if (opt_install)
@@ -56,6 +56,25 @@ builder_manifest_get_demarshal_base_dir (void)
   return g_object_ref (demarshal_base_dir);
 }
 
+/* Downloads module sources on a separate thread while the build runs,
+   see builder_manifest_start_download() */
+typedef struct
+{
+  GThread        *thread;
+  GMutex          lock;
+  GCond           cond;
+  GList          *modules;
+  BuilderContext *context;
+  gboolean        update_vcs;
+  GHashTable     *downloaded;
+  BuilderModule  *failed_module;
+  GError         *error;
+  gboolean        finished;
+  gboolean        cancelled;
+} BuilderManifestFetcher;
+
+static void builder_manifest_stop_download (BuilderManifest *self);
+
 struct BuilderManifest
 {
   GObject         parent;
@@ -113,6 +132,8 @@ struct BuilderManifest
   GList          *add_extensions;
   GList          *add_build_extensions;
   gint64          source_date_epoch;
+
+  BuilderManifestFetcher *fetcher;
 };
 
 typedef struct
@@ -186,6 +207,8 @@ builder_manifest_finalize (GObject *object)
 {
   BuilderManifest *self = (BuilderManifest *) object;
 
+  builder_manifest_stop_download (self);
+
   g_free (self->id);
   g_free (self->id_platform);
   g_free (self->branch);
@@ -1642,6 +1665,22 @@ add_installation_args (GPtrArray *args,
     g_ptr_array_add (args, g_strdup ("--system"));
 }
 
+/* Successful flatpak info results, keyed by the command line. These
+   don't change during a run unless we install or update something,
+   which calls flatpak_info_cache_clear() */
+static GHashTable *flatpak_info_cache = NULL;
+
+/* Deploy directories from flatpak info --show-location, keyed by
+   "id/arch/branch" */
+static GHashTable *flatpak_location_cache = NULL;
+
+static void
+flatpak_info_cache_clear (void)
+{
+  g_clear_pointer (&flatpak_info_cache, g_hash_table_unref);
+  g_clear_pointer (&flatpak_location_cache, g_hash_table_unref);
+}
+
 static char *
 flatpak_info (gboolean opt_user,
               const char *opt_installation,
@@ -1651,7 +1690,9 @@ flatpak_info (gboolean opt_user,
 {
   gboolean res;
   g_autofree char *output = NULL;
+  g_autofree char *key = NULL;
   g_autoptr(GPtrArray) args = NULL;
+  const char *cached;
 
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
@@ -1662,11 +1703,21 @@ flatpak_info (gboolean opt_user,
   g_ptr_array_add (args, g_strdup (ref));
   g_ptr_array_add (args, NULL);
 
+  key = g_strjoinv (" ", (char **) args->pdata);
+  if (flatpak_info_cache != NULL &&
+      (cached = g_hash_table_lookup (flatpak_info_cache, key)) != NULL)
+    return g_strdup (cached);
+
   res = builder_maybe_host_spawnv (NULL, &output, G_SUBPROCESS_FLAGS_STDERR_SILENCE, error, (const char * const *)args->pdata, NULL);
 
   if (res)
     {
       g_strchomp (output);
+
+      if (flatpak_info_cache == NULL)
+        flatpak_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_hash_table_insert (flatpak_info_cache, g_steal_pointer (&key), g_strdup (output));
+
       return g_steal_pointer (&output);
     }
   return NULL;
@@ -1679,6 +1730,14 @@ flatpak_info_show_path (const char *id,
 {
   g_autofree char *output = NULL;
   g_autofree char *arch_option = NULL;
+  g_autofree char *key = NULL;
+  const char *cached;
+
+  key = g_strdup_printf ("%s/%s/%s", id, builder_context_get_arch (context),
+                         branch ? branch : "");
+  if (flatpak_location_cache != NULL &&
+      (cached = g_hash_table_lookup (flatpak_location_cache, key)) != NULL)
+    return g_strdup (cached);
 
   arch_option = g_strdup_printf ("--arch=%s", builder_context_get_arch (context));
 
@@ -1687,9 +1746,58 @@ flatpak_info_show_path (const char *id,
     return NULL;
 
   g_strchomp (output);
+
+  if (flatpak_location_cache == NULL)
+    flatpak_location_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_hash_table_insert (flatpak_location_cache, g_steal_pointer (&key), g_strdup (output));
+
   return g_steal_pointer (&output);
 }
 
+/* The deploy directory of a ref is named after the deployed commit, so
+   we can get that from the (cached) location without running flatpak
+   again */
+static char *
+flatpak_info_show_commit (const char *id,
+                          const char *branch,
+                          BuilderContext  *context)
+{
+  g_autofree char *location = flatpak_info_show_path (id, branch, context);
+  g_autofree char *arch_option = NULL;
+
+  if (location != NULL)
+    {
+      g_autofree char *commit = g_path_get_basename (location);
+
+      if (ostree_validate_checksum_string (commit, NULL))
+        return g_steal_pointer (&commit);
+    }
+
+  arch_option = g_strdup_printf ("--arch=%s", builder_context_get_arch (context));
+  return flatpak (NULL, "info", arch_option, "--show-commit", id, branch, NULL);
+}
+
+static char *
+flatpak_info_show_metadata (const char *id,
+                            const char *branch,
+                            BuilderContext  *context)
+{
+  g_autofree char *location = flatpak_info_show_path (id, branch, context);
+  g_autofree char *arch_option = NULL;
+
+  if (location != NULL)
+    {
+      g_autofree char *metadata_path = g_build_filename (location, "metadata", NULL);
+      g_autofree char *metadata = NULL;
+
+      if (g_file_get_contents (metadata_path, &metadata, NULL, NULL))
+        return g_steal_pointer (&metadata);
+    }
+
+  arch_option = g_strdup_printf ("--arch=%s", builder_context_get_arch (context));
+  return flatpak (NULL, "info", arch_option, "--show-metadata", id, branch, NULL);
+}
+
 gboolean
 builder_manifest_start (BuilderManifest *self,
                         gboolean download_only,
@@ -1697,7 +1805,6 @@ builder_manifest_start (BuilderManifest *self,
                         BuilderContext  *context,
                         GError         **error)
 {
-  g_autofree char *arch_option = NULL;
   g_autoptr(GHashTable) names = g_hash_table_new (g_str_hash, g_str_equal);
   const char *stop_at;
 
@@ -1710,10 +1817,8 @@ builder_manifest_start (BuilderManifest *self,
       return FALSE;
     }
 
-  arch_option = g_strdup_printf ("--arch=%s", builder_context_get_arch (context));
-
-  self->sdk_commit = flatpak (NULL, "info", arch_option, "--show-commit", self->sdk,
-                              builder_manifest_get_runtime_version (self), NULL);
+  self->sdk_commit = flatpak_info_show_commit (self->sdk, builder_manifest_get_runtime_version (self),
+                                              context);
   if (!download_only && !allow_missing_runtimes && self->sdk_commit == NULL)
     return flatpak_fail (error, "Unable to find sdk %s version %s",
                          self->sdk,
@@ -1731,8 +1836,8 @@ builder_manifest_start (BuilderManifest *self,
       !builder_context_load_sdk_config (context, self->sdk_path, error))
     return FALSE;
 
-  self->runtime_commit = flatpak (NULL, "info", arch_option, "--show-commit", self->runtime,
-                                  builder_manifest_get_runtime_version (self), NULL);
+  self->runtime_commit = flatpak_info_show_commit (self->runtime, builder_manifest_get_runtime_version (self),
+                                                  context);
   if (!download_only && !allow_missing_runtimes && self->runtime_commit == NULL)
     return flatpak_fail (error, "Unable to find runtime %s version %s",
                          self->runtime,
@@ -1746,8 +1851,8 @@ builder_manifest_start (BuilderManifest *self,
 
   if (self->base != NULL && *self->base != 0)
     {
-      self->base_commit = flatpak (NULL, "info", arch_option, "--show-commit", self->base,
-                                   builder_manifest_get_base_version (self), NULL);
+      self->base_commit = flatpak_info_show_commit (self->base, builder_manifest_get_base_version (self),
+                                                    context);
       if (!download_only && self->base_commit == NULL)
         return flatpak_fail (error, "Unable to find app %s version %s",
                              self->base, builder_manifest_get_base_version (self));
@@ -2081,6 +2186,177 @@ builder_manifest_download (BuilderManifest *self,
   return TRUE;
 }
 
+static gpointer
+fetcher_thread (gpointer data)
+{
+  BuilderManifestFetcher *fetcher = data;
+  const char *stop_at = builder_context_get_stop_at (fetcher->context);
+  g_autoptr(GMainContext) main_context = g_main_context_new ();
+  GList *l;
+
+  /* The spawn helpers run a main loop on the thread-default context,
+   * keep that private so we don't dispatch the main thread's sources. */
+  g_main_context_push_thread_default (main_context);
+
+  for (l = fetcher->modules; l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+      g_autoptr(GError) local_error = NULL;
+      gboolean res;
+
+      if (stop_at != NULL && strcmp (name, stop_at) == 0)
+        break;
+
+      g_mutex_lock (&fetcher->lock);
+      if (fetcher->cancelled)
+        {
+          g_mutex_unlock (&fetcher->lock);
+          break;
+        }
+      g_mutex_unlock (&fetcher->lock);
+
+      res = builder_module_download_sources (m, fetcher->update_vcs, fetcher->context, &local_error);
+
+      g_mutex_lock (&fetcher->lock);
+      if (res)
+        g_hash_table_add (fetcher->downloaded, m);
+      else
+        {
+          fetcher->failed_module = m;
+          fetcher->error = g_steal_pointer (&local_error);
+        }
+      g_cond_broadcast (&fetcher->cond);
+      g_mutex_unlock (&fetcher->lock);
+
+      if (!res)
+        break;
+    }
+
+  g_mutex_lock (&fetcher->lock);
+  fetcher->finished = TRUE;
+  g_cond_broadcast (&fetcher->cond);
+  g_mutex_unlock (&fetcher->lock);
+
+  g_main_context_pop_thread_default (main_context);
+
+  return NULL;
+}
+
+/* Starts downloading the sources of all modules, in order, on a
+ * separate thread. builder_manifest_build() then waits for the sources
+ * of each module before building it, so downloads of later modules
+ * overlap with the build of earlier ones. */
+gboolean
+builder_manifest_start_download (BuilderManifest *self,
+                                 gboolean         update_vcs,
+                                 BuilderContext  *context,
+                                 GError         **error)
+{
+  BuilderManifestFetcher *fetcher;
+
+  g_return_val_if_fail (self->fetcher == NULL, FALSE);
+
+  fetcher = g_new0 (BuilderManifestFetcher, 1);
+  g_mutex_init (&fetcher->lock);
+  g_cond_init (&fetcher->cond);
+  fetcher->modules = g_list_copy_deep (self->expanded_modules, (GCopyFunc) g_object_ref, NULL);
+  fetcher->context = g_object_ref (context);
+  fetcher->update_vcs = update_vcs;
+  fetcher->downloaded = g_hash_table_new (NULL, NULL);
+
+  g_print ("Downloading sources in the background\n");
+
+  fetcher->thread = g_thread_try_new ("fetcher", fetcher_thread, fetcher, error);
+  if (fetcher->thread == NULL)
+    {
+      fetcher->finished = TRUE;
+      self->fetcher = fetcher;
+      builder_manifest_stop_download (self);
+      return FALSE;
+    }
+
+  self->fetcher = fetcher;
+  return TRUE;
+}
+
+static gboolean
+builder_manifest_wait_for_sources (BuilderManifest *self,
+                                   BuilderModule   *module,
+                                   GError         **error)
+{
+  BuilderManifestFetcher *fetcher = self->fetcher;
+  gboolean res = TRUE;
+
+  if (fetcher == NULL)
+    return TRUE;
+
+  g_mutex_lock (&fetcher->lock);
+  if (!fetcher->finished && !g_hash_table_contains (fetcher->downloaded, module))
+    g_print ("Waiting for sources of %s\n", builder_module_get_name (module));
+
+  while (!fetcher->finished && !g_hash_table_contains (fetcher->downloaded, module))
+    g_cond_wait (&fetcher->cond, &fetcher->lock);
+
+  /* Report the download error before the module that needed it */
+  if (!g_hash_table_contains (fetcher->downloaded, module) &&
+      fetcher->error != NULL)
+    {
+      g_propagate_prefixed_error (error, g_error_copy (fetcher->error),
+                                  "Failed to download sources for %s: ",
+                                  builder_module_get_name (fetcher->failed_module));
+      res = FALSE;
+    }
+  g_mutex_unlock (&fetcher->lock);
+
+  return res;
+}
+
+/* Like builder_manifest_wait_for_sources(), but doesn't block */
+static gboolean
+builder_manifest_sources_ready (BuilderManifest *self,
+                                BuilderModule   *module)
+{
+  BuilderManifestFetcher *fetcher = self->fetcher;
+  gboolean res;
+
+  if (fetcher == NULL)
+    return TRUE;
+
+  g_mutex_lock (&fetcher->lock);
+  res = g_hash_table_contains (fetcher->downloaded, module);
+  g_mutex_unlock (&fetcher->lock);
+
+  return res;
+}
+
+static void
+builder_manifest_stop_download (BuilderManifest *self)
+{
+  BuilderManifestFetcher *fetcher = self->fetcher;
+
+  if (fetcher == NULL)
+    return;
+
+  self->fetcher = NULL;
+
+  g_mutex_lock (&fetcher->lock);
+  fetcher->cancelled = TRUE;
+  g_mutex_unlock (&fetcher->lock);
+
+  /* The module currently being downloaded is finished first */
+  if (fetcher->thread)
+    g_thread_join (fetcher->thread);
+
+  g_list_free_full (fetcher->modules, g_object_unref);
+  g_object_unref (fetcher->context);
+  g_hash_table_unref (fetcher->downloaded);
+  g_clear_error (&fetcher->error);
+  g_mutex_clear (&fetcher->lock);
+  g_cond_clear (&fetcher->cond);
+  g_free (fetcher);
+}
+
 static gboolean
 setup_context (BuilderManifest *self,
                BuilderContext  *context,
@@ -2101,14 +2377,33 @@ setup_context (BuilderManifest *self,
   return TRUE;
 }
 
+static BuilderModule *
+builder_manifest_find_module (BuilderManifest *self,
+                              const char      *modulename,
+                              GError         **error)
+{
+  GList *l;
+
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+
+      if (strcmp (name, modulename) == 0)
+        return m;
+    }
+
+  flatpak_fail (error, "Can't find module %s", modulename);
+  return NULL;
+}
+
 gboolean
 builder_manifest_build_shell (BuilderManifest *self,
                               BuilderContext  *context,
                               const char      *modulename,
                               GError         **error)
 {
-  GList *l;
-  BuilderModule *found = NULL;
+  BuilderModule *found;
 
   if (!builder_context_enable_rofiles (context, error))
     return FALSE;
@@ -2116,32 +2411,57 @@ builder_manifest_build_shell (BuilderManifest *self,
   if (!setup_context (self, context, error))
     return FALSE;
 
-  for (l = self->expanded_modules; l != NULL; l = l->next)
+  found = builder_manifest_find_module (self, modulename, error);
+  if (found == NULL)
+    return FALSE;
+
+  if (!builder_module_build (found, self->id, NULL, context, TRUE, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Starts extracting the sources of the module built after the current
+ * one. This is only called on a cache miss, as the cache is not used
+ * after the first miss, so every later module is going to be built. */
+static void
+builder_manifest_extract_ahead (BuilderManifest *self,
+                                GList           *next,
+                                BuilderContext  *context)
+{
+  const char *stop_at = builder_context_get_stop_at (context);
+  g_autoptr(GError) my_error = NULL;
+  GList *l;
+
+  for (l = next; l != NULL; l = l->next)
     {
       BuilderModule *m = l->data;
       const char *name = builder_module_get_name (m);
 
-      if (strcmp (name, modulename) == 0)
-        {
-          found = m;
-          break;
-        }
-    }
+      if (stop_at != NULL && strcmp (name, stop_at) == 0)
+        return;
 
-  if (found == NULL)
-    return flatpak_fail (error, "Can't find module %s", modulename);
+      if (!builder_module_should_build (m))
+        continue;
 
-  if (!builder_module_build (found, self->id, NULL, context, TRUE, error))
-    return FALSE;
+      /* Only the build itself waits for downloads */
+      if (!builder_manifest_sources_ready (self, m))
+        return;
 
-  return TRUE;
+      if (!builder_module_start_extract_sources (m, context, &my_error))
+        g_warning ("Failed to extract sources of %s in the background: %s", name, my_error->message);
+
+      return;
+    }
 }
 
-gboolean
-builder_manifest_build (BuilderManifest *self,
-                        BuilderCache    *cache,
-                        BuilderContext  *context,
-                        GError         **error)
+/* Builds all modules, or up to and including last if it is set */
+static gboolean
+builder_manifest_build_modules (BuilderManifest *self,
+                                BuilderCache    *cache,
+                                BuilderContext  *context,
+                                BuilderModule   *last,
+                                GError         **error)
 {
   const char *stop_at = builder_context_get_stop_at (context);
   GList *l;
@@ -2153,7 +2473,7 @@ builder_manifest_build (BuilderManifest *self,
   for (l = self->expanded_modules; l != NULL; l = l->next)
     {
       BuilderModule *m = l->data;
-      g_autoptr(GPtrArray) changes = NULL;
+      g_autoptr(BuilderPathTable) changes = NULL;
       const char *name = builder_module_get_name (m);
 
       g_autofree char *stage = g_strdup_printf ("build-%s", name);
@@ -2170,6 +2490,12 @@ builder_manifest_build (BuilderManifest *self,
           continue;
         }
 
+      if (!builder_manifest_wait_for_sources (self, m, error))
+        return FALSE;
+
+      /* The checksum runs git on the mirrors the extraction uses */
+      builder_module_wait_extract_sources (m);
+
       builder_module_checksum (m, cache, context);
 
       if (!builder_cache_lookup (cache, stage))
@@ -2180,6 +2506,8 @@ builder_manifest_build (BuilderManifest *self,
             return FALSE;
           if (!builder_context_enable_rofiles (context, error))
             return FALSE;
+          if (builder_context_get_extract_ahead (context) && m != last)
+            builder_manifest_extract_ahead (self, l->next, context);
           if (!builder_module_build (m, self->id, cache, context, FALSE, error))
             return FALSE;
           if (!builder_context_disable_rofiles (context, error))
@@ -2199,22 +2527,181 @@ builder_manifest_build (BuilderManifest *self,
       builder_module_set_changes (m, changes);
 
       builder_module_update (m, context, error);
+
+      if (m == last)
+        return TRUE;
     }
 
   return TRUE;
 }
 
+gboolean
+builder_manifest_build (BuilderManifest *self,
+                        BuilderCache    *cache,
+                        BuilderContext  *context,
+                        GError         **error)
+{
+  gboolean res;
+  GList *l;
+
+  res = builder_manifest_build_modules (self, cache, context, NULL, error);
+  builder_manifest_stop_download (self);
+
+  /* Roll back sources extracted ahead for a module we didn't get to */
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    builder_module_discard_extracted_sources (l->data);
+
+  return res;
+}
+
+static char *
+format_usecs (guint64 usecs)
+{
+  return g_strdup_printf ("%.1fs", (double) usecs / G_USEC_PER_SEC);
+}
+
+static void
+print_resource_usage (const char                 *name,
+                      const BuilderResourceUsage *usage)
+{
+  g_autofree char *wall = format_usecs (usage->wall_time);
+  g_autofree char *user = format_usecs (usage->user_time);
+  g_autofree char *system = format_usecs (usage->system_time);
+  g_autofree char *max_rss = g_format_size (usage->max_rss);
+  g_autofree char *bytes_read = g_format_size (usage->bytes_read);
+  g_autofree char *bytes_written = g_format_size (usage->bytes_written);
+
+  g_print ("%-30s %10s %10s %10s %10s %10s %10s\n",
+           name, wall, user, system, max_rss, bytes_read, bytes_written);
+}
+
+/* Prints what each module cost the last time it was built, as stored
+ * in the cache, so cache hits report the numbers of the original build */
+void
+builder_manifest_report_resources (BuilderManifest *self,
+                                   BuilderCache    *cache)
+{
+  BuilderResourceUsage total = { 0 };
+  GList *l;
+
+  g_print ("%-30s %10s %10s %10s %10s %10s %10s\n",
+           "Module", "Wall", "User", "System", "Max RSS", "Read", "Written");
+
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+      g_autofree char *stage = g_strdup_printf ("build-%s", name);
+      BuilderResourceUsage usage;
+
+      if (!builder_module_should_build (m))
+        continue;
+
+      if (!builder_cache_get_stage_usage (cache, stage, &usage))
+        {
+          g_print ("%-30s %10s %10s %10s %10s %10s %10s\n",
+                   name, "-", "-", "-", "-", "-", "-");
+          continue;
+        }
+
+      print_resource_usage (name, &usage);
+
+      total.wall_time += usage.wall_time;
+      total.user_time += usage.user_time;
+      total.system_time += usage.system_time;
+      total.max_rss = MAX (total.max_rss, usage.max_rss);
+      total.bytes_read += usage.bytes_read;
+      total.bytes_written += usage.bytes_written;
+    }
+
+  print_resource_usage ("Total", &total);
+}
+
+/* Builds up to and including the module, and then keeps rebuilding
+ * it whenever its dir sources change, committing the result in place
+ * of its stage. The modules after it are not built. This only returns
+ * on errors outside of the rebuilds. */
+gboolean
+builder_manifest_watch (BuilderManifest *self,
+                        BuilderCache    *cache,
+                        BuilderContext  *context,
+                        const char      *modulename,
+                        GError         **error)
+{
+  g_autoptr(BuilderWatch) watch = builder_watch_new ();
+  BuilderModule *found;
+  gboolean res;
+  GList *l;
+
+  found = builder_manifest_find_module (self, modulename, error);
+  if (found == NULL)
+    return FALSE;
+
+  if (!builder_module_should_build (found))
+    return flatpak_fail (error, "Module %s is disabled", modulename);
+
+  /* Watch from the start, so edits made during the first build count */
+  if (!builder_module_add_watch (found, watch, context, error))
+    return FALSE;
+
+  builder_module_set_keep_build_dir (found, TRUE);
+
+  res = builder_manifest_build_modules (self, cache, context, found, error);
+  builder_manifest_stop_download (self);
+
+  for (l = self->expanded_modules; l != NULL; l = l->next)
+    builder_module_discard_extracted_sources (l->data);
+
+  if (!res)
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autoptr(GPtrArray) changed = NULL;
+      g_autoptr(GError) my_error = NULL;
+      g_autofree char *body = g_strdup_printf ("Built %s\n", modulename);
+
+      g_print ("Watching %s for changes\n", modulename);
+      changed = builder_watch_wait (watch);
+
+      if (!builder_cache_rewind_stage (cache, error))
+        return FALSE;
+
+      if (!builder_module_ensure_writable (found, cache, context, error))
+        return FALSE;
+
+      if (!builder_context_enable_rofiles (context, error))
+        return FALSE;
+
+      if (!builder_module_rebuild (found, self->id, cache, context, changed, &my_error))
+        {
+          g_printerr ("Error: %s\n", my_error->message);
+          if (!builder_context_disable_rofiles (context, error))
+            return FALSE;
+          continue;
+        }
+
+      if (!builder_context_disable_rofiles (context, error))
+        return FALSE;
+
+      if (!builder_cache_commit (cache, body, error))
+        return FALSE;
+    }
+}
+
 static gboolean
-command (GFile      *app_dir,
-         char      **env_vars,
-         char      **extra_args,
-         const char *commandline,
-         GError    **error)
+command (BuilderContext *context,
+         GFile          *app_dir,
+         char          **env_vars,
+         char          **extra_args,
+         const char     *commandline,
+         GError        **error)
 {
   g_autoptr(GPtrArray) args = NULL;
   int i;
 
   args = g_ptr_array_new_with_free_func (g_free);
+  builder_context_add_build_wrapper (context, args);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   g_ptr_array_add (args, g_strdup ("build"));
 
@@ -2763,7 +3250,7 @@ builder_manifest_cleanup (BuilderManifest *self,
           env = builder_options_get_env (self->build_options, context);
           for (i = 0; self->cleanup_commands[i] != NULL; i++)
             {
-              if (!command (app_dir, env, build_args, self->cleanup_commands[i], error))
+              if (!command (context, app_dir, env, build_args, self->cleanup_commands[i], error))
                 return FALSE;
             }
         }
@@ -3224,13 +3711,10 @@ builder_manifest_finish (BuilderManifest *self,
           g_autoptr(GFile) metadata = g_file_get_child (app_dir, "metadata");
           g_autoptr(GKeyFile) keyfile = g_key_file_new ();
           g_autoptr(GKeyFile) base_keyfile = g_key_file_new ();
-          g_autofree char *arch_option = NULL;
           const char *parent_id = NULL;
           const char *parent_version = NULL;
           g_autofree char *base_metadata = NULL;
 
-          arch_option = g_strdup_printf ("--arch=%s", builder_context_get_arch (context));
-
           if (self->base != NULL && *self->base != 0)
             {
               parent_id = self->base;
@@ -3242,7 +3726,7 @@ builder_manifest_finish (BuilderManifest *self,
               parent_version = builder_manifest_get_runtime_version (self);
             }
 
-          base_metadata = flatpak (NULL, "info", arch_option, "--show-metadata", parent_id, parent_version, NULL);
+          base_metadata = flatpak_info_show_metadata (parent_id, parent_version, context);
           if (base_metadata == NULL)
             return flatpak_fail (error, "Inherit extensions specified, but could not get metadata for parent %s version %s", parent_id, parent_version);
 
@@ -3757,7 +4241,9 @@ builder_manifest_prepare_platform (BuilderManifest *self,
       GFile *app_dir = NULL;
       g_autoptr(GFile) platform_dir = NULL;
       g_autoptr(GHashTable) to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-      g_autoptr(GPtrArray) changes = NULL;
+      g_autoptr(BuilderPathTable) changes = NULL;
+      g_auto(BuilderPathTableIter) iter = { 0 };
+      const char *changed;
       GList *l;
       int i;
 
@@ -3782,7 +4268,7 @@ builder_manifest_prepare_platform (BuilderManifest *self,
 
           for (i = 0; self->prepare_platform_commands[i] != NULL; i++)
             {
-              if (!command (app_dir, env, extra_args, self->prepare_platform_commands[i], error))
+              if (!command (context, app_dir, env, extra_args, self->prepare_platform_commands[i], error))
                 return FALSE;
             }
         }
@@ -3799,9 +4285,9 @@ builder_manifest_prepare_platform (BuilderManifest *self,
       if (changes == NULL)
         return FALSE;
 
-      for (i = 0; i < changes->len; i++)
+      builder_path_table_iter_init (&iter, changes);
+      while (builder_path_table_iter_next (&iter, &changed))
         {
-          const char *changed = g_ptr_array_index (changes, i);
           g_autoptr(GFile) src = NULL;
           g_autoptr(GFile) dest = NULL;
           g_autoptr(GFileInfo) info = NULL;
@@ -3948,7 +4434,7 @@ builder_manifest_finish_platform (BuilderManifest *self,
 
           for (i = 0; self->cleanup_platform_commands[i] != NULL; i++)
             {
-              if (!command (app_dir, env, extra_args, self->cleanup_platform_commands[i], error))
+              if (!command (context, app_dir, env, extra_args, self->cleanup_platform_commands[i], error))
                 return FALSE;
             }
         }
@@ -4213,13 +4699,15 @@ builder_manifest_show_deps (BuilderManifest *self,
 }
 
 static gboolean
-builder_manifest_install_single_dep (const char *ref,
-				     const char *remote,
-				     gboolean opt_user,
-				     const char *opt_installation,
-				     GError **error)
+builder_manifest_install_dep_refs (GPtrArray *refs,
+                                   const char *remote,
+                                   gboolean opt_user,
+                                   const char *opt_installation,
+                                   GError **error)
 {
   g_autoptr(GPtrArray) args = NULL;
+  guint i;
+
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   add_installation_args (args, opt_user, opt_installation);
@@ -4231,9 +4719,12 @@ builder_manifest_install_single_dep (const char *ref,
     g_ptr_array_add (args, g_strdup ("--noninteractive"));
 
   g_ptr_array_add (args, g_strdup (remote));
-  g_ptr_array_add (args, g_strdup (ref));
+  for (i = 0; i < refs->len; i++)
+    g_ptr_array_add (args, g_strdup (refs->pdata[i]));
   g_ptr_array_add (args, NULL);
 
+  flatpak_info_cache_clear ();
+
   if (!builder_maybe_host_spawnv (NULL, NULL, 0, error, (const char * const *)args->pdata, NULL))
     {
       g_autofree char *commandline = flatpak_quote_argv ((const char **)args->pdata);
@@ -4248,12 +4739,14 @@ builder_manifest_install_single_dep (const char *ref,
 
 
 static gboolean
-builder_manifest_update_single_dep (const char *ref,
-				     gboolean opt_user,
-				     const char *opt_installation,
-				     GError **error)
+builder_manifest_update_dep_refs (GPtrArray *refs,
+                                  gboolean opt_user,
+                                  const char *opt_installation,
+                                  GError **error)
 {
   g_autoptr(GPtrArray) args = NULL;
+  guint i;
+
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   add_installation_args (args, opt_user, opt_installation);
@@ -4265,9 +4758,12 @@ builder_manifest_update_single_dep (const char *ref,
   if (flatpak_version_check (1, 2, 0))
     g_ptr_array_add (args, g_strdup ("--noninteractive"));
 
-  g_ptr_array_add (args, g_strdup (ref));
+  for (i = 0; i < refs->len; i++)
+    g_ptr_array_add (args, g_strdup (refs->pdata[i]));
   g_ptr_array_add (args, NULL);
 
+  flatpak_info_cache_clear ();
+
   if (!builder_maybe_host_spawnv (NULL, NULL, 0, error, (const char * const *)args->pdata, NULL))
     {
       g_autofree char *commandline = flatpak_quote_argv ((const char **)args->pdata);
@@ -4281,20 +4777,121 @@ builder_manifest_update_single_dep (const char *ref,
 }
 
 static gboolean
-builder_manifest_install_dep (BuilderManifest *self,
-                              BuilderContext  *context,
-                              char *const *remotes,
-                              gboolean opt_user,
-                              const char *opt_installation,
-                              const char *runtime,
-                              const char *version,
-                              gboolean opt_yes,
-                              GError         **error)
+builder_manifest_install_missing_dep (const char *ref,
+                                      char *const *remotes,
+                                      gboolean opt_user,
+                                      const char *opt_installation,
+                                      GError **error)
 {
-  g_autofree char *ref = NULL;
-  g_autofree char *commit = NULL;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new ();
   g_autoptr(GError) first_error = NULL;
 
+  g_ptr_array_add (refs, (char *) ref);
+
+  for (const char *remote = *remotes; remote != NULL; remote = *(++remotes))
+    {
+      g_autoptr(GError) current_error = NULL;
+
+      g_print ("Trying to install %s from %s\n", ref, remote);
+      if (builder_manifest_install_dep_refs (refs, remote, opt_user, opt_installation,
+                                             &current_error))
+        return TRUE;
+      else
+        {
+          gboolean fatal_error = current_error->domain != G_SPAWN_EXIT_ERROR;
+          if (first_error == NULL)
+            first_error = g_steal_pointer (&current_error);
+          if (fatal_error)
+            break;
+        }
+    }
+
+  g_propagate_error (error, g_steal_pointer (&first_error));
+  return FALSE;
+}
+
+/* Installs or updates all of refs, using one flatpak transaction for
+ * the updates and one for the installs. If the installs fail and there
+ * are several remotes, each missing ref is tried on each remote in turn. */
+static gboolean
+builder_manifest_install_dep_batch (GPtrArray *refs,
+                                    char *const *remotes,
+                                    gboolean opt_user,
+                                    const char *opt_installation,
+                                    GError **error)
+{
+  g_autoptr(GPtrArray) installed = g_ptr_array_new ();
+  g_autoptr(GPtrArray) missing = g_ptr_array_new ();
+  g_autoptr(GError) local_error = NULL;
+  gboolean multiple_remotes = remotes[0] != NULL && remotes[1] != NULL;
+  guint i;
+
+  for (i = 0; i < refs->len; i++)
+    {
+      const char *ref = refs->pdata[i];
+      g_autofree char *commit = flatpak_info (opt_user, opt_installation, "--show-commit", ref, NULL);
+
+      if (commit != NULL)
+        g_ptr_array_add (installed, (char *) ref);
+      else
+        g_ptr_array_add (missing, (char *) ref);
+    }
+
+  if (installed->len > 0)
+    {
+      for (i = 0; i < installed->len; i++)
+        g_print ("Updating %s\n", (char *) installed->pdata[i]);
+
+      if (!builder_manifest_update_dep_refs (installed, opt_user, opt_installation, error))
+        return FALSE;
+    }
+
+  if (missing->len == 0)
+    return TRUE;
+
+  if (remotes[0] == NULL)
+    return flatpak_fail (error, "No remote to install %s from", (char *) missing->pdata[0]);
+
+  for (i = 0; i < missing->len; i++)
+    g_print ("Installing %s from %s\n", (char *) missing->pdata[i], remotes[0]);
+
+  if (builder_manifest_install_dep_refs (missing, remotes[0], opt_user, opt_installation,
+                                         &local_error))
+    return TRUE;
+
+  if (!multiple_remotes || local_error->domain != G_SPAWN_EXIT_ERROR)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_print ("Failed to install all dependencies from %s, trying them one by one\n", remotes[0]);
+
+  for (i = 0; i < missing->len; i++)
+    {
+      const char *ref = missing->pdata[i];
+      g_autofree char *commit = flatpak_info (opt_user, opt_installation, "--show-commit", ref, NULL);
+
+      if (commit != NULL)
+        continue;
+
+      if (!builder_manifest_install_missing_dep (ref, remotes, opt_user, opt_installation, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+builder_manifest_add_dep (BuilderManifest *self,
+                          BuilderContext  *context,
+                          GPtrArray       *refs,
+                          const char      *runtime,
+                          const char      *version)
+{
+  char *ref;
+  guint i;
+
   if (version == NULL)
     version = builder_manifest_get_runtime_version (self);
 
@@ -4302,63 +4899,28 @@ builder_manifest_install_dep (BuilderManifest *self,
                                    version,
                                    builder_context_get_arch (context));
 
-  commit = flatpak_info (opt_user, opt_installation, "--show-commit", ref, NULL);
-
-  if (commit != NULL)
+  for (i = 0; i < refs->len; i++)
     {
-      g_print("Updating %s\n", ref);
-      if (builder_manifest_update_single_dep(ref, opt_user, opt_installation,
-                                             error))
-      {
-        return TRUE;
-      }
-    }
-  else
-    {
-      gboolean multiple_remotes = (*(remotes+1) != NULL);
-      for (const char *remote = *remotes; remote != NULL; remote = *(++remotes))
-	{
-	  g_autoptr(GError) current_error = NULL;
-	  if (multiple_remotes)
-	    {
-            g_print("Trying to install %s from %s\n", ref, remote);
-	    }
-	  else {
-	    g_print("Installing %s from %s\n", ref, remote);
-	  }
-	  if (builder_manifest_install_single_dep (ref, remote, opt_user, opt_installation,
-                                                   &current_error))
-	  {
-	    return TRUE;
-	  }
-	  else {
-	    gboolean fatal_error = current_error->domain != G_SPAWN_EXIT_ERROR;
-	    if (first_error == NULL)
-	      {
-	        first_error = g_steal_pointer(&current_error);
-	      }
-	    if (fatal_error)
-	      {
-		break;
-	      }
-	  }
-	}
+      if (strcmp (refs->pdata[i], ref) == 0)
+        {
+          g_free (ref);
+          return;
+        }
     }
-  *error = g_steal_pointer(&first_error);
-  return FALSE;
+
+  g_ptr_array_add (refs, ref);
 }
 
 static gboolean
-builder_manifest_install_extension_deps (BuilderManifest *self,
-                                         BuilderContext  *context,
-                                         const char *runtime,
-                                         const char *runtime_version,
-                                         char **runtime_extensions,
-                                         char * const *remotes,
-                                         gboolean opt_user,
-                                         const char *opt_installation,
-                                         gboolean opt_yes,
-                                         GError **error)
+builder_manifest_add_extension_deps (BuilderManifest *self,
+                                     BuilderContext  *context,
+                                     GPtrArray *refs,
+                                     const char *runtime,
+                                     const char *runtime_version,
+                                     char **runtime_extensions,
+                                     gboolean opt_user,
+                                     const char *opt_installation,
+                                     GError **error)
 {
   g_autofree char *runtime_ref = flatpak_build_runtime_ref (runtime, runtime_version,
                                                             builder_context_get_arch (context));
@@ -4402,11 +4964,7 @@ builder_manifest_install_extension_deps (BuilderManifest *self,
         extension_version = g_strdup (runtime_version);
 
       g_print ("Dependency Extension: %s %s\n", runtime_extensions[i], extension_version);
-      if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                         runtime_extensions[i], extension_version,
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, refs, runtime_extensions[i], extension_version);
     }
 
   return TRUE;
@@ -4421,6 +4979,8 @@ builder_manifest_install_deps (BuilderManifest *self,
                                gboolean opt_yes,
                                GError **error)
 {
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) extension_refs = g_ptr_array_new_with_free_func (g_free);
   GList *l;
 
   const char *sdk = NULL;
@@ -4440,56 +5000,28 @@ builder_manifest_install_deps (BuilderManifest *self,
 
   /* Sdk */
   g_print ("Dependency Sdk: %s %s\n", sdk, sdk_branch);
-  if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                     sdk, sdk_branch,
-                                     opt_yes,
-                                     error))
-    return FALSE;
+  builder_manifest_add_dep (self, context, refs, sdk, sdk_branch);
 
   /* Runtime */
   g_print ("Dependency Runtime: %s %s\n", self->runtime, builder_manifest_get_runtime_version (self));
-  if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                     self->runtime, builder_manifest_get_runtime_version (self),
-                                     opt_yes,
-                                     error))
-    return FALSE;
+  builder_manifest_add_dep (self, context, refs,
+                            self->runtime, builder_manifest_get_runtime_version (self));
 
   if (self->base)
     {
       g_print ("Dependency Base: %s %s\n", self->base, builder_manifest_get_base_version (self));
-      if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                         self->base, builder_manifest_get_base_version (self),
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, refs,
+                                self->base, builder_manifest_get_base_version (self));
 
       for (size_t i = 0; self->base_extensions != NULL && self->base_extensions[i] != NULL; i++)
         {
           g_print ("Dependency Base extension: %s %s\n", self->base_extensions[i], builder_manifest_get_base_version (self));
-          if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                             self->base_extensions[i],
-                                             builder_manifest_get_base_version (self),
-                                             opt_yes,
-                                             error))
-            return FALSE;
+          builder_manifest_add_dep (self, context, refs,
+                                    self->base_extensions[i],
+                                    builder_manifest_get_base_version (self));
         }
     }
 
-  if (!builder_manifest_install_extension_deps (self, context,
-                                                sdk, sdk_branch, self->sdk_extensions,
-                                                remotes, opt_user, opt_installation,
-                                                opt_yes,
-                                                error))
-    return FALSE;
-
-  if (!builder_manifest_install_extension_deps (self, context,
-                                                self->runtime, builder_manifest_get_runtime_version (self),
-                                                self->platform_extensions,
-                                                remotes, opt_user, opt_installation,
-                                                opt_yes,
-                                                error))
-    return FALSE;
-
   for (l = self->add_build_extensions; l != NULL; l = l->next)
     {
       BuilderExtension *extension = l->data;
@@ -4500,13 +5032,31 @@ builder_manifest_install_deps (BuilderManifest *self,
         continue;
 
       g_print ("Dependency Extension: %s %s\n", name, version);
-      if (!builder_manifest_install_dep (self, context, remotes, opt_user, opt_installation,
-                                         name, version,
-                                         opt_yes,
-                                         error))
-        return FALSE;
+      builder_manifest_add_dep (self, context, refs, name, version);
     }
 
+  if (!builder_manifest_install_dep_batch (refs, remotes, opt_user, opt_installation, error))
+    return FALSE;
+
+  /* The extension versions come from the sdk and runtime metadata, so
+     these can only be resolved once those are installed */
+  if (!builder_manifest_add_extension_deps (self, context, extension_refs,
+                                            sdk, sdk_branch, self->sdk_extensions,
+                                            opt_user, opt_installation,
+                                            error))
+    return FALSE;
+
+  if (!builder_manifest_add_extension_deps (self, context, extension_refs,
+                                            self->runtime, builder_manifest_get_runtime_version (self),
+                                            self->platform_extensions,
+                                            opt_user, opt_installation,
+                                            error))
+    return FALSE;
+
+  if (extension_refs->len > 0 &&
+      !builder_manifest_install_dep_batch (extension_refs, remotes, opt_user, opt_installation, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -4528,6 +5078,10 @@ builder_manifest_run (BuilderManifest *self,
   g_auto(GStrv) build_args = NULL;
   int i;
 
+  /* The command replaces this process, so nothing would be left to
+     move the changes out of an overlayfs afterwards */
+  builder_context_set_use_overlayfs (context, FALSE);
+
   if (!builder_context_enable_rofiles (context, error))
     return FALSE;
 
@@ -4536,6 +5090,7 @@ builder_manifest_run (BuilderManifest *self,
     return FALSE;
 
   args = g_ptr_array_new_with_free_func (g_free);
+  builder_context_add_build_wrapper (context, args);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   g_ptr_array_add (args, g_strdup ("build"));
   g_ptr_array_add (args, g_strdup ("--nofilesystem=host:reset"));
@@ -94,6 +94,10 @@ gboolean        builder_manifest_download (BuilderManifest *self,
                                            const char      *only_module,
                                            BuilderContext  *context,
                                            GError         **error);
+gboolean        builder_manifest_start_download (BuilderManifest *self,
+                                                 gboolean         update_vcs,
+                                                 BuilderContext  *context,
+                                                 GError         **error);
 gboolean        builder_manifest_build_shell (BuilderManifest *self,
                                               BuilderContext  *context,
                                               const char      *modulename,
@@ -102,6 +106,13 @@ gboolean        builder_manifest_build (BuilderManifest *self,
                                         BuilderCache    *cache,
                                         BuilderContext  *context,
                                         GError         **error);
+void            builder_manifest_report_resources (BuilderManifest *self,
+                                                   BuilderCache    *cache);
+gboolean        builder_manifest_watch (BuilderManifest *self,
+                                        BuilderCache    *cache,
+                                        BuilderContext  *context,
+                                        const char      *modulename,
+                                        GError         **error);
 gboolean        builder_manifest_install_deps (BuilderManifest *self,
                                                BuilderContext  *context,
                                                char * const *remotes,
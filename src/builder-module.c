@@ -36,6 +36,10 @@
 #include "builder-module.h"
 #include "builder-post-process.h"
 #include "builder-manifest.h"
+#include "builder-path-matcher.h"
+#include "builder-source-dir.h"
+#include "builder-source-patch.h"
+#include "builder-source-shell.h"
 
 struct BuilderModule
 {
@@ -60,13 +64,14 @@ struct BuilderModule
   gboolean        rm_configure;
   gboolean        no_autogen;
   gboolean        no_parallel_make;
+  guint64         memory_per_job;
   gboolean        no_make_install;
   gboolean        no_python_timestamp_fix;
   gboolean        cmake;
   gboolean        builddir;
   gboolean        run_tests;
   BuilderOptions *build_options;
-  GPtrArray      *changes;
+  BuilderPathTable *changes;
   char          **cleanup;
   char          **cleanup_platform;
   GList          *sources;
@@ -74,6 +79,17 @@ struct BuilderModule
   char          **build_commands;
   char          **test_commands;
   char          **license_files;
+
+  /* Sources extracted ahead of the build, see
+     builder_module_start_extract_sources() */
+  GThread        *extract_thread;
+  GFile          *extract_dir;
+  BuilderContext *extract_context;
+  GError         *extract_error;
+
+  /* The build dir kept for builder_module_rebuild() */
+  gboolean        keep_build_dir;
+  GFile          *kept_build_dir;
 };
 
 typedef struct
@@ -81,6 +97,13 @@ typedef struct
   GObjectClass parent_class;
 } BuilderModuleClass;
 
+/* Where the fifo of the --jobserver jobserver is in the sandbox */
+#define JOBSERVER_DIR "/run/jobserver"
+#define JOBSERVER_AUTH "--jobserver-auth=fifo:" JOBSERVER_DIR "/fifo"
+
+/* Bump when the default license file scan finds different files */
+#define LICENSE_FILES_CHECKSUM_VERSION "1"
+
 typedef struct {
   int fd;
   char *src_name;
@@ -112,6 +135,7 @@ enum {
   PROP_DISABLED,
   PROP_NO_AUTOGEN,
   PROP_NO_PARALLEL_MAKE,
+  PROP_MEMORY_PER_JOB,
   PROP_NO_MAKE_INSTALL,
   PROP_NO_PYTHON_TIMESTAMP_FIX,
   PROP_CMAKE,
@@ -160,6 +184,9 @@ builder_module_finalize (GObject *object)
 {
   BuilderModule *self = (BuilderModule *) object;
 
+  builder_module_discard_extracted_sources (self);
+  g_clear_object (&self->kept_build_dir);
+
   g_free (self->json_path);
   g_free (self->name);
   g_free (self->subdir);
@@ -185,7 +212,7 @@ builder_module_finalize (GObject *object)
   g_strfreev (self->license_files);
 
   if (self->changes)
-    g_ptr_array_unref (self->changes);
+    builder_path_table_unref (self->changes);
 
   G_OBJECT_CLASS (builder_module_parent_class)->finalize (object);
 }
@@ -224,6 +251,10 @@ builder_module_get_property (GObject    *object,
       g_value_set_boolean (value, self->no_parallel_make);
       break;
 
+    case PROP_MEMORY_PER_JOB:
+      g_value_set_uint64 (value, self->memory_per_job);
+      break;
+
     case PROP_NO_MAKE_INSTALL:
       g_value_set_boolean (value, self->no_make_install);
       break;
@@ -370,6 +401,10 @@ builder_module_set_property (GObject      *object,
       self->no_parallel_make = g_value_get_boolean (value);
       break;
 
+    case PROP_MEMORY_PER_JOB:
+      self->memory_per_job = g_value_get_uint64 (value);
+      break;
+
     case PROP_NO_MAKE_INSTALL:
       self->no_make_install = g_value_get_boolean (value);
       break;
@@ -563,6 +598,14 @@ builder_module_class_init (BuilderModuleClass *klass)
                                                          "",
                                                          FALSE,
                                                          G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_MEMORY_PER_JOB,
+                                   g_param_spec_uint64 ("memory-per-job",
+                                                        "",
+                                                        "",
+                                                        0, G_MAXUINT64,
+                                                        0,
+                                                        G_PARAM_READWRITE));
   g_object_class_install_property (object_class,
                                    PROP_NO_MAKE_INSTALL,
                                    g_param_spec_boolean ("no-make-install",
@@ -1132,6 +1175,39 @@ builder_module_download_sources (BuilderModule  *self,
   return TRUE;
 }
 
+/* Patches and shell commands would modify the files of no-copy dir
+   sources through the symlinks to them */
+static gboolean
+check_no_copy_sources (BuilderModule  *self,
+                       BuilderContext *context,
+                       GError        **error)
+{
+  gboolean has_no_copy = FALSE;
+  BuilderSource *modifying = NULL;
+  GList *l;
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (!builder_source_is_enabled (source, context))
+        continue;
+
+      if (BUILDER_IS_SOURCE_DIR (source) &&
+          builder_source_dir_get_no_copy (BUILDER_SOURCE_DIR (source)))
+        has_no_copy = TRUE;
+      else if (modifying == NULL &&
+               (BUILDER_IS_SOURCE_PATCH (source) || BUILDER_IS_SOURCE_SHELL (source)))
+        modifying = source;
+    }
+
+  if (has_no_copy && modifying != NULL)
+    return flatpak_fail (error, "module %s: no-copy dir sources can't be combined with %s sources",
+                         self->name, BUILDER_IS_SOURCE_PATCH (modifying) ? "patch" : "shell");
+
+  return TRUE;
+}
+
 gboolean
 builder_module_extract_sources (BuilderModule  *self,
                                 GFile          *dest,
@@ -1140,6 +1216,9 @@ builder_module_extract_sources (BuilderModule  *self,
 {
   GList *l;
 
+  if (!check_no_copy_sources (self, context, error))
+    return FALSE;
+
   if (!g_file_query_exists (dest, NULL) &&
       !g_file_make_directory_with_parents (dest, NULL, error))
     return FALSE;
@@ -1147,11 +1226,44 @@ builder_module_extract_sources (BuilderModule  *self,
   for (l = self->sources; l != NULL; l = l->next)
     {
       BuilderSource *source = l->data;
+      g_autoptr(GPtrArray) batch = NULL;
+      gboolean res;
 
       if (!builder_source_is_enabled (source, context))
         continue;
 
-      if (!builder_source_extract (source, dest, self->build_options, context, error))
+      /* Apply runs of patches that git can apply together in one go */
+      if (BUILDER_IS_SOURCE_PATCH (source))
+        {
+          GList *next;
+
+          batch = g_ptr_array_new ();
+          g_ptr_array_add (batch, source);
+
+          for (next = l->next; next != NULL; next = next->next)
+            {
+              BuilderSource *next_source = next->data;
+
+              if (builder_source_is_enabled (next_source, context))
+                {
+                  if (!BUILDER_IS_SOURCE_PATCH (next_source) ||
+                      !builder_source_patch_can_batch (BUILDER_SOURCE_PATCH (source),
+                                                       BUILDER_SOURCE_PATCH (next_source)))
+                    break;
+
+                  g_ptr_array_add (batch, next_source);
+                }
+
+              l = next;
+            }
+        }
+
+      if (batch != NULL && batch->len > 1)
+        res = builder_source_patch_extract_batch (batch, dest, self->build_options, context, error);
+      else
+        res = builder_source_extract (source, dest, self->build_options, context, error);
+
+      if (!res)
         {
           g_prefix_error (error, "module %s: ", self->name);
           return FALSE;
@@ -1161,6 +1273,133 @@ builder_module_extract_sources (BuilderModule  *self,
   return TRUE;
 }
 
+static gpointer
+extract_sources_thread (gpointer data)
+{
+  BuilderModule *self = data;
+  g_autoptr(GMainContext) main_context = g_main_context_new ();
+  gboolean res;
+
+  /* Spawned commands iterate the thread-default context, don't let
+   * them dispatch the main thread's sources */
+  g_main_context_push_thread_default (main_context);
+  res = builder_module_extract_sources (self, self->extract_dir,
+                                        self->extract_context,
+                                        &self->extract_error);
+  g_main_context_pop_thread_default (main_context);
+
+  return GINT_TO_POINTER (res);
+}
+
+/* Extracts and patches the sources into a new build dir on a separate
+ * thread, so that this overlaps with building the previous module.
+ * builder_module_build() then uses that dir. Modules with shell sources
+ * are left alone, as those run commands in the app dir that the previous
+ * module is installing into. */
+gboolean
+builder_module_start_extract_sources (BuilderModule  *self,
+                                      BuilderContext *context,
+                                      GError        **error)
+{
+  GList *l;
+
+  g_return_val_if_fail (self->extract_thread == NULL, FALSE);
+  g_return_val_if_fail (self->extract_dir == NULL, FALSE);
+
+  if (self->keep_build_dir)
+    return TRUE;
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (builder_source_is_enabled (source, context) &&
+          BUILDER_IS_SOURCE_SHELL (source))
+        return TRUE;
+    }
+
+  self->extract_dir = builder_context_allocate_module_build_subdir (context, self->name, error);
+  if (self->extract_dir == NULL)
+    {
+      g_prefix_error (error, "module %s: ", self->name);
+      return FALSE;
+    }
+  self->extract_context = g_object_ref (context);
+
+  g_print ("Extracting sources of %s in the background\n", self->name);
+
+  self->extract_thread = g_thread_try_new ("extract", extract_sources_thread, self, error);
+  if (self->extract_thread == NULL)
+    {
+      builder_module_discard_extracted_sources (self);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Waits for builder_module_start_extract_sources(), so that nothing
+   else touches the source mirrors while it runs. A failed extraction
+   is dropped and redone by the build so it reports the error. */
+void
+builder_module_wait_extract_sources (BuilderModule *self)
+{
+  gboolean res;
+
+  if (self->extract_thread == NULL)
+    return;
+
+  res = GPOINTER_TO_INT (g_thread_join (self->extract_thread));
+  self->extract_thread = NULL;
+
+  if (!res)
+    {
+      g_print ("Extracting sources of %s in the background failed: %s\n",
+               self->name, self->extract_error->message);
+      builder_module_discard_extracted_sources (self);
+    }
+}
+
+/* Returns the build dir extracted by builder_module_start_extract_sources(),
+   or NULL if nothing was extracted ahead or that failed. */
+static GFile *
+builder_module_finish_extract_sources (BuilderModule *self)
+{
+  builder_module_wait_extract_sources (self);
+
+  if (self->extract_dir == NULL)
+    return NULL;
+
+  g_clear_object (&self->extract_context);
+  return g_steal_pointer (&self->extract_dir);
+}
+
+/* Removes the sources extracted by builder_module_start_extract_sources(),
+   when the build stops before getting to this module */
+void
+builder_module_discard_extracted_sources (BuilderModule *self)
+{
+  g_autoptr(GError) my_error = NULL;
+
+  if (self->extract_thread != NULL)
+    {
+      g_thread_join (self->extract_thread);
+      self->extract_thread = NULL;
+    }
+
+  if (self->extract_dir != NULL)
+    {
+      if (!flatpak_rm_rf (self->extract_dir, NULL, &my_error))
+        g_warning ("module %s: Failed to remove %s: %s", self->name,
+                   flatpak_file_get_path_cached (self->extract_dir), my_error->message);
+      builder_context_release_build_subdir (self->extract_context, self->extract_dir);
+    }
+
+  g_clear_object (&self->extract_dir);
+  g_clear_object (&self->extract_context);
+  g_clear_error (&self->extract_error);
+}
+
 void
 builder_module_finish_sources (BuilderModule  *self,
                                GPtrArray      *args,
@@ -1250,6 +1489,7 @@ setup_build_args (GFile          *app_dir,
   int i;
 
   args = g_ptr_array_new_with_free_func (g_free);
+  builder_context_add_build_wrapper (context, args);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   g_ptr_array_add (args, g_strdup ("build"));
   g_ptr_array_add (args, g_strdup ("--die-with-parent"));
@@ -1287,6 +1527,13 @@ setup_build_args (GFile          *app_dir,
       g_ptr_array_add (args, g_strdup_printf ("--bind-mount=/run/ccache=%s", ccache_dir_path));
     }
 
+  /* Only for modules that were given the jobserver */
+  if (builder_context_get_jobserver_dir (context) != NULL &&
+      env_vars != NULL && g_environ_getenv (env_vars, "MAKEFLAGS") != NULL &&
+      strstr (g_environ_getenv (env_vars, "MAKEFLAGS"), JOBSERVER_AUTH) != NULL)
+    g_ptr_array_add (args, g_strdup_printf ("--bind-mount=" JOBSERVER_DIR "=%s",
+                                            flatpak_file_get_path_cached (builder_context_get_jobserver_dir (context))));
+
   if (flatpak_opts)
     {
       for (i = 0; flatpak_opts[i] != NULL; i++)
@@ -1450,9 +1697,9 @@ build (GFile          *app_dir,
   g_ptr_array_add (unresolved_args, NULL);
 
   if (have_secrets)
-    build_success = builder_maybe_host_spawnv (cwd_file, NULL, 0, error, (const char * const *)args->pdata, (const char * const *)unresolved_args->pdata);
+    build_success = builder_maybe_host_spawnv_usage (cwd_file, builder_context_get_build_usage (context), error, (const char * const *)args->pdata, (const char * const *)unresolved_args->pdata);
   else
-    build_success = builder_maybe_host_spawnv (cwd_file, NULL, 0, error, (const char * const *)args->pdata, NULL);
+    build_success = builder_maybe_host_spawnv_usage (cwd_file, builder_context_get_build_usage (context), error, (const char * const *)args->pdata, NULL);
 
   if (!build_success)
     {
@@ -1463,18 +1710,116 @@ build (GFile          *app_dir,
   return TRUE;
 }
 
+/* ninja takes part in the make jobserver since 1.13 */
+static gboolean
+ninja_supports_jobserver (GFile          *app_dir,
+                          const char     *module_name,
+                          BuilderContext *context,
+                          GFile          *source_dir,
+                          char          **flatpak_opts,
+                          char          **env_vars)
+{
+  g_autoptr(GPtrArray) args = NULL;
+  g_autoptr(GError) my_error = NULL;
+  g_autofree char *output = NULL;
+  int major, minor;
+
+  args = setup_build_args (app_dir, module_name, context, source_dir, NULL, flatpak_opts, env_vars, NULL);
+  g_ptr_array_add (args, g_strdup ("ninja"));
+  g_ptr_array_add (args, g_strdup ("--version"));
+  g_ptr_array_add (args, NULL);
+
+  if (!builder_maybe_host_spawnv (NULL, &output, G_SUBPROCESS_FLAGS_STDERR_SILENCE, &my_error,
+                                  (const char * const *) args->pdata, NULL))
+    {
+      g_debug ("Can't get the ninja version: %s", my_error->message);
+      return FALSE;
+    }
+
+  if (sscanf (output, "%d.%d", &major, &minor) != 2)
+    return FALSE;
+
+  return major > 1 || (major == 1 && minor >= 13);
+}
+
+/* Keep the script well below the kernel limit on the size of a single
+   argument, MAX_ARG_STRLEN */
+#define BATCH_SCRIPT_MAX_LEN (64 * 1024)
+
+/* Runs each command with /bin/sh -c, stopping at the first failure. In
+   batch mode they run from one script in a single sandbox, rather than
+   setting up a new one per command. Every command still gets its own
+   shell, so variables and directory changes don't carry over, and the
+   script exits with the status of the command that failed. */
+static gboolean
+build_commands (GFile          *app_dir,
+                const char     *module_name,
+                BuilderContext *context,
+                GFile          *source_dir,
+                const char     *cwd_subdir,
+                char          **flatpak_opts,
+                char          **env_vars,
+                char          **commands,
+                char          **secret_env,
+                gboolean        print_running,
+                GError        **error)
+{
+  g_autoptr(GString) script = NULL;
+  int i;
+
+  if (commands == NULL || commands[0] == NULL)
+    return TRUE;
+
+  if (builder_context_get_batch_commands (context) && commands[1] != NULL)
+    {
+      script = g_string_new ("");
+      for (i = 0; commands[i] != NULL; i++)
+        {
+          g_autofree char *quoted = g_shell_quote (commands[i]);
+
+          if (print_running)
+            {
+              g_autofree char *running = g_strdup_printf ("Running: %s", commands[i]);
+              g_autofree char *quoted_running = g_shell_quote (running);
+              g_string_append_printf (script, "printf '%%s\\n' %s\n", quoted_running);
+            }
+
+          g_string_append_printf (script, "/bin/sh -c %s || exit $?\n", quoted);
+        }
+
+      if (script->len > BATCH_SCRIPT_MAX_LEN)
+        g_string_free (g_steal_pointer (&script), TRUE);
+    }
+
+  if (script != NULL)
+    return build (app_dir, module_name, context, source_dir, cwd_subdir, flatpak_opts, env_vars, error,
+                  "/bin/sh", "-c", script->str, secret_env_arg, secret_env, NULL);
+
+  for (i = 0; commands[i] != NULL; i++)
+    {
+      if (print_running)
+        g_print ("Running: %s\n", commands[i]);
+      if (!build (app_dir, module_name, context, source_dir, cwd_subdir, flatpak_opts, env_vars, error,
+                  "/bin/sh", "-c", commands[i], secret_env_arg, secret_env, NULL))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_module_ensure_writable (BuilderModule  *self,
                                 BuilderCache   *cache,
                                 BuilderContext *context,
                                 GError        **error)
 {
-  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(BuilderPathTable) changes = NULL;
+  g_auto(BuilderPathTableIter) changes_iter = { 0 };
   g_autoptr(GHashTable) matches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   GFile *app_dir = builder_context_get_app_dir (context);
   GHashTableIter iter;
   gpointer key, value;
-  int i;
+  const char *path;
 
   if (cache == NULL)
     return TRUE;
@@ -1487,9 +1832,9 @@ builder_module_ensure_writable (BuilderModule  *self,
   if (changes == NULL)
     return FALSE;
 
-  for (i = 0; i < changes->len; i++)
+  builder_path_table_iter_init (&changes_iter, changes);
+  while (builder_path_table_iter_next (&changes_iter, &path))
     {
-      const char *path = g_ptr_array_index (changes, i);
       const char *unprefixed_path;
       const char *prefix;
 
@@ -1624,10 +1969,30 @@ find_defined_license_files (GStrv       license_files,
 }
 
 static gboolean
-scan_license_dir (int              dirfd,
-                  LicenseScanCb    cb,
-                  gpointer         user_data,
-                  GError         **error)
+license_name_matches (const char * const *patterns,
+                      const char         *name)
+{
+  if (patterns == NULL)
+    return TRUE;
+
+  for (size_t i = 0; patterns[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (name, patterns[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Calls cb for the regular files in dirfd whose names start with one
+   of the patterns, or all of them if patterns is NULL. Names are
+   checked first, so the other files are never opened. */
+static gboolean
+scan_license_dir (int                  dirfd,
+                  const char * const  *patterns,
+                  LicenseScanCb        cb,
+                  gpointer             user_data,
+                  GError             **error)
 {
   g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
   struct dirent *dent;
@@ -1641,12 +2006,18 @@ scan_license_dir (int              dirfd,
 
   while (TRUE)
     {
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
         return FALSE;
 
       if (dent == NULL)
         break;
 
+      if (!license_name_matches (patterns, dent->d_name))
+        continue;
+
+      if (dent->d_type != DT_UNKNOWN && dent->d_type != DT_REG)
+        continue;
+
       glnx_autofd int opath_fd = -1;
       glnx_autofd int fd = -1;
       struct stat st;
@@ -1691,23 +2062,6 @@ license_scan_cb (int         fd,
   g_autofree char *src_path = NULL;
   g_autofree char *dst_name = NULL;
 
-  if (data->patterns)
-    {
-      gboolean match = FALSE;
-
-      for (size_t i = 0; data->patterns[i] != NULL; i++)
-        {
-          if (g_str_has_prefix (name, data->patterns[i]))
-            {
-              match = TRUE;
-              break;
-            }
-        }
-
-      if (!match)
-        return TRUE;
-    }
-
   if (data->prefix)
     {
       src_path = g_build_filename (data->prefix, name, NULL);
@@ -1750,6 +2104,7 @@ scan_license_subdir (int               parent_dfd,
     }
 
   return scan_license_dir (sub_dfd,
+                           data->patterns,
                            license_scan_cb,
                            data,
                            error);
@@ -1794,6 +2149,7 @@ find_default_license_files (BuilderModule  *self,
     return FALSE;
 
   if (!scan_license_dir (source_dfd,
+                         toplevel_data.patterns,
                          license_scan_cb,
                          &toplevel_data,
                          error))
@@ -1817,8 +2173,69 @@ find_default_license_files (BuilderModule  *self,
   return TRUE;
 }
 
+/* Returns the key the default license files of the module are
+   remembered under, which is the checksum of the stage being built,
+   or NULL if there is none. Dir sources are checksummed randomly, so
+   remembering them is pointless. */
+static char *
+get_license_files_checksum (BuilderModule  *self,
+                            BuilderContext *context,
+                            const char     *stage_checksum)
+{
+  GList *l;
+
+  if (stage_checksum == NULL)
+    return NULL;
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (builder_source_is_enabled (source, context) &&
+          BUILDER_IS_SOURCE_DIR (source))
+        return NULL;
+    }
+
+  return g_strdup_printf ("%s-%s", LICENSE_FILES_CHECKSUM_VERSION, stage_checksum);
+}
+
+/* Opens the license files found by an earlier scan of the same
+   sources. Returns FALSE if any of them is gone. */
+static gboolean
+find_cached_license_files (char      **paths,
+                           GFile      *source_dir,
+                           GPtrArray  *files)
+{
+  glnx_autofd int source_dfd = -1;
+
+  if (!glnx_opendirat (AT_FDCWD,
+                       flatpak_file_get_path_cached (source_dir),
+                       TRUE, &source_dfd, NULL))
+    return FALSE;
+
+  for (size_t i = 0; paths[i] != NULL; i++)
+    {
+      g_autofree char *dest_name = g_strdelimit (g_strdup (paths[i]), "/", '_');
+      glnx_autofd int fd = -1;
+
+      fd = glnx_chaseat (source_dfd, paths[i],
+                         GLNX_CHASE_RESOLVE_BENEATH |
+                         GLNX_CHASE_MUST_BE_REGULAR,
+                         NULL);
+      if (fd < 0)
+        return FALSE;
+
+      if (!collect_license_file (fd, paths[i], dest_name, files, NULL))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 find_license_files (BuilderModule  *self,
+                    BuilderContext *context,
+                    const char     *stage_checksum,
                     GFile          *source_dir,
                     GPtrArray     **license_files_out,
                     GError        **error)
@@ -1836,11 +2253,41 @@ find_license_files (BuilderModule  *self,
     }
   else
     {
-      if (!find_default_license_files (self,
-                                       source_dir,
-                                       license_files,
-                                       error))
-        return FALSE;
+      g_autofree char *checksum = get_license_files_checksum (self, context, stage_checksum);
+      g_auto(GStrv) cached_paths = NULL;
+
+      if (checksum)
+        cached_paths = builder_context_get_license_files (context, self->name, checksum);
+
+      if (cached_paths == NULL ||
+          !find_cached_license_files (cached_paths, source_dir, license_files))
+        {
+          g_ptr_array_set_size (license_files, 0);
+
+          if (!find_default_license_files (self,
+                                           source_dir,
+                                           license_files,
+                                           error))
+            return FALSE;
+
+          if (checksum)
+            {
+              g_autoptr(GPtrArray) paths = g_ptr_array_new ();
+              g_autoptr(GError) my_error = NULL;
+
+              for (size_t i = 0; i < license_files->len; i++)
+                {
+                  LicenseFile *lf = license_files->pdata[i];
+                  g_ptr_array_add (paths, lf->src_name);
+                }
+              g_ptr_array_add (paths, NULL);
+
+              if (!builder_context_set_license_files (context, self->name, checksum,
+                                                      (const char * const *) paths->pdata,
+                                                      &my_error))
+                g_warning ("Failed to remember license files: %s", my_error->message);
+            }
+        }
     }
 
   if (license_files_out)
@@ -1851,6 +2298,7 @@ find_license_files (BuilderModule  *self,
 static gboolean
 builder_module_install_licenses (BuilderModule  *self,
                                  const char     *id,
+                                 const char     *stage_checksum,
                                  GFile          *source_dir,
                                  GFile          *app_dir,
                                  BuilderContext *context,
@@ -1875,7 +2323,7 @@ builder_module_install_licenses (BuilderModule  *self,
       return FALSE;
     }
 
-  if (!find_license_files (self, source_dir, &license_files, error))
+  if (!find_license_files (self, context, stage_checksum, source_dir, &license_files, error))
     return FALSE;
 
   if (license_files->len == 0)
@@ -1921,12 +2369,133 @@ builder_module_install_licenses (BuilderModule  *self,
   return TRUE;
 }
 
+static gboolean
+build_dir_is_configured (GFile   *build_dir,
+                         gboolean ninja)
+{
+  const char *makefile_names[] =  {"Makefile", "makefile", "GNUmakefile", NULL};
+  int i;
+
+  if (ninja)
+    {
+      g_autoptr(GFile) ninja_file = g_file_get_child (build_dir, "build.ninja");
+      return g_file_query_exists (ninja_file, NULL);
+    }
+
+  for (i = 0; makefile_names[i] != NULL; i++)
+    {
+      g_autoptr(GFile) makefile_file = g_file_get_child (build_dir, makefile_names[i]);
+      if (g_file_query_exists (makefile_file, NULL))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Caps the jobs so that they all fit into the available memory, given
+   the memory one job of this module needs. Unless the manifest says
+   how much that is, it is the peak seen in the last build. */
+static int
+get_build_jobs (BuilderModule  *self,
+                BuilderCache   *cache,
+                BuilderContext *context)
+{
+  int jobs = builder_context_get_jobs (context);
+  guint64 per_job = self->memory_per_job * 1024 * 1024;
+  BuilderResourceUsage last_usage;
+  guint64 available;
+
+  if (self->no_parallel_make)
+    return 1;
+
+  if (per_job == 0 && cache != NULL &&
+      builder_cache_get_stage_usage (cache, NULL, &last_usage))
+    per_job = last_usage.max_rss;
+
+  available = builder_get_available_memory ();
+  if (per_job == 0 || available == 0)
+    return jobs;
+
+  if (available / per_job < (guint64) jobs)
+    {
+      g_autofree char *per_job_str = g_format_size (per_job);
+      g_autofree char *available_str = g_format_size (available);
+
+      jobs = MAX (1, (int) (available / per_job));
+      g_print ("Limiting %s to %d jobs, as each needs up to %s and %s is available\n",
+               self->name, jobs, per_job_str, available_str);
+    }
+
+  return jobs;
+}
+
+/* Installing from a no-copy dir source can copy the symlinks of the
+   build dir, which would leave the app pointing at the source tree */
+static gboolean
+check_no_links_into (int         dfd,
+                     const char *name,
+                     const char *path,
+                     GPtrArray  *linked_dirs,
+                     GError    **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  struct dirent *dent;
+  int i;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autofree char *child_path = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      child_path = g_build_filename (path, dent->d_name, NULL);
+
+      if (dent->d_type == DT_DIR)
+        {
+          if (!check_no_links_into (iter.fd, dent->d_name, child_path, linked_dirs, error))
+            return FALSE;
+        }
+      else if (dent->d_type == DT_LNK)
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (iter.fd, dent->d_name, NULL, error);
+
+          if (target == NULL)
+            return FALSE;
+
+          if (!g_path_is_absolute (target))
+            continue;
+
+          for (i = 0; i < linked_dirs->len; i++)
+            {
+              const char *linked = flatpak_file_get_path_cached (g_ptr_array_index (linked_dirs, i));
+              gsize len = strlen (linked);
+
+              if (strncmp (target, linked, len) == 0 &&
+                  (target[len] == 0 || target[len] == '/'))
+                return flatpak_fail (error, "%s was installed as a symlink to %s in a no-copy dir source, "
+                                     "install a copy of the file instead", child_path, target);
+            }
+        }
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_module_build_helper (BuilderModule   *self,
                              const char      *id,
                              BuilderCache    *cache,
                              BuilderContext  *context,
                              GFile           *source_dir,
+                             gboolean        *sources_extracted,
+                             gboolean         reuse_build_dir,
                              gboolean         run_shell,
                              GError         **error)
 {
@@ -1942,12 +2511,19 @@ builder_module_build_helper (BuilderModule   *self,
 
   gboolean autotools = FALSE, cmake = FALSE, cmake_ninja = FALSE, meson = FALSE, simple = FALSE, qmake = FALSE;
   gboolean build_has_network = FALSE;
+  gboolean use_jobserver = FALSE;
   g_autoptr(GFile) configure_file = NULL;
   g_autoptr(GFile) build_dir = NULL;
   g_autofree char *build_dir_relative = NULL;
   gboolean has_configure = FALSE;
+  gboolean configured = FALSE;
   gboolean var_require_builddir;
   gboolean use_builddir;
+  int jobs;
+  gint64 start_time;
+  GPtrArray *all_build_args;
+  g_autoptr(GPtrArray) linked_dirs = g_ptr_array_new_with_free_func (g_object_unref);
+  GList *l;
   int i;
   g_auto(GStrv) env = NULL;
   g_auto(GStrv) build_args = NULL;
@@ -1967,8 +2543,16 @@ builder_module_build_helper (BuilderModule   *self,
 
   builder_set_term_title (_("Building %s"), self->name);
 
-  if (!builder_module_extract_sources (self, source_dir, context, error))
-    return FALSE;
+  /* Only count the commands of this build */
+  builder_context_take_build_usage (context, NULL);
+  start_time = g_get_monotonic_time ();
+
+  if (!*sources_extracted)
+    {
+      if (!builder_module_extract_sources (self, source_dir, context, error))
+        return FALSE;
+      *sources_extracted = TRUE;
+    }
 
   if (self->subdir != NULL && self->subdir[0] != 0)
     {
@@ -1986,6 +2570,33 @@ builder_module_build_helper (BuilderModule   *self,
 
   build_has_network = builder_options_build_has_network (build_args);
 
+  /* The build dir links into no-copy dir sources */
+  all_build_args = g_ptr_array_new ();
+  for (i = 0; build_args[i] != NULL; i++)
+    g_ptr_array_add (all_build_args, g_strdup (build_args[i]));
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+      g_autoptr(GFile) linked_dir = NULL;
+
+      if (!BUILDER_IS_SOURCE_DIR (source) ||
+          !builder_source_is_enabled (source, context))
+        continue;
+
+      linked_dir = builder_source_dir_get_linked_dir (BUILDER_SOURCE_DIR (source), context);
+      if (linked_dir != NULL)
+        {
+          g_ptr_array_add (all_build_args, g_strdup_printf ("--filesystem=%s:ro",
+                                                            flatpak_file_get_path_cached (linked_dir)));
+          g_ptr_array_add (linked_dirs, g_steal_pointer (&linked_dir));
+        }
+    }
+
+  g_ptr_array_add (all_build_args, NULL);
+  g_strfreev (build_args);
+  build_args = (char **) g_ptr_array_free (all_build_args, FALSE);
+
   env = builder_options_get_env (self->build_options, context);
   cflags  = g_environ_getenv (env, "CFLAGS");
   cxxflags = g_environ_getenv (env, "CXXFLAGS");
@@ -1994,9 +2605,29 @@ builder_module_build_helper (BuilderModule   *self,
   secret_opts = builder_options_get_secret_opts (self->build_options, context, self->secret_opts);
   secret_env = builder_options_get_secret_env (self->build_options, context, self->secret_env);
 
-  n_jobs = g_strdup_printf ("%d", self->no_parallel_make ? 1 : builder_context_get_jobs (context));
+  jobs = get_build_jobs (self, cache, context);
+  n_jobs = g_strdup_printf ("%d", jobs);
   env = g_environ_setenv (env, "FLATPAK_BUILDER_N_JOBS", n_jobs, FALSE);
 
+  /* Everything that understands the jobserver protocol shares it, so
+     nested parallel builds don't multiply the number of jobs */
+  if (builder_context_get_jobserver (context) && !self->no_parallel_make &&
+      g_environ_getenv (env, "MAKEFLAGS") == NULL)
+    {
+      g_autofree char *makeflags = NULL;
+
+      if (!builder_context_refill_jobserver (context, jobs, error))
+        {
+          g_prefix_error (error, "module %s: ", self->name);
+          return FALSE;
+        }
+
+      makeflags = g_strdup_printf ("-j%s " JOBSERVER_AUTH, n_jobs);
+      env = g_environ_setenv (env, "MAKEFLAGS", makeflags, TRUE);
+      env = g_environ_setenv (env, "CARGO_MAKEFLAGS", makeflags, FALSE);
+      use_jobserver = TRUE;
+    }
+
   if (!self->buildsystem)
     {
       if (self->cmake)
@@ -2069,7 +2700,8 @@ builder_module_build_helper (BuilderModule   *self,
     {
       configure_file = g_file_get_child (source_subdir, "configure");
 
-      if (self->rm_configure)
+      /* A reused build dir already ran autogen in place of it */
+      if (self->rm_configure && !reuse_build_dir)
         {
           if (!g_file_delete (configure_file, NULL, error))
             {
@@ -2155,8 +2787,12 @@ builder_module_build_helper (BuilderModule   *self,
           else
             build_dir_relative = g_strdup ("_flatpak_build");
           build_dir = g_file_get_child (source_subdir, "_flatpak_build");
+          configured = reuse_build_dir && build_dir_is_configured (build_dir, meson || cmake_ninja);
 
-          if (!g_file_make_directory (build_dir, NULL, error))
+          /* A reused build dir may have failed to configure before */
+          if (reuse_build_dir ?
+              !flatpak_mkdir_p (build_dir, NULL, error) :
+              !g_file_make_directory (build_dir, NULL, error))
             {
               g_prefix_error (error, "module %s: ", self->name);
               return FALSE;
@@ -2188,6 +2824,7 @@ builder_module_build_helper (BuilderModule   *self,
         {
           build_dir_relative = g_strdup (source_subdir_relative);
           build_dir = g_object_ref (source_subdir);
+          configured = reuse_build_dir && build_dir_is_configured (build_dir, meson || cmake_ninja);
           if (cmake || cmake_ninja)
             {
               configure_cmd = "cmake";
@@ -2271,7 +2908,10 @@ builder_module_build_helper (BuilderModule   *self,
 
       configure_args = (char **) g_ptr_array_free (g_steal_pointer (&configure_args_arr), FALSE);
 
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
+      /* Make and ninja rerun the configuration themselves if needed */
+      if (configured)
+        g_print ("Reusing configured build dir\n");
+      else if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   configure_cmd, strv_arg, configure_args, strv_arg, config_opts, secret_arg, secret_opts, NULL))
         return FALSE;
     }
@@ -2283,8 +2923,7 @@ builder_module_build_helper (BuilderModule   *self,
 
   if (meson || cmake_ninja)
     {
-      g_autoptr(GFile) ninja_file = g_file_get_child (build_dir, "build.ninja");
-      if (!g_file_query_exists (ninja_file, NULL))
+      if (!build_dir_is_configured (build_dir, TRUE))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "module %s: Can't find ninja file", self->name);
           return FALSE;
@@ -2292,26 +2931,27 @@ builder_module_build_helper (BuilderModule   *self,
     }
   else if (autotools || cmake || qmake)
     {
-      const char *makefile_names[] =  {"Makefile", "makefile", "GNUmakefile", NULL};
-
-      for (i = 0; makefile_names[i] != NULL; i++)
-        {
-          g_autoptr(GFile) makefile_file = g_file_get_child (build_dir, makefile_names[i]);
-          if (g_file_query_exists (makefile_file, NULL))
-            break;
-        }
-
-      if (makefile_names[i] == NULL)
+      if (!build_dir_is_configured (build_dir, FALSE))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "module %s: Can't find makefile", self->name);
           return FALSE;
         }
     }
 
-  if (!self->no_parallel_make)
+  /* ninja before 1.13 doesn't know the jobserver, and without -j
+     would run as many jobs as it likes */
+  if (use_jobserver && (meson || cmake_ninja) &&
+      !ninja_supports_jobserver (app_dir, self->name, context, source_dir, build_args, env))
+    use_jobserver = FALSE;
+
+  if (use_jobserver)
+    {
+      /* An explicit -j makes make and ninja ignore the jobserver */
+    }
+  else if (!self->no_parallel_make)
     {
-      make_j = g_strdup_printf ("-j%d", builder_context_get_jobs (context));
-      make_l = g_strdup_printf ("-l%d", 2 * builder_context_get_jobs (context));
+      make_j = g_strdup_printf ("-j%d", jobs);
+      make_l = g_strdup_printf ("-l%d", 2 * jobs);
     }
   else if (meson || cmake_ninja)
     {
@@ -2348,13 +2988,9 @@ builder_module_build_helper (BuilderModule   *self,
         return FALSE;
     }
 
-  for (i = 0; self->build_commands != NULL && self->build_commands[i] != NULL; i++)
-    {
-      g_print ("Running: %s\n", self->build_commands[i]);
-      if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
-                  "/bin/sh", "-c", self->build_commands[i], secret_env_arg, secret_env, NULL))
-        return FALSE;
-    }
+  if (!build_commands (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env,
+                       self->build_commands, secret_env, TRUE, error))
+    return FALSE;
 
   if (!self->no_make_install && make_cmd)
     {
@@ -2365,21 +3001,23 @@ builder_module_build_helper (BuilderModule   *self,
         return FALSE;
     }
 
-  if (!builder_module_install_licenses (self, id, source_dir, app_dir, context, error))
+  if (!builder_module_install_licenses (self, id, cache ? builder_cache_get_stage_checksum (cache) : NULL,
+                                        source_dir, app_dir, context, error))
     return FALSE;
 
   /* Post installation scripts */
 
   builder_set_term_title (_("Post-Install %s"), self->name);
 
-  if (self->post_install)
+  if (!build_commands (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env,
+                       self->post_install, secret_env, FALSE, error))
+    return FALSE;
+
+  if (linked_dirs->len > 0 &&
+      !check_no_links_into (AT_FDCWD, flatpak_file_get_path_cached (app_dir), "", linked_dirs, error))
     {
-      for (i = 0; self->post_install[i] != NULL; i++)
-        {
-          if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
-                      "/bin/sh", "-c", self->post_install[i], secret_env_arg, secret_env, NULL))
-            return FALSE;
-        }
+      g_prefix_error (error, "module %s: ", self->name);
+      return FALSE;
     }
 
   /* Run unit tests */
@@ -2438,10 +3076,74 @@ builder_module_build_helper (BuilderModule   *self,
       return FALSE;
     }
 
+  if (cache != NULL)
+    {
+      BuilderResourceUsage usage;
+
+      builder_context_take_build_usage (context, &usage);
+      usage.wall_time = g_get_monotonic_time () - start_time;
+      builder_cache_set_usage (cache, &usage);
+    }
+
 
   return TRUE;
 }
 
+static gboolean
+make_build_link (BuilderContext  *context,
+                 GFile           *build_link,
+                 GFile           *source_dir,
+                 GError         **error)
+{
+  g_autoptr(GError) my_error = NULL;
+  g_autofree char *target = NULL;
+
+  if (!g_file_delete (build_link, NULL, &my_error) &&
+      !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  /* tmpfs build dirs live outside the build dir, so need an absolute link */
+  if (builder_context_build_subdir_is_tmpfs (context, source_dir))
+    target = g_file_get_path (source_dir);
+  else
+    target = g_file_get_basename (source_dir);
+
+  return g_file_make_symbolic_link (build_link, target, NULL, error);
+}
+
+/* Returns the new location of the build dir */
+static GFile *
+move_build_dir_to_disk (BuilderModule   *self,
+                        BuilderContext  *context,
+                        GFile           *source_dir,
+                        GFile           *build_link,
+                        GError         **error)
+{
+  g_autoptr(GFile) disk_dir = NULL;
+
+  disk_dir = builder_context_allocate_build_subdir (context, self->name, error);
+  if (disk_dir == NULL)
+    return NULL;
+
+  if (!flatpak_cp_a (source_dir, disk_dir, NULL,
+                     FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_MOVE,
+                     NULL, NULL, error))
+    return NULL;
+
+  if (!flatpak_rm_rf (source_dir, NULL, error))
+    return NULL;
+
+  builder_context_release_build_subdir (context, source_dir);
+
+  if (!make_build_link (context, build_link, disk_dir, error))
+    return NULL;
+
+  return g_steal_pointer (&disk_dir);
+}
+
 gboolean
 builder_module_build (BuilderModule   *self,
                       const char      *id,
@@ -2451,48 +3153,75 @@ builder_module_build (BuilderModule   *self,
                       GError         **error)
 {
   g_autoptr(GFile) source_dir = NULL;
-  g_autoptr(GFile) build_parent_dir = NULL;
   g_autoptr(GFile) build_link = NULL;
   g_autoptr(GError) my_error = NULL;
-  g_autofree char *buildname = NULL;
+  g_autofree char *stage_checksum = cache ? g_strdup (builder_cache_get_stage_checksum (cache)) : NULL;
+  gboolean sources_extracted = FALSE;
+  gboolean reuse_build_dir = FALSE;
+  gboolean remove_build_dir;
   gboolean res;
 
-  source_dir = builder_context_allocate_build_subdir (context, self->name, error);
+  /* The build shell and kept build dirs outlive us, so never put
+     them on tmpfs */
+  if (run_shell || self->keep_build_dir)
+    source_dir = builder_context_allocate_build_subdir (context, self->name, error);
+  else if (stage_checksum != NULL && builder_context_get_resume_failed (context) &&
+           (source_dir = builder_context_take_failed_build (context, self->name, stage_checksum)) != NULL)
+    {
+      g_print ("Resuming failed build of %s in %s\n", self->name,
+               flatpak_file_get_path_cached (source_dir));
+      builder_module_discard_extracted_sources (self);
+      sources_extracted = TRUE;
+      reuse_build_dir = TRUE;
+    }
+  else if ((source_dir = builder_module_finish_extract_sources (self)) != NULL)
+    sources_extracted = TRUE;
+  else
+    source_dir = builder_context_allocate_module_build_subdir (context, self->name, error);
   if (source_dir == NULL)
     {
       g_prefix_error (error, "module %s: ", self->name);
       return FALSE;
     }
 
-  build_parent_dir = g_file_get_parent (source_dir);
-  buildname = g_file_get_basename (source_dir);
-
-  /* Make an unversioned symlink */
-  build_link = g_file_get_child (build_parent_dir, self->name);
-  if (!g_file_delete (build_link, NULL, &my_error) &&
-      !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+  if (!flatpak_mkdir_p (builder_context_get_build_dir (context), NULL, error))
     {
-      g_propagate_error (error, g_steal_pointer (&my_error));
       g_prefix_error (error, "module %s: ", self->name);
       return FALSE;
     }
-  g_clear_error (&my_error);
 
-  if (!g_file_make_symbolic_link (build_link,
-                                  buildname,
-                                  NULL, error))
+  /* Make an unversioned symlink */
+  build_link = g_file_get_child (builder_context_get_build_dir (context), self->name);
+  if (!make_build_link (context, build_link, source_dir, error))
     {
       g_prefix_error (error, "module %s: ", self->name);
       return FALSE;
     }
 
-  res = builder_module_build_helper (self, id, cache, context, source_dir, run_shell, error);
+  res = builder_module_build_helper (self, id, cache, context, source_dir,
+                                     &sources_extracted, reuse_build_dir, run_shell, error);
+
+  /* Remember how much space the build needed, to decide where to
+     build it next time */
+  if (res && !run_shell && builder_context_get_build_dir_tmpfs_size (context) > 0)
+    {
+      guint64 size;
+
+      if (!builder_get_disk_usage (source_dir, &size, &my_error) ||
+          !builder_context_set_build_size_for (context, self->name, size, &my_error))
+        {
+          g_warning ("module %s: Failed to record build dir size: %s", self->name, my_error->message);
+          g_clear_error (&my_error);
+        }
+    }
 
   /* Clean up build dir */
 
-  if (!run_shell &&
-      (!builder_context_get_keep_build_dirs (context) &&
-       (res || builder_context_get_delete_build_dirs (context))))
+  remove_build_dir = !run_shell && !self->keep_build_dir &&
+    (!builder_context_get_keep_build_dirs (context) &&
+     (res || builder_context_get_delete_build_dirs (context)));
+
+  if (remove_build_dir)
     {
       builder_set_term_title (_("Cleanup %s"), self->name);
 
@@ -2502,16 +3231,132 @@ builder_module_build (BuilderModule   *self,
           return FALSE;
         }
 
-      if (!flatpak_rm_rf (source_dir, NULL, error))
+      if (!builder_context_trash_build_subdir (context, source_dir, error))
         {
           g_prefix_error (error, "module %s: ", self->name);
           return FALSE;
         }
+
+      builder_context_release_build_subdir (context, source_dir);
     }
+  else if (!run_shell && builder_context_build_subdir_is_tmpfs (context, source_dir))
+    {
+      g_autoptr(GFile) disk_dir = NULL;
+
+      /* Kept build dirs have to survive the tmpfs going away */
+      disk_dir = move_build_dir_to_disk (self, context, source_dir, build_link, &my_error);
+      if (disk_dir == NULL)
+        {
+          if (res)
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              g_prefix_error (error, "module %s: ", self->name);
+              return FALSE;
+            }
+
+          g_warning ("module %s: Failed to move build dir to disk: %s", self->name, my_error->message);
+          g_clear_error (&my_error);
+        }
+      else
+        g_set_object (&source_dir, disk_dir);
+    }
+
+  /* Let a later --resume-failed run continue where this stopped. That
+     needs the sources in place, and the build dir on disk. */
+  if (!res && !run_shell && !remove_build_dir &&
+      stage_checksum != NULL && sources_extracted &&
+      !builder_context_build_subdir_is_tmpfs (context, source_dir))
+    {
+      if (!builder_context_set_failed_build (context, self->name, stage_checksum, source_dir, &my_error))
+        g_warning ("module %s: Failed to record failed build: %s", self->name, my_error->message);
+    }
+
+  if (res && !run_shell && self->keep_build_dir)
+    g_set_object (&self->kept_build_dir, source_dir);
 
   return res;
 }
 
+/* Keeps the build dir around after building, so that the module can
+ * be built again incrementally with builder_module_rebuild() */
+void
+builder_module_set_keep_build_dir (BuilderModule *self,
+                                   gboolean       keep_build_dir)
+{
+  self->keep_build_dir = keep_build_dir;
+}
+
+/* Watches the dir sources of the module for changes, fails if there
+ * are none */
+gboolean
+builder_module_add_watch (BuilderModule  *self,
+                          BuilderWatch   *watch,
+                          BuilderContext *context,
+                          GError        **error)
+{
+  gboolean found = FALSE;
+  GList *l;
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (!builder_source_is_enabled (source, context) ||
+          !BUILDER_IS_SOURCE_DIR (source))
+        continue;
+
+      if (!builder_source_dir_add_watch (BUILDER_SOURCE_DIR (source), watch, context, error))
+        {
+          g_prefix_error (error, "module %s: ", self->name);
+          return FALSE;
+        }
+
+      found = TRUE;
+    }
+
+  if (!found)
+    return flatpak_fail (error, "module %s: No dir sources to watch", self->name);
+
+  return TRUE;
+}
+
+/* Copies the changed files of the dir sources into the build dir kept
+ * from the last build, and builds it again. This skips configuring,
+ * so only what changed gets rebuilt, but installs everything again. */
+gboolean
+builder_module_rebuild (BuilderModule  *self,
+                        const char     *id,
+                        BuilderCache   *cache,
+                        BuilderContext *context,
+                        GPtrArray      *changed,
+                        GError        **error)
+{
+  GList *l;
+
+  gboolean sources_extracted = TRUE;
+
+  g_return_val_if_fail (self->kept_build_dir != NULL, FALSE);
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (!builder_source_is_enabled (source, context) ||
+          !BUILDER_IS_SOURCE_DIR (source))
+        continue;
+
+      if (!builder_source_dir_sync (BUILDER_SOURCE_DIR (source), self->kept_build_dir,
+                                    changed, context, error))
+        {
+          g_prefix_error (error, "module %s: ", self->name);
+          return FALSE;
+        }
+    }
+
+  return builder_module_build_helper (self, id, cache, context, self->kept_build_dir,
+                                      &sources_extracted, TRUE, FALSE, error);
+}
+
 gboolean
 builder_module_update (BuilderModule  *self,
                        BuilderContext *context,
@@ -2619,50 +3464,33 @@ builder_module_set_base_dir (BuilderModule *self,
     builder_source_set_base_dir (l->data, base_dir);
 }
 
-GPtrArray *
+BuilderPathTable *
 builder_module_get_changes (BuilderModule *self)
 {
   return self->changes;
 }
 
 void
-builder_module_set_changes (BuilderModule *self,
-                            GPtrArray     *changes)
+builder_module_set_changes (BuilderModule    *self,
+                            BuilderPathTable *changes)
 {
   if (self->changes != changes)
     {
       if (self->changes)
-        g_ptr_array_unref (self->changes);
-      self->changes = g_ptr_array_ref (changes);
+        builder_path_table_unref (self->changes);
+      self->changes = builder_path_table_ref (changes);
     }
 }
 
-static gboolean
-matches_cleanup_for_path (const char **patterns,
-                          const char  *path)
-{
-  int i;
-
-  if (patterns == NULL)
-    return FALSE;
-
-  for (i = 0; patterns[i] != NULL; i++)
-    {
-      if (flatpak_matches_path_pattern (path, patterns[i]))
-        return TRUE;
-    }
-
-  return FALSE;
-}
-
 void
 builder_module_cleanup_collect (BuilderModule  *self,
                                 gboolean        platform,
                                 BuilderContext *context,
                                 GHashTable     *to_remove_ht)
 {
-  GPtrArray *changed_files;
-  int i;
+  g_autoptr(BuilderPathMatcher) matcher = NULL;
+  g_auto(BuilderPathTableIter) iter = { 0 };
+  const char *path;
   const char **global_patterns;
   const char **local_patterns;
 
@@ -2680,10 +3508,13 @@ builder_module_cleanup_collect (BuilderModule  *self,
       local_patterns = (const char **) self->cleanup;
     }
 
-  changed_files = self->changes;
-  for (i = 0; i < changed_files->len; i++)
+  /* Compile all the patterns once so each path is matched in a single pass */
+  matcher = builder_path_matcher_new ((const char * const *) global_patterns);
+  builder_path_matcher_add_patterns (matcher, (const char * const *) local_patterns);
+
+  builder_path_table_iter_init (&iter, self->changes);
+  while (builder_path_table_iter_next (&iter, &path))
     {
-      const char *path = g_ptr_array_index (changed_files, i);
       const char *unprefixed_path;
       const char *prefix;
 
@@ -2696,8 +3527,7 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
       unprefixed_path = path + strlen (prefix);
 
-      collect_cleanup_for_path (global_patterns, unprefixed_path, prefix, to_remove_ht);
-      collect_cleanup_for_path (local_patterns, unprefixed_path, prefix, to_remove_ht);
+      builder_path_matcher_collect (matcher, unprefixed_path, prefix, to_remove_ht);
 
       if (g_str_has_prefix (unprefixed_path, "lib/debug/") &&
           g_str_has_suffix (unprefixed_path, ".debug"))
@@ -2712,8 +3542,7 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
           while (TRUE)
             {
-              if (matches_cleanup_for_path (global_patterns, debug_path) ||
-                  matches_cleanup_for_path (local_patterns, debug_path))
+              if (builder_path_matcher_matches (matcher, debug_path))
                 g_hash_table_insert (to_remove_ht, g_strconcat (prefix, real_path, NULL), GINT_TO_POINTER (1));
 
               real_parent = g_path_get_dirname (real_path);
@@ -25,6 +25,8 @@
 
 #include "builder-source.h"
 #include "builder-options.h"
+#include "builder-path-table.h"
+#include "builder-watch.h"
 
 G_BEGIN_DECLS
 
@@ -52,9 +54,9 @@ void         builder_module_set_json_path (BuilderModule *self,
                                            const char *json_path);
 void         builder_module_set_base_dir (BuilderModule *self,
                                           GFile* base_dir);
-GPtrArray *  builder_module_get_changes (BuilderModule *self);
-void         builder_module_set_changes (BuilderModule *self,
-                                         GPtrArray     *changes);
+BuilderPathTable *builder_module_get_changes (BuilderModule *self);
+void         builder_module_set_changes (BuilderModule    *self,
+                                         BuilderPathTable *changes);
 
 gboolean     builder_module_show_deps (BuilderModule *self,
                                        BuilderContext *context,
@@ -67,6 +69,11 @@ gboolean builder_module_extract_sources (BuilderModule  *self,
                                          GFile          *dest,
                                          BuilderContext *context,
                                          GError        **error);
+gboolean builder_module_start_extract_sources (BuilderModule  *self,
+                                               BuilderContext *context,
+                                               GError        **error);
+void     builder_module_wait_extract_sources (BuilderModule *self);
+void     builder_module_discard_extracted_sources (BuilderModule *self);
 gboolean builder_module_bundle_sources (BuilderModule  *self,
                                         BuilderContext *context,
                                         GError        **error);
@@ -83,6 +90,18 @@ gboolean builder_module_build (BuilderModule   *self,
                                BuilderContext  *context,
                                gboolean         run_shell,
                                GError         **error);
+void     builder_module_set_keep_build_dir (BuilderModule *self,
+                                            gboolean       keep_build_dir);
+gboolean builder_module_add_watch (BuilderModule  *self,
+                                   BuilderWatch   *watch,
+                                   BuilderContext *context,
+                                   GError        **error);
+gboolean builder_module_rebuild (BuilderModule  *self,
+                                 const char     *id,
+                                 BuilderCache   *cache,
+                                 BuilderContext *context,
+                                 GPtrArray      *changed,
+                                 GError        **error);
 gboolean builder_module_update (BuilderModule  *self,
                                 BuilderContext *context,
                                 GError        **error);
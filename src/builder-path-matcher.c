@@ -0,0 +1,512 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "builder-path-matcher.h"
+
+/* A compiled set of cleanup patterns, with the same semantics as
+ * running flatpak_collect_matches_for_path_pattern() and
+ * flatpak_matches_path_pattern() for each pattern in turn.
+ *
+ * Patterns starting with a slash are split into path segments and
+ * stored in a trie, with literal segments in a hash table per node
+ * and wildcard segments in a list. A path is matched by advancing the
+ * set of active trie nodes one path component at a time, so each
+ * component is looked at once no matter how many patterns there are.
+ *
+ * Like in flatpak_path_match_prefix(), a '*' that is followed by more
+ * of its segment may also swallow the rest of a component, with the
+ * rest of the segment then matching from the start of the next one,
+ * so "/a*b" matches "a/b". Such partial matches are tracked as extra
+ * active states.
+ *
+ * Other patterns match only the basename, and are split into a hash
+ * table of literal names and a list of wildcard ones.
+ */
+
+typedef struct PathNode PathNode;
+
+typedef struct
+{
+  char     *glob;
+  PathNode *node;
+} GlobChild;
+
+struct PathNode
+{
+  GHashTable *literal_children;
+  GPtrArray  *glob_children;
+  gboolean    terminal;
+  /* Only matches if more components follow */
+  gboolean    terminal_dir;
+};
+
+/* A position in the trie. If rest is set, the rest of a glob segment
+   still has to match the next component before node is reached. */
+typedef struct
+{
+  PathNode   *node;
+  const char *rest;
+} MatchState;
+
+struct BuilderPathMatcher
+{
+  PathNode   *root;
+  GHashTable *literal_basenames;
+  GPtrArray  *glob_basenames;
+};
+
+static void path_node_free (PathNode *node);
+
+static void
+glob_child_free (GlobChild *child)
+{
+  g_free (child->glob);
+  path_node_free (child->node);
+  g_free (child);
+}
+
+static PathNode *
+path_node_new (void)
+{
+  PathNode *node = g_new0 (PathNode, 1);
+
+  node->literal_children = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, (GDestroyNotify) path_node_free);
+  node->glob_children = g_ptr_array_new_with_free_func ((GDestroyNotify) glob_child_free);
+
+  return node;
+}
+
+static void
+path_node_free (PathNode *node)
+{
+  g_hash_table_unref (node->literal_children);
+  g_ptr_array_unref (node->glob_children);
+  g_free (node);
+}
+
+static gboolean
+is_glob (const char *segment)
+{
+  return strpbrk (segment, "*?") != NULL;
+}
+
+static void
+add_crossing (GPtrArray  *crossings,
+              const char *rest)
+{
+  guint i;
+
+  for (i = 0; i < crossings->len; i++)
+    {
+      if (g_ptr_array_index (crossings, i) == rest)
+        return;
+    }
+
+  g_ptr_array_add (crossings, (gpointer) rest);
+}
+
+/* Matches a glob segment against all of a path component, the way
+ * flatpak_path_match_prefix() does. If crossings is set, the rests of
+ * the glob that may continue at the start of the next component, after
+ * a '*' took the end of this one, are added to it. */
+static gboolean
+segment_matches_full (const char *glob,
+                      const char *str,
+                      GPtrArray  *crossings)
+{
+  while (TRUE)
+    {
+      char c = *glob++;
+
+      switch (c)
+        {
+        case 0:
+          return *str == 0;
+
+        case '?':
+          if (*str == 0)
+            return FALSE;
+          str++;
+          break;
+
+        case '*':
+          {
+            gboolean matched = FALSE;
+
+            while (*glob == '*')
+              glob++;
+
+            if (*glob == 0)
+              return TRUE;
+
+            for (; *str != 0; str++)
+              {
+                if (segment_matches_full (glob, str, crossings))
+                  {
+                    matched = TRUE;
+                    if (crossings == NULL)
+                      break;
+                  }
+              }
+
+            if (crossings != NULL)
+              add_crossing (crossings, glob);
+
+            return matched;
+          }
+
+        default:
+          if (c != *str)
+            return FALSE;
+          str++;
+          break;
+        }
+    }
+}
+
+static gboolean
+segment_matches (const char *glob,
+                 const char *str)
+{
+  return segment_matches_full (glob, str, NULL);
+}
+
+static PathNode *
+path_node_ensure_child (PathNode   *node,
+                        const char *segment)
+{
+  PathNode *child;
+  guint i;
+
+  if (!is_glob (segment))
+    {
+      child = g_hash_table_lookup (node->literal_children, segment);
+      if (child == NULL)
+        {
+          child = path_node_new ();
+          g_hash_table_insert (node->literal_children, g_strdup (segment), child);
+        }
+      return child;
+    }
+
+  for (i = 0; i < node->glob_children->len; i++)
+    {
+      GlobChild *glob_child = g_ptr_array_index (node->glob_children, i);
+
+      if (strcmp (glob_child->glob, segment) == 0)
+        return glob_child->node;
+    }
+
+  {
+    GlobChild *glob_child = g_new0 (GlobChild, 1);
+    glob_child->glob = g_strdup (segment);
+    glob_child->node = path_node_new ();
+    g_ptr_array_add (node->glob_children, glob_child);
+    return glob_child->node;
+  }
+}
+
+/* Strips the single trailing slash that flatpak_path_match_prefix()
+ * treats as a directory boundary. After a '*' it instead needs another
+ * component to follow, which is returned in out_need_dir. Returns NULL
+ * for patterns that can never match a path without empty components. */
+static char *
+normalize_pattern (const char *pattern,
+                   gboolean   *out_need_dir)
+{
+  g_autofree char *copy = NULL;
+  gsize len;
+
+  while (*pattern == '/')
+    pattern++;
+
+  copy = g_strdup (pattern);
+  len = strlen (copy);
+  *out_need_dir = FALSE;
+  if (len > 0 && copy[len - 1] == '/')
+    {
+      copy[--len] = 0;
+      *out_need_dir = len > 0 && copy[len - 1] == '*';
+    }
+
+  if (len == 0 || copy[len - 1] == '/' || strstr (copy, "//") != NULL)
+    return NULL;
+
+  return g_steal_pointer (&copy);
+}
+
+static void
+add_pattern (BuilderPathMatcher *self,
+             const char         *pattern)
+{
+  gboolean need_dir;
+  g_autofree char *normalized = normalize_pattern (pattern, &need_dir);
+
+  if (normalized == NULL)
+    return;
+
+  if (pattern[0] == '/')
+    {
+      g_auto(GStrv) segments = g_strsplit (normalized, "/", -1);
+      PathNode *node = self->root;
+      int i;
+
+      for (i = 0; segments[i] != NULL; i++)
+        node = path_node_ensure_child (node, segments[i]);
+
+      if (need_dir)
+        node->terminal_dir = TRUE;
+      else
+        node->terminal = TRUE;
+    }
+  else if (strchr (normalized, '/') != NULL || need_dir)
+    {
+      /* Never matches a basename */
+    }
+  else if (is_glob (normalized))
+    g_ptr_array_add (self->glob_basenames, g_steal_pointer (&normalized));
+  else
+    g_hash_table_add (self->literal_basenames, g_steal_pointer (&normalized));
+}
+
+BuilderPathMatcher *
+builder_path_matcher_new (const char * const *patterns)
+{
+  BuilderPathMatcher *self = g_new0 (BuilderPathMatcher, 1);
+
+  self->root = path_node_new ();
+  self->literal_basenames = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->glob_basenames = g_ptr_array_new_with_free_func (g_free);
+
+  builder_path_matcher_add_patterns (self, patterns);
+
+  return self;
+}
+
+void
+builder_path_matcher_add_patterns (BuilderPathMatcher *self,
+                                   const char * const *patterns)
+{
+  int i;
+
+  for (i = 0; patterns != NULL && patterns[i] != NULL; i++)
+    add_pattern (self, patterns[i]);
+}
+
+void
+builder_path_matcher_free (BuilderPathMatcher *self)
+{
+  path_node_free (self->root);
+  g_hash_table_unref (self->literal_basenames);
+  g_ptr_array_unref (self->glob_basenames);
+  g_free (self);
+}
+
+static gboolean
+basename_matches (BuilderPathMatcher *self,
+                  const char         *basename)
+{
+  guint i;
+
+  if (g_hash_table_contains (self->literal_basenames, basename))
+    return TRUE;
+
+  for (i = 0; i < self->glob_basenames->len; i++)
+    {
+      if (segment_matches (g_ptr_array_index (self->glob_basenames, i), basename))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Adds the states reached by matching glob against component, on the
+   way to node */
+static void
+advance_glob (GArray     *next,
+              PathNode   *node,
+              const char *glob,
+              const char *component,
+              GPtrArray  *crossings)
+{
+  guint i;
+
+  g_ptr_array_set_size (crossings, 0);
+
+  if (segment_matches_full (glob, component, crossings))
+    {
+      MatchState state = { node, NULL };
+      g_array_append_val (next, state);
+    }
+
+  for (i = 0; i < crossings->len; i++)
+    {
+      MatchState state = { node, g_ptr_array_index (crossings, i) };
+      g_array_append_val (next, state);
+    }
+}
+
+/* Returns the length of the shortest prefix of path (ending at a
+ * component boundary) that is matched by an absolute pattern, or -1.
+ * Leading slashes must already be stripped from path. */
+static gssize
+match_prefix_len (BuilderPathMatcher *self,
+                  const char         *path)
+{
+  g_autofree char *copy = NULL;
+  g_autoptr(GArray) active = NULL;
+  g_autoptr(GArray) next = NULL;
+  g_autoptr(GPtrArray) crossings = NULL;
+  MatchState root_state = { self->root, NULL };
+  char *component;
+
+  if (g_hash_table_size (self->root->literal_children) == 0 &&
+      self->root->glob_children->len == 0)
+    return -1;
+
+  copy = g_strdup (path);
+  active = g_array_new (FALSE, FALSE, sizeof (MatchState));
+  next = g_array_new (FALSE, FALSE, sizeof (MatchState));
+  crossings = g_ptr_array_new ();
+  g_array_append_val (active, root_state);
+
+  component = copy;
+  while (*component != 0)
+    {
+      char *end = strchr (component, '/');
+      gboolean last = end == NULL;
+      guint i, j;
+
+      if (!last)
+        *end = 0;
+
+      g_array_set_size (next, 0);
+      for (i = 0; i < active->len; i++)
+        {
+          MatchState *state = &g_array_index (active, MatchState, i);
+          PathNode *child;
+
+          if (state->rest != NULL)
+            {
+              advance_glob (next, state->node, state->rest, component, crossings);
+              continue;
+            }
+
+          child = g_hash_table_lookup (state->node->literal_children, component);
+          if (child != NULL)
+            {
+              MatchState child_state = { child, NULL };
+              g_array_append_val (next, child_state);
+            }
+
+          for (j = 0; j < state->node->glob_children->len; j++)
+            {
+              GlobChild *glob_child = g_ptr_array_index (state->node->glob_children, j);
+
+              advance_glob (next, glob_child->node, glob_child->glob, component, crossings);
+            }
+        }
+
+      for (i = 0; i < next->len; i++)
+        {
+          MatchState *state = &g_array_index (next, MatchState, i);
+          if (state->rest == NULL &&
+              (state->node->terminal || (state->node->terminal_dir && !last)))
+            return (component - copy) + strlen (component);
+        }
+
+      if (next->len == 0 || last)
+        return -1;
+
+      component = end + 1;
+      while (*component == '/')
+        component++;
+
+      {
+        GArray *tmp = active;
+        active = next;
+        next = tmp;
+      }
+    }
+
+  return -1;
+}
+
+gboolean
+builder_path_matcher_matches (BuilderPathMatcher *self,
+                              const char         *path)
+{
+  const char *basename = strrchr (path, '/');
+
+  if (basename_matches (self, basename ? basename + 1 : path))
+    return TRUE;
+
+  while (*path == '/')
+    path++;
+
+  return match_prefix_len (self, path) >= 0;
+}
+
+/* Adds all matches of path to to_remove_ht, like calling
+ * flatpak_collect_matches_for_path_pattern() for each pattern */
+void
+builder_path_matcher_collect (BuilderPathMatcher *self,
+                              const char         *path,
+                              const char         *add_prefix,
+                              GHashTable         *to_remove_ht)
+{
+  const char *basename = strrchr (path, '/');
+  const char *stripped = path;
+  const char *rest;
+  gssize prefix_len;
+
+  if (add_prefix == NULL)
+    add_prefix = "";
+
+  while (*stripped == '/')
+    stripped++;
+
+  prefix_len = match_prefix_len (self, stripped);
+  if (prefix_len < 0)
+    {
+      if (basename_matches (self, basename ? basename + 1 : path))
+        g_hash_table_insert (to_remove_ht, g_strconcat (add_prefix, path, NULL), GINT_TO_POINTER (1));
+      return;
+    }
+
+  /* A prefix match removes all files below it, and the full path is
+     part of that, so a basename match adds nothing new */
+  rest = stripped + prefix_len;
+  while (TRUE)
+    {
+      const char *slash;
+      g_autofree char *prefix = g_strndup (path, rest - path);
+
+      g_hash_table_insert (to_remove_ht, g_strconcat (add_prefix, prefix, NULL), GINT_TO_POINTER (1));
+      while (*rest == '/')
+        rest++;
+      if (*rest == 0)
+        break;
+      slash = strchr (rest, '/');
+      rest = slash ? slash : rest + strlen (rest);
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUILDER_PATH_MATCHER_H__
+#define __BUILDER_PATH_MATCHER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct BuilderPathMatcher BuilderPathMatcher;
+
+BuilderPathMatcher *builder_path_matcher_new (const char * const *patterns);
+void                builder_path_matcher_add_patterns (BuilderPathMatcher *self,
+                                                       const char * const *patterns);
+void                builder_path_matcher_free (BuilderPathMatcher *self);
+gboolean            builder_path_matcher_matches (BuilderPathMatcher *self,
+                                                  const char         *path);
+void                builder_path_matcher_collect (BuilderPathMatcher *self,
+                                                  const char         *path,
+                                                  const char         *add_prefix,
+                                                  GHashTable         *to_remove_ht);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderPathMatcher, builder_path_matcher_free)
+
+G_END_DECLS
+
+#endif /* __BUILDER_PATH_MATCHER_H__ */
@@ -0,0 +1,252 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <gio/gio.h>
+
+#include "builder-path-table.h"
+
+/* A sorted list of paths, front-coded into a single buffer. Each path
+ * is stored as the length of the prefix it shares with the path before
+ * it, followed by the rest of it:
+ *
+ *   varint n_paths
+ *   n_paths * (varint shared_len, varint suffix_len, suffix bytes)
+ *
+ * Sibling files share most of their path, so this is a fraction of the
+ * size of separate strings. The buffer is also the on-disk format, so
+ * it can be stored in commit metadata as is. Paths are only available
+ * in order, through BuilderPathTableIter.
+ */
+
+struct BuilderPathTable
+{
+  gatomicrefcount ref_count;
+  guint           n_paths;
+  GBytes         *data;
+};
+
+static void
+put_varint (GByteArray *array,
+            guint64     value)
+{
+  do
+    {
+      guint8 byte = value & 0x7f;
+
+      value >>= 7;
+      if (value != 0)
+        byte |= 0x80;
+      g_byte_array_append (array, &byte, 1);
+    }
+  while (value != 0);
+}
+
+static gboolean
+get_varint (const guint8 **p,
+            const guint8  *end,
+            guint64       *out_value)
+{
+  guint64 value = 0;
+  guint shift;
+
+  for (shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+      guint8 byte = *(*p)++;
+
+      value |= (guint64) (byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+        {
+          *out_value = value;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static int
+cmpstringp (const void *p1, const void *p2)
+{
+  return strcmp (*(char * const *) p1, *(char * const *) p2);
+}
+
+/* The paths don't have to be sorted, and are not referenced after this */
+BuilderPathTable *
+builder_path_table_new (const char * const *paths,
+                        gsize               n_paths)
+{
+  BuilderPathTable *self = g_new0 (BuilderPathTable, 1);
+  g_autofree const char **sorted = NULL;
+  g_autoptr(GByteArray) arena = g_byte_array_new ();
+  const char *prev = "";
+  gsize prev_len = 0;
+  gsize i;
+
+  g_atomic_ref_count_init (&self->ref_count);
+  self->n_paths = n_paths;
+
+  sorted = g_memdup2 (paths, n_paths * sizeof (char *));
+  if (n_paths > 0)
+    qsort (sorted, n_paths, sizeof (char *), cmpstringp);
+
+  put_varint (arena, n_paths);
+  for (i = 0; i < n_paths; i++)
+    {
+      const char *path = sorted[i];
+      gsize len = strlen (path);
+      gsize shared = 0;
+
+      while (shared < prev_len && shared < len && prev[shared] == path[shared])
+        shared++;
+
+      put_varint (arena, shared);
+      put_varint (arena, len - shared);
+      g_byte_array_append (arena, (const guint8 *) path + shared, len - shared);
+
+      prev = path;
+      prev_len = len;
+    }
+
+  /* Copy, so we don't keep the slack of the growing array around */
+  self->data = g_bytes_new (arena->data, arena->len);
+
+  return self;
+}
+
+BuilderPathTable *
+builder_path_table_new_from_bytes (GBytes  *bytes,
+                                   GError **error)
+{
+  BuilderPathTable *self;
+  gsize size;
+  const guint8 *data = g_bytes_get_data (bytes, &size);
+  const guint8 *p = data;
+  const guint8 *end = data + size;
+  guint64 n_paths, i;
+  guint64 prev_len = 0;
+
+  /* Check it all once, so that iterating doesn't have to */
+  if (!get_varint (&p, end, &n_paths) || n_paths > size)
+    goto invalid;
+
+  for (i = 0; i < n_paths; i++)
+    {
+      guint64 shared, suffix_len;
+
+      if (!get_varint (&p, end, &shared) ||
+          !get_varint (&p, end, &suffix_len) ||
+          shared > prev_len ||
+          suffix_len > (guint64) (end - p) ||
+          memchr (p, 0, suffix_len) != NULL)
+        goto invalid;
+
+      p += suffix_len;
+      prev_len = shared + suffix_len;
+    }
+
+  if (p != end)
+    goto invalid;
+
+  self = g_new0 (BuilderPathTable, 1);
+  g_atomic_ref_count_init (&self->ref_count);
+  self->n_paths = n_paths;
+  self->data = g_bytes_ref (bytes);
+
+  return self;
+
+invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid path table");
+  return NULL;
+}
+
+BuilderPathTable *
+builder_path_table_ref (BuilderPathTable *self)
+{
+  g_atomic_ref_count_inc (&self->ref_count);
+  return self;
+}
+
+void
+builder_path_table_unref (BuilderPathTable *self)
+{
+  if (!g_atomic_ref_count_dec (&self->ref_count))
+    return;
+
+  g_bytes_unref (self->data);
+  g_free (self);
+}
+
+guint
+builder_path_table_get_length (BuilderPathTable *self)
+{
+  return self->n_paths;
+}
+
+GBytes *
+builder_path_table_get_bytes (BuilderPathTable *self)
+{
+  return g_bytes_ref (self->data);
+}
+
+void
+builder_path_table_iter_init (BuilderPathTableIter *iter,
+                              BuilderPathTable     *self)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (self->data, &size);
+  guint64 n_paths;
+
+  iter->p = data;
+  iter->end = data + size;
+  (void) get_varint (&iter->p, iter->end, &n_paths);
+  iter->remaining = self->n_paths;
+  iter->path = g_string_new (NULL);
+}
+
+/* The returned path is only valid until the next call */
+gboolean
+builder_path_table_iter_next (BuilderPathTableIter *iter,
+                              const char          **out_path)
+{
+  guint64 shared, suffix_len;
+
+  if (iter->remaining == 0)
+    return FALSE;
+
+  (void) get_varint (&iter->p, iter->end, &shared);
+  (void) get_varint (&iter->p, iter->end, &suffix_len);
+
+  g_string_truncate (iter->path, shared);
+  g_string_append_len (iter->path, (const char *) iter->p, suffix_len);
+  iter->p += suffix_len;
+  iter->remaining--;
+
+  *out_path = iter->path->str;
+  return TRUE;
+}
+
+void
+builder_path_table_iter_clear (BuilderPathTableIter *iter)
+{
+  if (iter->path)
+    g_string_free (iter->path, TRUE);
+  iter->path = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUILDER_PATH_TABLE_H__
+#define __BUILDER_PATH_TABLE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct BuilderPathTable BuilderPathTable;
+
+typedef struct
+{
+  /*< private >*/
+  const guint8 *p;
+  const guint8 *end;
+  guint         remaining;
+  GString      *path;
+} BuilderPathTableIter;
+
+BuilderPathTable *builder_path_table_new (const char * const *paths,
+                                          gsize               n_paths);
+BuilderPathTable *builder_path_table_new_from_bytes (GBytes  *bytes,
+                                                     GError **error);
+BuilderPathTable *builder_path_table_ref (BuilderPathTable *self);
+void              builder_path_table_unref (BuilderPathTable *self);
+guint             builder_path_table_get_length (BuilderPathTable *self);
+GBytes *          builder_path_table_get_bytes (BuilderPathTable *self);
+
+void              builder_path_table_iter_init (BuilderPathTableIter *iter,
+                                                BuilderPathTable     *self);
+gboolean          builder_path_table_iter_next (BuilderPathTableIter *iter,
+                                                const char          **out_path);
+void              builder_path_table_iter_clear (BuilderPathTableIter *iter);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderPathTable, builder_path_table_unref)
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (BuilderPathTableIter, builder_path_table_iter_clear)
+
+G_END_DECLS
+
+#endif /* __BUILDER_PATH_TABLE_H__ */
@@ -34,57 +34,105 @@
 #include "builder-utils.h"
 #include "builder-post-process.h"
 
-static gboolean
-invalidate_old_python_compiled (const char *path,
-                                const char *rel_path,
-                                GError **error)
+typedef struct
 {
-  struct stat stbuf;
-  g_autofree char *pyc = NULL;
-  g_autofree char *pyo = NULL;
-  g_autofree char *dir = NULL;
-  g_autofree char *py3dir = NULL;
-  g_autofree char *pyfilename = NULL;
-  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  char       *path;
+  char       *rel_path;
+  GHashTable *stems;
+} PythonDir;
 
+typedef struct
+{
+  char *path;
+  char *rel_path;
+} PythonFile;
 
-  /* This is a python file, not a .py[oc]. If it changed (mtime != 0) then
-   * this needs to invalidate any old (mtime == 0) .py[oc] files that could refer to it.
-   */
+static void
+python_dir_free (PythonDir *py_dir)
+{
+  g_free (py_dir->path);
+  g_free (py_dir->rel_path);
+  g_hash_table_unref (py_dir->stems);
+  g_free (py_dir);
+}
 
-  if (lstat (path, &stbuf) != 0)
-    {
-      g_warning ("Can't stat %s", rel_path);
-      return TRUE;
-    }
+static void
+python_file_free (PythonFile *py_file)
+{
+  g_free (py_file->path);
+  g_free (py_file->rel_path);
+  g_free (py_file);
+}
 
-  if (stbuf.st_mtime == OSTREE_TIMESTAMP)
-    return TRUE; /* Previously handled .py */
+static gboolean
+stem_matches (GHashTable *stems,
+              const char *name)
+{
+  g_autofree char *prefix = g_strdup (name);
+  char *dot;
 
-  pyc = g_strconcat (path, "c", NULL);
-  if (lstat (pyc, &stbuf) == 0 &&
-      stbuf.st_mtime == OSTREE_TIMESTAMP)
+  /* Stems include the trailing dot, like "foo." for foo.py, so check
+     each prefix of name that ends in a dot */
+  for (dot = strchr (prefix, '.'); dot != NULL; dot = strchr (dot + 1, '.'))
     {
-      g_print ("Removing stale file %sc\n", rel_path);
-      if (unlink (pyc) != 0)
-        g_warning ("Unable to delete %s", pyc);
+      char saved = dot[1];
+      gboolean found;
+
+      dot[1] = 0;
+      found = g_hash_table_contains (stems, prefix);
+      dot[1] = saved;
+
+      if (found)
+        return TRUE;
     }
 
-  pyo = g_strconcat (path, "o", NULL);
-  if (lstat (pyo, &stbuf) == 0 &&
-      stbuf.st_mtime == OSTREE_TIMESTAMP)
+  return FALSE;
+}
+
+static gboolean
+invalidate_old_python_compiled (gpointer  data,
+                                GError  **error)
+{
+  PythonDir *py_dir = data;
+  g_autofree char *py3dir = NULL;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  GHashTableIter iter;
+  gpointer key;
+  struct stat stbuf;
+
+  /* These are the python files (not .py[oc]) in one directory that changed
+   * (mtime != 0) in this module. They need to invalidate any old (mtime == 0)
+   * .py[oc] files that could refer to them.
+   */
+
+  g_hash_table_iter_init (&iter, py_dir->stems);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      g_print ("Removing stale file %so\n", rel_path);
-      if (unlink (pyo) != 0)
-        g_warning ("Unable to delete %s", pyo);
+      const char *stem = key;
+      g_autofree char *pyc = g_strconcat (py_dir->path, "/", stem, "pyc", NULL);
+      g_autofree char *pyo = g_strconcat (py_dir->path, "/", stem, "pyo", NULL);
+
+      if (lstat (pyc, &stbuf) == 0 &&
+          stbuf.st_mtime == OSTREE_TIMESTAMP)
+        {
+          g_print ("Removing stale file %s/%spyc\n", py_dir->rel_path, stem);
+          if (unlink (pyc) != 0)
+            g_warning ("Unable to delete %s", pyc);
+        }
+
+      if (lstat (pyo, &stbuf) == 0 &&
+          stbuf.st_mtime == OSTREE_TIMESTAMP)
+        {
+          g_print ("Removing stale file %s/%spyo\n", py_dir->rel_path, stem);
+          if (unlink (pyo) != 0)
+            g_warning ("Unable to delete %s", pyo);
+        }
     }
 
-  /* Handle python3 which is in a __pycache__ subdir */
+  /* Handle python3 which is in a __pycache__ subdir, scanned once for all
+     the python files in the directory */
 
-  pyfilename = g_path_get_basename (path);
-  pyfilename[strlen (pyfilename) - 2] = 0; /* skip "py" */
-  dir = g_path_get_dirname (path);
-  py3dir = g_build_filename (dir, "__pycache__", NULL);
+  py3dir = g_build_filename (py_dir->path, "__pycache__", NULL);
 
   if (glnx_dirfd_iterator_init_at (AT_FDCWD, py3dir, FALSE, &dfd_iter, NULL))
     {
@@ -96,13 +144,13 @@ invalidate_old_python_compiled (const char *path,
                 g_str_has_suffix (dent->d_name, ".pyo")))
             continue;
 
-          if (!g_str_has_prefix (dent->d_name, pyfilename))
+          if (!stem_matches (py_dir->stems, dent->d_name))
             continue;
 
           if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
               stbuf.st_mtime == OSTREE_TIMESTAMP)
             {
-              g_print ("Removing stale file %s/__pycache__/%s\n", rel_path, dent->d_name);
+              g_print ("Removing stale file %s/__pycache__/%s\n", py_dir->rel_path, dent->d_name);
               if (unlinkat (dfd_iter.fd, dent->d_name, 0))
                 g_warning ("Unable to delete %s", dent->d_name);
             }
@@ -129,6 +177,7 @@ fixup_python_time_stamp (const char *path,
   gsize mtime_offset;
   g_autofree char *py_path = NULL;
   struct stat stbuf;
+  struct stat pyc_stbuf;
   gboolean remove_pyc = FALSE;
   g_autofree char *path_basename = g_path_get_basename (path);
   g_autofree char *dir = g_path_get_dirname (path);
@@ -137,7 +186,9 @@ fixup_python_time_stamp (const char *path,
   fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
   if (fd == -1)
     {
-      g_warning ("Can't open %s", rel_path);
+      /* Already removed as stale */
+      if (errno != ENOENT)
+        g_warning ("Can't open %s", rel_path);
       return TRUE;
     }
 
@@ -265,6 +316,35 @@ fixup_python_time_stamp (const char *path,
       return TRUE;
     }
 
+  /* Change to mtime 0 which is what ostree uses for checkouts */
+  buffer[mtime_offset+0] = OSTREE_TIMESTAMP;
+  buffer[mtime_offset+1] = buffer[mtime_offset+2] = buffer[mtime_offset+3] = 0;
+
+  /* If the file has no other links (like the one in the cache repo for
+     checked out files), we can just patch the header in place */
+  if (fstat (fd, &pyc_stbuf) == 0 && pyc_stbuf.st_nlink == 1)
+    {
+      glnx_autofd int write_fd = open (path, O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+      struct stat write_stbuf;
+
+      if (write_fd != -1 &&
+          fstat (write_fd, &write_stbuf) == 0 &&
+          write_stbuf.st_dev == pyc_stbuf.st_dev &&
+          write_stbuf.st_ino == pyc_stbuf.st_ino)
+        {
+          res = pwrite (write_fd, buffer, PYTHON_HEADER_SIZE, 0);
+          if (res != PYTHON_HEADER_SIZE)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          g_print ("Fixed up header mtime for %s\n", rel_path);
+          return TRUE;
+        }
+    }
+
+  /* Otherwise replace it with a copy, which is a reflink if possible */
   if (!glnx_open_tmpfile_linkable_at (AT_FDCWD, dir,
                                       O_RDWR | O_CLOEXEC | O_NOFOLLOW,
                                       &tmpf,
@@ -274,10 +354,6 @@ fixup_python_time_stamp (const char *path,
   if (glnx_regfile_copy_bytes (fd, tmpf.fd, (off_t)-1) < 0)
     return glnx_throw_errno_prefix (error, "copyfile");
 
-  /* Change to mtime 0 which is what ostree uses for checkouts */
-  buffer[mtime_offset+0] = OSTREE_TIMESTAMP;
-  buffer[mtime_offset+1] = buffer[mtime_offset+2] = buffer[mtime_offset+3] = 0;
-
   res = pwrite (tmpf.fd, buffer, PYTHON_HEADER_SIZE, 0);
   if (res != PYTHON_HEADER_SIZE)
     {
@@ -300,16 +376,89 @@ fixup_python_time_stamp (const char *path,
   return TRUE;
 }
 
+static gboolean
+fixup_python_compiled (gpointer  data,
+                       GError  **error)
+{
+  PythonFile *py_file = data;
+
+  return fixup_python_time_stamp (py_file->path, py_file->rel_path, error);
+}
+
+typedef gboolean (*PythonFixupFunc) (gpointer  data,
+                                     GError  **error);
+
+typedef struct
+{
+  PythonFixupFunc func;
+  GMutex          lock;
+  GError         *error;
+} PythonFixupPool;
+
+static void
+python_fixup_worker (gpointer data,
+                     gpointer user_data)
+{
+  PythonFixupPool *pool = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!pool->func (data, &local_error))
+    {
+      g_mutex_lock (&pool->lock);
+      if (pool->error == NULL)
+        pool->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&pool->lock);
+    }
+}
+
+static gboolean
+run_python_fixups (GPtrArray       *items,
+                   PythonFixupFunc  func,
+                   GError         **error)
+{
+  PythonFixupPool pool = { func };
+  GThreadPool *threads;
+  guint i;
+
+  if (items->len == 0)
+    return TRUE;
+
+  g_mutex_init (&pool.lock);
+
+  threads = g_thread_pool_new (python_fixup_worker, &pool,
+                               MIN (g_get_num_processors (), items->len),
+                               FALSE, NULL);
+  for (i = 0; i < items->len; i++)
+    g_thread_pool_push (threads, g_ptr_array_index (items, i), NULL);
+
+  /* Waits for all queued items */
+  g_thread_pool_free (threads, FALSE, TRUE);
+
+  g_mutex_clear (&pool.lock);
+
+  if (pool.error != NULL)
+    {
+      g_propagate_error (error, pool.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_post_process_python_time_stamp (GFile *app_dir,
-                                        GPtrArray *changed,
+                                        BuilderPathTable *changed,
                                         GError **error)
 {
-  int i;
-
-  for (i = 0; i < changed->len; i++)
+  g_autoptr(GHashTable) py_dirs_ht = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) py_dirs = g_ptr_array_new_with_free_func ((GDestroyNotify) python_dir_free);
+  g_autoptr(GPtrArray) compiled = g_ptr_array_new_with_free_func ((GDestroyNotify) python_file_free);
+  g_auto(BuilderPathTableIter) iter = { 0 };
+  const char *rel_path;
+
+  builder_path_table_iter_init (&iter, changed);
+  while (builder_path_table_iter_next (&iter, &rel_path))
     {
-      const char *rel_path = (char *) g_ptr_array_index (changed, i);
       g_autoptr(GFile) file = NULL;
       g_autofree char *path = NULL;
       struct stat stbuf;
@@ -330,29 +479,57 @@ builder_post_process_python_time_stamp (GFile *app_dir,
 
       if (g_str_has_suffix (rel_path, ".py"))
         {
-          if (!invalidate_old_python_compiled (path, rel_path, error))
-            return FALSE;
+          g_autofree char *dir = NULL;
+          g_autofree char *stem = NULL;
+          PythonDir *py_dir;
+
+          if (stbuf.st_mtime == OSTREE_TIMESTAMP)
+            continue; /* Previously handled .py */
+
+          dir = g_path_get_dirname (path);
+          py_dir = g_hash_table_lookup (py_dirs_ht, dir);
+          if (py_dir == NULL)
+            {
+              py_dir = g_new0 (PythonDir, 1);
+              py_dir->path = g_steal_pointer (&dir);
+              py_dir->rel_path = g_path_get_dirname (rel_path);
+              py_dir->stems = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+              g_hash_table_insert (py_dirs_ht, py_dir->path, py_dir);
+              g_ptr_array_add (py_dirs, py_dir);
+            }
+
+          stem = g_path_get_basename (path);
+          stem[strlen (stem) - 2] = 0; /* skip "py" */
+          g_hash_table_add (py_dir->stems, g_steal_pointer (&stem));
         }
       else
         {
-          if (!fixup_python_time_stamp (path, rel_path, error))
-            return FALSE;
+          PythonFile *py_file = g_new0 (PythonFile, 1);
+          py_file->path = g_steal_pointer (&path);
+          py_file->rel_path = g_strdup (rel_path);
+          g_ptr_array_add (compiled, py_file);
         }
     }
 
-  return TRUE;
+  /* Drop the stale bytecode first, so the fixups don't race with
+     removing the same files */
+  if (!run_python_fixups (py_dirs, invalidate_old_python_compiled, error))
+    return FALSE;
+
+  return run_python_fixups (compiled, fixup_python_compiled, error);
 }
 
 static gboolean
 builder_post_process_strip (GFile *app_dir,
-                            GPtrArray *changed,
+                            BuilderPathTable *changed,
                             GError        **error)
 {
-  int i;
+  g_auto(BuilderPathTableIter) iter = { 0 };
+  const char *rel_path;
 
-  for (i = 0; i < changed->len; i++)
+  builder_path_table_iter_init (&iter, changed);
+  while (builder_path_table_iter_next (&iter, &rel_path))
     {
-      const char *rel_path = (char *) g_ptr_array_index (changed, i);
       g_autoptr(GFile) file = g_file_resolve_relative_path (app_dir, rel_path);
       g_autofree char *path = g_file_get_path (file);
       gboolean is_shared, is_stripped;
@@ -381,17 +558,18 @@ builder_post_process_strip (GFile *app_dir,
 
 static gboolean
 builder_post_process_debuginfo (GFile          *app_dir,
-                                GPtrArray      *changed,
+                                BuilderPathTable *changed,
 				BuilderPostProcessFlags flags,
                                 BuilderContext *context,
                                 GError        **error)
 {
   g_autofree char *app_dir_path = g_file_get_path (app_dir);
-  int j;
+  g_auto(BuilderPathTableIter) iter = { 0 };
+  const char *rel_path;
 
-  for (j = 0; j < changed->len; j++)
+  builder_path_table_iter_init (&iter, changed);
+  while (builder_path_table_iter_next (&iter, &rel_path))
     {
-      const char *rel_path = (char *) g_ptr_array_index (changed, j);
       g_autoptr(GFile) file = g_file_resolve_relative_path (app_dir, rel_path);
       g_autofree char *path = g_file_get_path (file);
       g_autofree char *debug_path = NULL;
@@ -537,7 +715,7 @@ builder_post_process (BuilderPostProcessFlags flags,
                       BuilderContext *context,
                       GError        **error)
 {
-  g_autoptr(GPtrArray) changed = NULL;
+  g_autoptr(BuilderPathTable) changed = NULL;
 
   if (!builder_cache_get_outstanding_changes (cache, &changed, error))
     return FALSE;
@@ -21,11 +21,13 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <unistd.h>
 
 #include "builder-flatpak-utils.h"
 
@@ -38,6 +40,7 @@ struct BuilderSourceDir
 
   char         *path;
   char        **skip;
+  gboolean      no_copy;
 };
 
 typedef struct
@@ -51,6 +54,7 @@ enum {
   PROP_0,
   PROP_PATH,
   PROP_SKIP,
+  PROP_NO_COPY,
   LAST_PROP
 };
 
@@ -83,6 +87,10 @@ builder_source_dir_get_property (GObject    *object,
       g_value_set_boxed (value, self->skip);
       break;
 
+    case PROP_NO_COPY:
+      g_value_set_boolean (value, self->no_copy);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -110,6 +118,10 @@ builder_source_dir_set_property (GObject      *object,
       g_strfreev (tmp);
       break;
 
+    case PROP_NO_COPY:
+      self->no_copy = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -171,32 +183,171 @@ builder_source_dir_download (BuilderSource  *source,
   return TRUE;
 }
 
+/* The skip entries are resolved against source_dir, which must be the
+   same path the files are then looked up with */
 static GPtrArray *
-builder_source_dir_get_skip (BuilderSource  *source,
-                             BuilderContext *context)
+get_skip_in (BuilderSourceDir *self,
+             BuilderContext   *context,
+             GFile            *source_dir)
 {
-  BuilderSourceDir *self = BUILDER_SOURCE_DIR (source);
   g_autoptr(GPtrArray) skip = g_ptr_array_new_with_free_func (g_object_unref);
   int i;
 
   g_ptr_array_add (skip, g_object_ref (builder_context_get_app_dir_raw (context)));
   g_ptr_array_add (skip, g_object_ref (builder_context_get_state_dir (context)));
 
-  if (self->skip)
+  for (i = 0; source_dir != NULL && self->skip != NULL && self->skip[i] != NULL; i++)
     {
-      g_autoptr(GFile) source_dir = get_source_file (self, context, NULL);
-
-      for (i = 0; source_dir != NULL && self->skip[i] != NULL; i++)
-        {
-          GFile *f = g_file_resolve_relative_path (source_dir, self->skip[i]);
-          if (f)
-            g_ptr_array_add (skip, f);
-        }
+      GFile *f = g_file_resolve_relative_path (source_dir, self->skip[i]);
+      if (f)
+        g_ptr_array_add (skip, f);
     }
 
   return g_steal_pointer (&skip);
 }
 
+static GPtrArray *
+builder_source_dir_get_skip (BuilderSource  *source,
+                             BuilderContext *context)
+{
+  BuilderSourceDir *self = BUILDER_SOURCE_DIR (source);
+  g_autoptr(GFile) source_dir = get_source_file (self, context, NULL);
+
+  return get_skip_in (self, context, source_dir);
+}
+
+static gboolean
+is_skipped (GPtrArray *skip,
+            GFile     *file)
+{
+  int i;
+
+  for (i = 0; i < skip->len; i++)
+    {
+      GFile *f = g_ptr_array_index (skip, i);
+
+      if (g_file_equal (file, f) || g_file_has_prefix (file, f))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* The symlinks point at the canonical location, as that is what is
+   made available in the sandbox */
+static GFile *
+get_canonical_source_file (BuilderSourceDir *self,
+                           BuilderContext   *context,
+                           GError          **error)
+{
+  g_autoptr(GFile) src = NULL;
+  g_autofree char *canonical = NULL;
+
+  src = get_source_file (self, context, error);
+  if (src == NULL)
+    return NULL;
+
+  canonical = realpath (flatpak_file_get_path_cached (src), NULL);
+  if (canonical == NULL)
+    return g_steal_pointer (&src);
+
+  return g_file_new_for_path (canonical);
+}
+
+static gboolean link_tree (GFile      *src,
+                           GFile      *dest,
+                           GFile      *source_dir,
+                           GPtrArray  *skip,
+                           GError    **error);
+
+/* Makes dest a symlink to src, or for directories a real directory
+   with symlinks for what is in it. Symlinks in src are copied. */
+static gboolean
+link_file (GFile      *src,
+           GFileType   type,
+           GFile      *dest,
+           GFile      *source_dir,
+           GPtrArray  *skip,
+           GError    **error)
+{
+  g_autoptr(GFile) dest_parent = g_file_get_parent (dest);
+  const char *target;
+  g_autofree char *symlink_target = NULL;
+
+  /* Don't follow symlinks the build created out of the build dir */
+  if (!flatpak_file_is_in (dest_parent, source_dir))
+    return flatpak_fail (error, "dest is not pointing inside build directory");
+
+  if (type == G_FILE_TYPE_DIRECTORY)
+    return link_tree (src, dest, source_dir, skip, error);
+
+  if (type == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      g_autoptr(GFileInfo) info = g_file_query_info (src, G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET,
+                                                     G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                                     NULL, error);
+      if (info == NULL)
+        return FALSE;
+
+      symlink_target = g_strdup (g_file_info_get_symlink_target (info));
+      target = symlink_target;
+    }
+  else
+    target = flatpak_file_get_path_cached (src);
+
+  if (unlink (flatpak_file_get_path_cached (dest)) != 0 && errno != ENOENT)
+    return glnx_throw_errno_prefix (error, "unlink %s", flatpak_file_get_path_cached (dest));
+
+  return g_file_make_symbolic_link (dest, target, NULL, error);
+}
+
+static gboolean
+link_tree (GFile      *src,
+           GFile      *dest,
+           GFile      *source_dir,
+           GPtrArray  *skip,
+           GError    **error)
+{
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+
+  /* Replaces what an earlier build left in place of the directory */
+  if (g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) != G_FILE_TYPE_DIRECTORY &&
+      unlink (flatpak_file_get_path_cached (dest)) != 0 && errno != ENOENT)
+    return glnx_throw_errno_prefix (error, "unlink %s", flatpak_file_get_path_cached (dest));
+
+  if (!flatpak_mkdir_p (dest, NULL, error))
+    return FALSE;
+
+  enumerator = g_file_enumerate_children (src, "standard::name,standard::type",
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          NULL, error);
+  if (enumerator == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      GFile *child;
+      g_autoptr(GFile) dest_child = NULL;
+
+      if (!g_file_enumerator_iterate (enumerator, &info, &child, NULL, error))
+        return FALSE;
+
+      if (info == NULL)
+        break;
+
+      if (is_skipped (skip, child))
+        continue;
+
+      dest_child = g_file_get_child (dest, g_file_info_get_name (info));
+      if (!link_file (child, g_file_info_get_file_type (info), dest_child,
+                      source_dir, skip, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_source_dir_extract (BuilderSource  *source,
                             GFile          *dest,
@@ -209,11 +360,18 @@ builder_source_dir_extract (BuilderSource  *source,
   g_autoptr(GFile) src = NULL;
   g_autoptr(GPtrArray) skip = NULL;
 
-  src = get_source_file (self, context, error);
+  if (self->no_copy)
+    src = get_canonical_source_file (self, context, error);
+  else
+    src = get_source_file (self, context, error);
   if (src == NULL)
     return FALSE;
 
-  skip = builder_source_dir_get_skip (source, context);
+  skip = get_skip_in (self, context, src);
+
+  if (self->no_copy)
+    return link_tree (src, dest, source_dir, skip, error);
+
   if (!flatpak_cp_a (src, dest, source_dir,
                      FLATPAK_CP_FLAGS_MERGE|FLATPAK_CP_FLAGS_NO_CHOWN,
                      skip, NULL, error))
@@ -222,6 +380,142 @@ builder_source_dir_extract (BuilderSource  *source,
   return TRUE;
 }
 
+gboolean
+builder_source_dir_get_no_copy (BuilderSourceDir *self)
+{
+  return self->no_copy;
+}
+
+/* For no-copy sources, the directory the build dir links into. It
+   has to be made available read-only in the build sandbox. */
+GFile *
+builder_source_dir_get_linked_dir (BuilderSourceDir *self,
+                                   BuilderContext   *context)
+{
+  if (!self->no_copy)
+    return NULL;
+
+  return get_canonical_source_file (self, context, NULL);
+}
+
+gboolean
+builder_source_dir_add_watch (BuilderSourceDir *self,
+                              BuilderWatch     *watch,
+                              BuilderContext   *context,
+                              GError          **error)
+{
+  g_autoptr(GFile) src = NULL;
+  g_autoptr(GPtrArray) skip = NULL;
+
+  src = get_source_file (self, context, error);
+  if (src == NULL)
+    return FALSE;
+
+  skip = builder_source_dir_get_skip (BUILDER_SOURCE (self), context);
+
+  return builder_watch_add_dir (watch, src, skip, error);
+}
+
+/* Brings the copy previously extracted into source_dir up to date,
+ * for the given changed (or removed) files of the source directory. */
+gboolean
+builder_source_dir_sync (BuilderSourceDir *self,
+                         GFile            *source_dir,
+                         GPtrArray        *changed,
+                         BuilderContext   *context,
+                         GError          **error)
+{
+  BuilderSource *source = BUILDER_SOURCE (self);
+  g_autoptr(GFile) src = NULL;
+  g_autoptr(GFile) canonical_src = NULL;
+  g_autoptr(GFile) real_dest = NULL;
+  g_autoptr(GPtrArray) skip = NULL;
+  g_autoptr(GPtrArray) canonical_skip = NULL;
+  int i;
+
+  src = get_source_file (self, context, error);
+  if (src == NULL)
+    return FALSE;
+
+  if (self->no_copy)
+    {
+      canonical_src = get_canonical_source_file (self, context, error);
+      if (canonical_src == NULL)
+        return FALSE;
+      canonical_skip = get_skip_in (self, context, canonical_src);
+    }
+
+  if (source->dest != NULL)
+    real_dest = g_file_resolve_relative_path (source_dir, source->dest);
+  else
+    real_dest = g_object_ref (source_dir);
+
+  skip = builder_source_dir_get_skip (source, context);
+
+  for (i = 0; i < changed->len; i++)
+    {
+      GFile *file = g_ptr_array_index (changed, i);
+      g_autofree char *rel_path = g_file_get_relative_path (src, file);
+      g_autoptr(GFile) dest = NULL;
+      g_autoptr(GFile) dest_parent = NULL;
+      GFileType type;
+
+      if (rel_path == NULL || is_skipped (skip, file))
+        continue;
+
+      dest = g_file_resolve_relative_path (real_dest, rel_path);
+      dest_parent = g_file_get_parent (dest);
+
+      type = g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
+      if (type == G_FILE_TYPE_UNKNOWN)
+        {
+          if (g_file_query_exists (dest_parent, NULL) &&
+              flatpak_file_is_in (dest_parent, source_dir) &&
+              !flatpak_rm_rf (dest, NULL, error))
+            return FALSE;
+          continue;
+        }
+
+      if (!flatpak_mkdir_p (dest_parent, NULL, error))
+        return FALSE;
+
+      if (self->no_copy)
+        {
+          g_autoptr(GFile) target = g_file_resolve_relative_path (canonical_src, rel_path);
+
+          /* Changed files are already seen through their symlinks */
+          if (type == G_FILE_TYPE_REGULAR &&
+              g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_SYMBOLIC_LINK)
+            continue;
+
+          if (!link_file (target, type, dest, source_dir, canonical_skip, error))
+            return FALSE;
+          continue;
+        }
+
+      /* Don't follow symlinks the build created out of the build dir */
+      if (!flatpak_file_is_in (dest_parent, source_dir))
+        return flatpak_fail (error, "dest is not pointing inside build directory");
+
+      if (type == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!flatpak_cp_a (file, dest, source_dir,
+                             FLATPAK_CP_FLAGS_MERGE|FLATPAK_CP_FLAGS_NO_CHOWN,
+                             skip, NULL, error))
+            return FALSE;
+        }
+      else
+        {
+          (void) unlink (flatpak_file_get_path_cached (dest));
+          if (!g_file_copy (file, dest, G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS,
+                            NULL, NULL, NULL, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_source_dir_bundle (BuilderSource  *source,
                             BuilderContext *context,
@@ -306,6 +600,13 @@ builder_source_dir_class_init (BuilderSourceDirClass *klass)
                                                        "",
                                                        G_TYPE_STRV,
                                                        G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_NO_COPY,
+                                   g_param_spec_boolean ("no-copy",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
 }
 
 static void
@@ -22,6 +22,7 @@
 #define __BUILDER_SOURCE_DIR_H__
 
 #include "builder-source.h"
+#include "builder-watch.h"
 
 G_BEGIN_DECLS
 
@@ -33,6 +34,19 @@ typedef struct BuilderSourceDir BuilderSourceDir;
 
 GType builder_source_dir_get_type (void);
 
+gboolean builder_source_dir_add_watch (BuilderSourceDir *self,
+                                       BuilderWatch     *watch,
+                                       BuilderContext   *context,
+                                       GError          **error);
+gboolean builder_source_dir_get_no_copy (BuilderSourceDir *self);
+GFile *  builder_source_dir_get_linked_dir (BuilderSourceDir *self,
+                                           BuilderContext   *context);
+gboolean builder_source_dir_sync (BuilderSourceDir *self,
+                                  GFile            *source_dir,
+                                  GPtrArray        *changed,
+                                  BuilderContext   *context,
+                                  GError          **error);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderSourceDir, g_object_unref)
 
 G_END_DECLS
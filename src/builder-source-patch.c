@@ -230,13 +230,14 @@ builder_source_patch_download (BuilderSource  *source,
   return TRUE;
 }
 
+/* patch only takes a single patch_path, git can apply several at once */
 static gboolean
-patch (GFile      *dir,
-       gboolean    use_git,
-       gboolean    use_git_am,
-       const char *patch_path,
-       char      **extra_options,
-       GError    **error,
+patch (GFile       *dir,
+       gboolean     use_git,
+       gboolean     use_git_am,
+       const char **patch_paths,
+       char       **extra_options,
+       GError     **error,
        ...)
 {
   gboolean res;
@@ -265,10 +266,12 @@ patch (GFile      *dir,
   while ((arg = va_arg (ap, const gchar *)))
     g_ptr_array_add (args, (gchar *) arg);
   if (use_git || use_git_am) {
-    g_ptr_array_add (args, (char *) patch_path);
+    for (i = 0; patch_paths[i] != NULL; i++)
+      g_ptr_array_add (args, (char *) patch_paths[i]);
   } else {
+    g_assert (patch_paths[1] == NULL);
     g_ptr_array_add (args, "-i");
-    g_ptr_array_add (args, (char *) patch_path);
+    g_ptr_array_add (args, (char *) patch_paths[0]);
   }
   g_ptr_array_add (args, NULL);
 
@@ -281,6 +284,32 @@ patch (GFile      *dir,
   return res;
 }
 
+/* git apply checks all patches before touching anything, so when this
+   fails nothing has been applied and they can be retried one by one */
+static gboolean
+apply_git_batch (GFile      *dest,
+                 GPtrArray  *patchfiles,
+                 guint       strip_components,
+                 char      **options,
+                 GError    **error)
+{
+  g_autofree char *strip_arg = g_strdup_printf ("-p%u", strip_components);
+  g_autoptr(GPtrArray) patch_paths = g_ptr_array_new_with_free_func (g_free);
+  int i;
+
+  for (i = 0; i < patchfiles->len; i++)
+    {
+      GFile *patchfile = g_ptr_array_index (patchfiles, i);
+      g_autofree char *basename = g_file_get_basename (patchfile);
+
+      g_print ("Applying patch %s\n", basename);
+      g_ptr_array_add (patch_paths, g_file_get_path (patchfile));
+    }
+  g_ptr_array_add (patch_paths, NULL);
+
+  return patch (dest, TRUE, FALSE, (const char **) patch_paths->pdata, options, error, strip_arg, NULL);
+}
+
 static gboolean
 builder_source_patch_extract (BuilderSource  *source,
                               GFile          *dest,
@@ -312,6 +341,16 @@ builder_source_patch_extract (BuilderSource  *source,
   if (srcs == NULL)
     return FALSE;
 
+  if (self->use_git && srcs->len > 1)
+    {
+      g_autoptr(GError) my_error = NULL;
+
+      if (apply_git_batch (dest, srcs, self->strip_components, self->options, &my_error))
+        return TRUE;
+
+      g_print ("Failed to apply the patches at once (%s), applying them one by one\n", my_error->message);
+    }
+
   strip_components = g_strdup_printf ("-p%u", self->strip_components);
 
   for (i = 0; i < srcs->len; i++)
@@ -319,9 +358,87 @@ builder_source_patch_extract (BuilderSource  *source,
       GFile *patchfile = g_ptr_array_index (srcs, i);
       g_autofree char *basename = g_file_get_basename (patchfile);
       g_autofree char *patch_path = g_file_get_path (patchfile);
+      const char *patch_paths[] = { patch_path, NULL };
 
       g_print ("Applying patch %s\n", basename);
-      if (!patch (dest, self->use_git, self->use_git_am, patch_path, self->options, error, strip_components, NULL))
+      if (!patch (dest, self->use_git, self->use_git_am, patch_paths, self->options, error, strip_components, NULL))
+        {
+          g_prefix_error (error, "Failed to apply patch %s: ", basename);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+options_equal (char **a,
+               char **b)
+{
+  const char * const empty[] = { NULL };
+
+  return g_strv_equal (a ? (const char * const *) a : empty,
+                       b ? (const char * const *) b : empty);
+}
+
+/* Whether other can be applied in the same git apply run as self */
+gboolean
+builder_source_patch_can_batch (BuilderSourcePatch *self,
+                                BuilderSourcePatch *other)
+{
+  return
+    self->use_git && !self->use_git_am &&
+    other->use_git && !other->use_git_am &&
+    self->strip_components == other->strip_components &&
+    g_strcmp0 (BUILDER_SOURCE (self)->dest, BUILDER_SOURCE (other)->dest) == 0 &&
+    options_equal (self->options, other->options);
+}
+
+/* Applies a run of patch sources that can be batched with the first
+   one in a single git apply. If that fails they are applied one by one,
+   so the error names the patch that doesn't apply. */
+gboolean
+builder_source_patch_extract_batch (GPtrArray      *patches,
+                                    GFile          *source_dir,
+                                    BuilderOptions *build_options,
+                                    BuilderContext *context,
+                                    GError        **error)
+{
+  BuilderSourcePatch *first = g_ptr_array_index (patches, 0);
+  g_autoptr(GPtrArray) patchfiles = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GFile) dest = NULL;
+  g_autoptr(GError) my_error = NULL;
+  int i, j;
+
+  for (i = 0; i < patches->len; i++)
+    {
+      BuilderSourcePatch *self = g_ptr_array_index (patches, i);
+      g_autoptr(GPtrArray) srcs = NULL;
+
+      g_assert (builder_source_patch_can_batch (first, self));
+
+      srcs = get_source_files (self, context, error);
+      if (srcs == NULL)
+        return FALSE;
+
+      for (j = 0; j < srcs->len; j++)
+        g_ptr_array_add (patchfiles, g_object_ref (g_ptr_array_index (srcs, j)));
+    }
+
+  dest = builder_source_get_extract_dest (BUILDER_SOURCE (first), source_dir, error);
+  if (dest == NULL)
+    return FALSE;
+
+  if (apply_git_batch (dest, patchfiles, first->strip_components, first->options, &my_error))
+    return TRUE;
+
+  g_print ("Failed to apply the patches at once (%s), applying them one by one\n", my_error->message);
+
+  for (i = 0; i < patches->len; i++)
+    {
+      BuilderSource *source = g_ptr_array_index (patches, i);
+
+      if (!builder_source_extract (source, source_dir, build_options, context, error))
         return FALSE;
     }
 
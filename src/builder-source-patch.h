@@ -33,6 +33,14 @@ typedef struct BuilderSourcePatch BuilderSourcePatch;
 
 GType builder_source_patch_get_type (void);
 
+gboolean builder_source_patch_can_batch (BuilderSourcePatch *self,
+                                         BuilderSourcePatch *other);
+gboolean builder_source_patch_extract_batch (GPtrArray      *patches,
+                                             GFile          *source_dir,
+                                             BuilderOptions *build_options,
+                                             BuilderContext *context,
+                                             GError        **error);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderSourcePatch, g_object_unref)
 
 G_END_DECLS
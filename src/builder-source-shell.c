@@ -130,6 +130,7 @@ run_script (BuilderContext *context,
   env = builder_options_get_env (build_options, context);
 
   args = g_ptr_array_new_with_free_func (g_free);
+  builder_context_add_build_wrapper (context, args);
   g_ptr_array_add (args, g_strdup ("flatpak"));
   g_ptr_array_add (args, g_strdup ("build"));
   g_ptr_array_add (args, g_strdup ("--die-with-parent"));
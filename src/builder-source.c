@@ -387,31 +387,47 @@ ensure_dir_inside_toplevel (GFile          *dest,
   return TRUE;
 }
 
-gboolean
-builder_source_extract (BuilderSource  *self,
-                        GFile          *source_dir,
-                        BuilderOptions *build_options,
-                        BuilderContext *context,
-                        GError        **error)
+/* The directory in source_dir the source is extracted into, which is
+   created if needed */
+GFile *
+builder_source_get_extract_dest (BuilderSource *self,
+                                 GFile         *source_dir,
+                                 GError       **error)
 {
-  BuilderSourceClass *class;
-
   g_autoptr(GFile) real_dest = NULL;
 
-  class = BUILDER_SOURCE_GET_CLASS (self);
-
   if (self->dest != NULL)
     {
       real_dest = g_file_resolve_relative_path (source_dir, self->dest);
 
       if (!ensure_dir_inside_toplevel (real_dest, source_dir, error))
-        return FALSE;
+        return NULL;
     }
   else
     {
       real_dest = g_object_ref (source_dir);
     }
 
+  return g_steal_pointer (&real_dest);
+}
+
+gboolean
+builder_source_extract (BuilderSource  *self,
+                        GFile          *source_dir,
+                        BuilderOptions *build_options,
+                        BuilderContext *context,
+                        GError        **error)
+{
+  BuilderSourceClass *class;
+
+  g_autoptr(GFile) real_dest = NULL;
+
+  class = BUILDER_SOURCE_GET_CLASS (self);
+
+  real_dest = builder_source_get_extract_dest (self, source_dir, error);
+  if (real_dest == NULL)
+    return FALSE;
+
   return class->extract (self, real_dest, source_dir, build_options, context, error);
 }
 
@@ -94,6 +94,9 @@ gboolean builder_source_download (BuilderSource  *self,
                                   gboolean        update_vcs,
                                   BuilderContext *context,
                                   GError        **error);
+GFile *  builder_source_get_extract_dest (BuilderSource *self,
+                                          GFile         *source_dir,
+                                          GError       **error);
 gboolean builder_source_extract (BuilderSource  *self,
                                  GFile          *source_dir,
                                  BuilderOptions *build_options,
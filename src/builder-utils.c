@@ -28,6 +28,7 @@
 #include <gelf.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <stdio.h>
 
 #include <string.h>
@@ -283,6 +284,135 @@ directory_is_empty (const char *path)
   return empty;
 }
 
+/* Parses sizes like "512M" or "4G", using binary units */
+gboolean
+builder_parse_size (const char *str,
+                    guint64    *out_size,
+                    GError    **error)
+{
+  guint64 size;
+  char *end = NULL;
+  int shifts = 0;
+
+  errno = 0;
+  size = g_ascii_strtoull (str, &end, 10);
+  if (errno != 0 || end == str)
+    return flatpak_fail (error, "Invalid size '%s'", str);
+
+  switch (g_ascii_toupper (*end))
+    {
+    case 'T':
+      shifts++;
+      G_GNUC_FALLTHROUGH;
+    case 'G':
+      shifts++;
+      G_GNUC_FALLTHROUGH;
+    case 'M':
+      shifts++;
+      G_GNUC_FALLTHROUGH;
+    case 'K':
+      shifts++;
+      end++;
+      break;
+
+    case '\0':
+      break;
+
+    default:
+      return flatpak_fail (error, "Invalid size '%s'", str);
+    }
+
+  if (*end != '\0' && g_ascii_strcasecmp (end, "B") != 0 &&
+      g_ascii_strcasecmp (end, "iB") != 0)
+    return flatpak_fail (error, "Invalid size '%s'", str);
+
+  while (shifts-- > 0)
+    {
+      if (size > G_MAXUINT64 / 1024)
+        return flatpak_fail (error, "Size '%s' is too large", str);
+      size *= 1024;
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+static gboolean
+get_disk_usage_at (int          dfd,
+                   const char  *path,
+                   guint64     *total,
+                   GError     **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!glnx_fstatat_allow_noent (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (errno == ENOENT)
+        continue;
+
+      *total += (guint64) stbuf.st_blocks * 512;
+
+      if (dent->d_type == DT_DIR &&
+          !get_disk_usage_at (iter.fd, dent->d_name, total, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns the space allocated on disk for everything below dir */
+gboolean
+builder_get_disk_usage (GFile    *dir,
+                        guint64  *out_size,
+                        GError  **error)
+{
+  guint64 total = 0;
+
+  if (!get_disk_usage_at (AT_FDCWD, flatpak_file_get_path_cached (dir), &total, error))
+    return FALSE;
+
+  *out_size = total;
+  return TRUE;
+}
+
+/* Returns MemAvailable from /proc/meminfo in bytes, or 0 if unknown */
+guint64
+builder_get_available_memory (void)
+{
+  g_autofree char *contents = NULL;
+  const char *line;
+  guint64 kb;
+
+  if (!g_file_get_contents ("/proc/meminfo", &contents, NULL, NULL))
+    return 0;
+
+  line = strstr (contents, "MemAvailable:");
+  if (line == NULL)
+    return 0;
+
+  line += strlen ("MemAvailable:");
+  while (*line == ' ')
+    line++;
+
+  kb = g_ascii_strtoull (line, NULL, 10);
+
+  return kb * 1024;
+}
+
 static char *
 locale_name_to_language (const char *name)
 {
@@ -335,6 +465,14 @@ migrate_locale_dir_contents (int      src_dfd,
 
       if (S_ISREG (stx.stx_mode) || S_ISLNK (stx.stx_mode))
         {
+          /* Usually both sides are on the same filesystem, so just move
+           * the file. Otherwise copy it, which tries to reflink first. */
+          if (renameat (src_dfd, tmp_name, dst_dfd, dent->d_name) == 0)
+            continue;
+
+          if (errno != EXDEV)
+            return glnx_throw_errno_prefix (error, "renameat %s", dent->d_name);
+
           if (!glnx_file_copy_at (src_dfd, tmp_name, NULL,
                                   dst_dfd, dent->d_name,
                                   GLNX_FILE_COPY_OVERWRITE |
@@ -351,6 +489,10 @@ migrate_locale_dir_contents (int      src_dfd,
           glnx_autofd int src_child_dfd = -1;
           glnx_autofd int child_dst_dfd = -1;
 
+          /* Move the whole directory if there is nothing to merge with */
+          if (glnx_renameat2_noreplace (src_dfd, tmp_name, dst_dfd, dent->d_name) == 0)
+            continue;
+
           src_child_dfd = glnx_fd_reopen (chase_fd, O_RDONLY | O_DIRECTORY, error);
           if (src_child_dfd < 0)
             return FALSE;
@@ -383,24 +525,46 @@ migrate_lang_dir (int         source_dfd,
                   const char *subdir,
                   GError    **error)
 {
-  glnx_autofd int locale_subdir_dfd = -1;
+  glnx_autofd int parent_dfd = -1;
   g_autofree char *language = locale_name_to_language (lang_name);
   g_autofree char *target = NULL;
+  struct stat lang_st, tmp_st;
+  gboolean is_plain_dir;
 
-  const char *components[] = { language, subdir, lang_name, NULL };
+  const char *components[] = { language, subdir, NULL };
 
-  if (!builder_ensure_dirs_at (separate_dfd, components, &locale_subdir_dfd, error))
+  if (!builder_ensure_dirs_at (separate_dfd, components, &parent_dfd, error))
     return FALSE;
 
-  if (!migrate_locale_dir_contents (lang_dfd, locale_subdir_dfd, error))
-    return FALSE;
+  /* lang_dfd was chased and may be a symlink target, only move the
+   * entry itself if it is the same directory */
+  is_plain_dir = fstat (lang_dfd, &lang_st) == 0 &&
+                 fstatat (source_dfd, src_tmp_name, &tmp_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                 S_ISDIR (tmp_st.st_mode) &&
+                 lang_st.st_dev == tmp_st.st_dev &&
+                 lang_st.st_ino == tmp_st.st_ino;
+
+  /* If the target doesn't exist yet the whole language dir can be
+   * moved, otherwise merge it in file by file */
+  if (!is_plain_dir ||
+      glnx_renameat2_noreplace (source_dfd, src_tmp_name, parent_dfd, lang_name) < 0)
+    {
+      glnx_autofd int locale_subdir_dfd = -1;
+      const char *lang_components[] = { lang_name, NULL };
+
+      if (!builder_ensure_dirs_at (parent_dfd, lang_components, &locale_subdir_dfd, error))
+        return FALSE;
+
+      if (!migrate_locale_dir_contents (lang_dfd, locale_subdir_dfd, error))
+        return FALSE;
+
+      if (unlinkat (source_dfd, src_tmp_name, AT_REMOVEDIR) < 0)
+        return glnx_throw_errno_prefix (error, "unlinkat %s", src_tmp_name);
+    }
 
   target = g_build_filename ("../../share/runtime/locale",
                              language, subdir, lang_name, NULL);
 
-  if (unlinkat (source_dfd, src_tmp_name, AT_REMOVEDIR) < 0)
-    return glnx_throw_errno_prefix (error, "unlinkat %s", src_tmp_name);
-
   if (symlinkat (target, source_dfd, lang_name) < 0)
     return glnx_throw_errno_prefix (error, "symlinkat %s", lang_name);
 
@@ -929,6 +1093,27 @@ sigint_handler (gpointer user_data)
   return TRUE;
 }
 
+/* Like g_unix_signal_add(), but attached to the thread-default context */
+static guint
+add_signal_source (int          signum,
+                   GSourceFunc  handler,
+                   gpointer     user_data)
+{
+  g_autoptr(GSource) source = g_unix_signal_source_new (signum);
+
+  g_source_set_callback (source, handler, user_data, NULL);
+  return g_source_attach (source, g_main_context_get_thread_default ());
+}
+
+static void
+remove_signal_source (guint id)
+{
+  GSource *source = g_main_context_find_source_by_id (g_main_context_get_thread_default (), id);
+
+  if (source)
+    g_source_destroy (source);
+}
+
 gboolean
 builder_host_spawnv (GFile                *dir,
                      char                **output,
@@ -979,7 +1164,7 @@ builder_host_spawnv (GFile                *dir,
   if (connection == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
   data.connection = connection;
   data.loop = loop;
   data.refs = 1;
@@ -1063,8 +1248,8 @@ builder_host_spawnv (GFile                *dir,
     }
   g_variant_builder_add (env_builder, "{ss}", "LANGUAGE", "C");
 
-  sigterm_id = g_unix_signal_add (SIGTERM, sigterm_handler, &data);
-  sigint_id = g_unix_signal_add (SIGINT, sigint_handler, &data);
+  sigterm_id = add_signal_source (SIGTERM, sigterm_handler, &data);
+  sigint_id = add_signal_source (SIGINT, sigint_handler, &data);
 
 try_again:
   ret = g_dbus_connection_call_with_unix_fd_list_sync (connection,
@@ -1111,8 +1296,8 @@ try_again:
 
   g_main_loop_run (loop);
 
-  g_source_remove (sigterm_id);
-  g_source_remove (sigint_id);
+  remove_signal_source (sigterm_id);
+  remove_signal_source (sigint_id);
   g_dbus_connection_signal_unsubscribe (connection, subscription);
 
   if (!g_spawn_check_exit_status (data.exit_status, error))
@@ -1135,6 +1320,104 @@ try_again:
   return TRUE;
 }
 
+/* Adds the resource usage of the command to usage */
+void
+builder_resource_usage_add (BuilderResourceUsage *usage,
+                            const struct rusage  *rusage)
+{
+  usage->user_time += (guint64) rusage->ru_utime.tv_sec * G_USEC_PER_SEC + rusage->ru_utime.tv_usec;
+  usage->system_time += (guint64) rusage->ru_stime.tv_sec * G_USEC_PER_SEC + rusage->ru_stime.tv_usec;
+  /* In kilobytes */
+  usage->max_rss = MAX (usage->max_rss, (guint64) rusage->ru_maxrss * 1024);
+}
+
+/* Adds what an exited but not yet reaped process read and wrote to
+   usage. Unlike the block counts in the rusage, this includes reads
+   from the page cache and IO on tmpfs, and the kernel adds the IO of
+   reaped children to their parent, so it covers the whole tree. */
+static void
+add_process_io (GPid                  pid,
+                BuilderResourceUsage *usage)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%d/io", pid);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], "rchar: "))
+        usage->bytes_read += g_ascii_strtoull (lines[i] + strlen ("rchar: "), NULL, 10);
+      else if (g_str_has_prefix (lines[i], "wchar: "))
+        usage->bytes_written += g_ascii_strtoull (lines[i] + strlen ("wchar: "), NULL, 10);
+    }
+}
+
+/* Like builder_maybe_host_spawnv() without output, but also adds what
+   the command used to usage. The memory is the peak RSS of the biggest
+   process the command ran. Nothing is added when running on the host
+   through the session helper, as there is no way to get it then. */
+gboolean
+builder_maybe_host_spawnv_usage (GFile                *dir,
+                                 BuilderResourceUsage *usage,
+                                 GError              **error,
+                                 const gchar * const  *argv,
+                                 const gchar * const  *unresolved_argv)
+{
+  g_auto(GStrv) env = NULL;
+  g_autofree gchar *commandline = NULL;
+  g_autofree char *dir_path = NULL;
+  struct rusage rusage;
+  siginfo_t info;
+  GPid pid;
+  int status;
+  int r;
+
+  if (flatpak_is_in_sandbox ())
+    return builder_host_spawnv (dir, NULL, 0, error, argv, unresolved_argv);
+
+  if (unresolved_argv != NULL)
+    commandline = flatpak_quote_argv ((const char **) unresolved_argv);
+  else
+    commandline = flatpak_quote_argv ((const char **) argv);
+  g_debug ("Running: %s", commandline);
+
+  if (dir)
+    dir_path = g_file_get_path (dir);
+
+  env = g_environ_setenv (g_get_environ (), "LANGUAGE", "C", TRUE);
+
+  /* We reap the child ourselves, as only wait4() reports the usage of
+     the process tree it ran */
+  if (!g_spawn_async (dir_path, (char **) argv, env,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                      NULL, NULL, &pid, error))
+    return FALSE;
+
+  /* The IO counters are gone once the child is reaped */
+  do
+    r = waitid (P_PID, pid, &info, WEXITED | WNOWAIT);
+  while (G_UNLIKELY (r == -1 && errno == EINTR));
+  if (r == -1)
+    return glnx_throw_errno_prefix (error, "waitid");
+
+  add_process_io (pid, usage);
+
+  do
+    r = wait4 (pid, &status, 0, &rusage);
+  while (G_UNLIKELY (r == -1 && errno == EINTR));
+  if (r == -1)
+    return glnx_throw_errno_prefix (error, "wait4");
+
+  builder_resource_usage_add (usage, &rusage);
+
+  return g_spawn_check_exit_status (status, error);
+}
+
 /* Similar to flatpak_spawnv, except uses the session helper HostCommand operation
    if in a sandbox */
 gboolean
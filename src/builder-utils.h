@@ -28,6 +28,7 @@
 #include <curl/curl.h>
 
 #include <libxml/tree.h>
+#include <sys/resource.h>
 
 G_BEGIN_DECLS
 
@@ -36,6 +37,17 @@ G_BEGIN_DECLS
 
 typedef struct BuilderUtils BuilderUtils;
 
+/* Times are in microseconds, the rest in bytes */
+typedef struct
+{
+  guint64 wall_time;
+  guint64 user_time;
+  guint64 system_time;
+  guint64 max_rss;
+  guint64 bytes_read;
+  guint64 bytes_written;
+} BuilderResourceUsage;
+
 char *builder_uri_to_filename (const char *uri);
 
 gboolean strip (GError **error,
@@ -54,6 +66,14 @@ char ** builder_get_debuginfo_file_references (const char *filename,
 
 gboolean directory_is_empty (const char *path);
 
+gboolean builder_parse_size (const char *str,
+                             guint64    *out_size,
+                             GError    **error);
+gboolean builder_get_disk_usage (GFile    *dir,
+                                 guint64  *out_size,
+                                 GError  **error);
+guint64  builder_get_available_memory (void);
+
 gboolean flatpak_matches_path_pattern (const char *path,
                                        const char *pattern);
 void     flatpak_collect_matches_for_path_pattern (const char *path,
@@ -98,6 +118,13 @@ gboolean builder_maybe_host_spawnv (GFile                *dir,
                                     GError              **error,
                                     const gchar * const  *argv,
                                     const gchar * const  *unresolved_argv);
+gboolean builder_maybe_host_spawnv_usage (GFile                *dir,
+                                          BuilderResourceUsage *usage,
+                                          GError              **error,
+                                          const gchar * const  *argv,
+                                          const gchar * const  *unresolved_argv);
+void     builder_resource_usage_add (BuilderResourceUsage *usage,
+                                     const struct rusage  *rusage);
 
 gboolean builder_download_uri (GUri           *uri,
                                const char     *http_referer,
@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+
+#include "builder-flatpak-utils.h"
+#include "builder-watch.h"
+
+/* Collects the files changed below a set of directories. Directory
+ * monitors are not recursive, so every subdirectory gets its own,
+ * including the ones created later. Changes are handed out once they
+ * have settled, so that saving many files at once triggers one build.
+ */
+
+#define WATCH_QUIET_MS 200
+
+typedef struct
+{
+  BuilderWatch *watch;
+  GPtrArray    *skip;
+} WatchRoot;
+
+struct BuilderWatch
+{
+  GPtrArray  *roots;
+  GHashTable *monitors;
+  GHashTable *changed;
+  guint       timeout_id;
+};
+
+static gboolean watch_tree (WatchRoot *root,
+                            GFile     *dir,
+                            GError   **error);
+
+static void
+watch_root_free (WatchRoot *root)
+{
+  if (root->skip)
+    g_ptr_array_unref (root->skip);
+  g_free (root);
+}
+
+static void
+monitor_free (GFileMonitor *monitor)
+{
+  g_file_monitor_cancel (monitor);
+  g_object_unref (monitor);
+}
+
+BuilderWatch *
+builder_watch_new (void)
+{
+  BuilderWatch *self = g_new0 (BuilderWatch, 1);
+
+  self->roots = g_ptr_array_new_with_free_func ((GDestroyNotify) watch_root_free);
+  self->monitors = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                          g_object_unref, (GDestroyNotify) monitor_free);
+  self->changed = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                         g_object_unref, NULL);
+
+  return self;
+}
+
+void
+builder_watch_free (BuilderWatch *self)
+{
+  if (self->timeout_id)
+    g_source_remove (self->timeout_id);
+  g_hash_table_unref (self->changed);
+  g_hash_table_unref (self->monitors);
+  g_ptr_array_unref (self->roots);
+  g_free (self);
+}
+
+static gboolean
+is_skipped (WatchRoot *root,
+            GFile     *file)
+{
+  int i;
+
+  for (i = 0; root->skip != NULL && i < root->skip->len; i++)
+    {
+      GFile *skip = g_ptr_array_index (root->skip, i);
+
+      if (g_file_equal (file, skip) || g_file_has_prefix (file, skip))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+settled_cb (gpointer user_data)
+{
+  BuilderWatch *self = user_data;
+
+  self->timeout_id = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+record_change (WatchRoot *root,
+               GFile     *file,
+               gboolean   maybe_new_dir)
+{
+  BuilderWatch *self = root->watch;
+
+  if (is_skipped (root, file))
+    return;
+
+  g_hash_table_add (self->changed, g_object_ref (file));
+
+  if (maybe_new_dir &&
+      g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_DIRECTORY)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (!watch_tree (root, file, &error))
+        g_warning ("Failed to watch %s: %s", flatpak_file_get_path_cached (file), error->message);
+    }
+
+  /* Wait for things to settle down */
+  if (self->timeout_id)
+    g_source_remove (self->timeout_id);
+  self->timeout_id = g_timeout_add (WATCH_QUIET_MS, settled_cb, self);
+}
+
+static void
+changed_cb (GFileMonitor      *monitor,
+            GFile             *file,
+            GFile             *other_file,
+            GFileMonitorEvent  event_type,
+            gpointer           user_data)
+{
+  WatchRoot *root = user_data;
+
+  switch (event_type)
+    {
+    case G_FILE_MONITOR_EVENT_CHANGED:
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+      record_change (root, file, FALSE);
+      break;
+
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+      record_change (root, file, TRUE);
+      break;
+
+    case G_FILE_MONITOR_EVENT_DELETED:
+    case G_FILE_MONITOR_EVENT_MOVED_OUT:
+      g_hash_table_remove (root->watch->monitors, file);
+      record_change (root, file, FALSE);
+      break;
+
+    case G_FILE_MONITOR_EVENT_RENAMED:
+      g_hash_table_remove (root->watch->monitors, file);
+      record_change (root, file, FALSE);
+      if (other_file)
+        record_change (root, other_file, TRUE);
+      break;
+
+    default:
+      break;
+    }
+}
+
+static gboolean
+watch_tree (WatchRoot *root,
+            GFile     *dir,
+            GError   **error)
+{
+  BuilderWatch *self = root->watch;
+  g_autoptr(GFileMonitor) monitor = NULL;
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  g_autoptr(GError) my_error = NULL;
+
+  if (is_skipped (root, dir) ||
+      g_hash_table_contains (self->monitors, dir))
+    return TRUE;
+
+  /* Monitor before listing, so nothing created in between is missed */
+  monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_WATCH_MOVES, NULL, error);
+  if (monitor == NULL)
+    return FALSE;
+
+  g_signal_connect (monitor, "changed", G_CALLBACK (changed_cb), root);
+  g_hash_table_insert (self->monitors, g_object_ref (dir), g_steal_pointer (&monitor));
+
+  enumerator = g_file_enumerate_children (dir, "standard::name,standard::type",
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          NULL, &my_error);
+  if (enumerator == NULL)
+    {
+      /* Raced with it being removed */
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      GFile *child;
+
+      if (!g_file_enumerator_iterate (enumerator, &info, &child, NULL, error))
+        return FALSE;
+
+      if (info == NULL)
+        break;
+
+      if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY &&
+          !watch_tree (root, child, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Files below anything in skip are ignored */
+gboolean
+builder_watch_add_dir (BuilderWatch *self,
+                       GFile        *dir,
+                       GPtrArray    *skip,
+                       GError      **error)
+{
+  WatchRoot *root = g_new0 (WatchRoot, 1);
+
+  root->watch = self;
+  root->skip = skip ? g_ptr_array_ref (skip) : NULL;
+  g_ptr_array_add (self->roots, root);
+
+  return watch_tree (root, dir, error);
+}
+
+/* Blocks until something changed, and returns the changed files and
+ * directories. This includes removed ones, and anything that changed
+ * since the last call. */
+GPtrArray *
+builder_watch_wait (BuilderWatch *self)
+{
+  g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_object_unref);
+  GHashTableIter iter;
+  gpointer key;
+
+  while (g_hash_table_size (self->changed) == 0 || self->timeout_id != 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_hash_table_iter_init (&iter, self->changed);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_ptr_array_add (changed, key);
+      g_hash_table_iter_steal (&iter);
+    }
+
+  return g_steal_pointer (&changed);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUILDER_WATCH_H__
+#define __BUILDER_WATCH_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct BuilderWatch BuilderWatch;
+
+BuilderWatch *builder_watch_new (void);
+void          builder_watch_free (BuilderWatch *self);
+gboolean      builder_watch_add_dir (BuilderWatch *self,
+                                     GFile        *dir,
+                                     GPtrArray    *skip,
+                                     GError      **error);
+GPtrArray *   builder_watch_wait (BuilderWatch *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderWatch, builder_watch_free)
+
+G_END_DECLS
+
+#endif /* __BUILDER_WATCH_H__ */
@@ -0,0 +1,215 @@
+/*
+ * Micro-benchmark comparing the compiled cleanup pattern matcher with
+ * matching each pattern in turn. Also checks that both agree.
+ *
+ * Usage: bench-path-matcher [N_PATHS [N_PATTERNS]]
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder-flatpak-utils.h"
+#include "builder-utils.h"
+#include "builder-path-matcher.h"
+
+static const char *base_patterns[] = {
+  "/include",
+  "/lib/pkgconfig",
+  "/lib/cmake",
+  "/share/pkgconfig",
+  "/share/aclocal",
+  "/share/man",
+  "/share/info",
+  "/share/gtk-doc",
+  "/share/doc/*",
+  "/lib/*/include",
+  "/share/*/examples",
+  "*.la",
+  "*.a",
+  "*.pc",
+  "lib*-static.so",
+  "Makefile?",
+  "README",
+  "/bin/*-config",
+  "/lib/debug/",
+  "/lib/python3*site-packages",
+  "/share/doc*glib",
+  "/share/icons/*/",
+};
+
+/* Cases where a '*' swallows the end of a component, or a trailing
+   slash needs another component to follow */
+static const char *edge_patterns[] = {
+  "/a*b",
+  "/a*b/c",
+  "/a?*c",
+  "/a*/",
+  "/a/*/",
+  "a*/",
+  "a/",
+  "/*b*c",
+};
+
+static const char *edge_paths[] = {
+  "a/b",
+  "ab",
+  "a/b/c",
+  "ab/c",
+  "axb/c/d",
+  "a/c",
+  "ax/c",
+  "a",
+  "a/x",
+  "a/x/y",
+  "x/b/c",
+  "bc",
+};
+
+static const char *dirs[] = {
+  "bin", "lib", "lib/pkgconfig", "lib/girepository-1.0", "lib/gio/modules",
+  "include", "include/glib-2.0", "share/man/man1", "share/doc/glib",
+  "share/locale/de/LC_MESSAGES", "share/icons/hicolor/48x48/apps",
+  "share/gtk-doc/html/gio", "lib/python3.11/site-packages/foo",
+};
+
+static const char *suffixes[] = {
+  ".so", ".so.0", ".la", ".a", ".h", ".pc", ".1", ".mo", ".png", ".py", "", "-config",
+};
+
+static GPtrArray *
+make_paths (guint n)
+{
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  for (i = 0; i < n; i++)
+    g_ptr_array_add (paths, g_strdup_printf ("%s/lib%u%s",
+                                             dirs[i % G_N_ELEMENTS (dirs)],
+                                             i / 7,
+                                             suffixes[i % G_N_ELEMENTS (suffixes)]));
+
+  return paths;
+}
+
+static GPtrArray *
+make_patterns (guint n)
+{
+  GPtrArray *patterns = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (i < G_N_ELEMENTS (base_patterns))
+        g_ptr_array_add (patterns, g_strdup (base_patterns[i]));
+      else if (i % 3 == 0)
+        g_ptr_array_add (patterns, g_strdup_printf ("/share/module%u", i));
+      else if (i % 3 == 1)
+        g_ptr_array_add (patterns, g_strdup_printf ("/lib/lib%u*.so", i));
+      else
+        g_ptr_array_add (patterns, g_strdup_printf ("*.ext%u", i));
+    }
+  g_ptr_array_add (patterns, NULL);
+
+  return patterns;
+}
+
+static gboolean
+same_keys (GHashTable *a,
+           GHashTable *b)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  if (g_hash_table_size (a) != g_hash_table_size (b))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (!g_hash_table_contains (b, key))
+        {
+          g_printerr ("Mismatch on %s\n", (char *) key);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GPtrArray) patterns = NULL;
+  g_autoptr(GHashTable) old_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) new_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(BuilderPathMatcher) matcher = NULL;
+  guint n_paths = argc > 1 ? atoi (argv[1]) : 300000;
+  guint n_patterns = argc > 2 ? atoi (argv[2]) : 300;
+  gint64 start, old_time, new_time;
+  guint i, j;
+
+  paths = make_paths (n_paths);
+  patterns = make_patterns (n_patterns);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < paths->len; i++)
+    for (j = 0; patterns->pdata[j] != NULL; j++)
+      flatpak_collect_matches_for_path_pattern (paths->pdata[i], patterns->pdata[j], "files/", old_ht);
+  old_time = g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  matcher = builder_path_matcher_new ((const char * const *) patterns->pdata);
+  for (i = 0; i < paths->len; i++)
+    builder_path_matcher_collect (matcher, paths->pdata[i], "files/", new_ht);
+  new_time = g_get_monotonic_time () - start;
+
+  g_print ("%u paths, %u patterns, %u matches\n", n_paths, n_patterns, g_hash_table_size (new_ht));
+  g_print ("per-pattern matching: %" G_GINT64_FORMAT " ms\n", old_time / 1000);
+  g_print ("compiled matcher:     %" G_GINT64_FORMAT " ms\n", new_time / 1000);
+
+  for (i = 0; i < paths->len; i++)
+    {
+      gboolean old_match = FALSE;
+
+      for (j = 0; patterns->pdata[j] != NULL; j++)
+        old_match = old_match || flatpak_matches_path_pattern (paths->pdata[i], patterns->pdata[j]);
+
+      if (old_match != builder_path_matcher_matches (matcher, paths->pdata[i]))
+        {
+          g_printerr ("Mismatch on %s\n", (char *) paths->pdata[i]);
+          return 1;
+        }
+    }
+
+  if (!same_keys (old_ht, new_ht))
+    return 1;
+
+  for (i = 0; i < G_N_ELEMENTS (edge_patterns); i++)
+    {
+      const char *edge_pattern[] = { edge_patterns[i], NULL };
+      g_autoptr(BuilderPathMatcher) edge_matcher = builder_path_matcher_new (edge_pattern);
+
+      for (j = 0; j < G_N_ELEMENTS (edge_paths); j++)
+        {
+          g_autoptr(GHashTable) old_edge_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+          g_autoptr(GHashTable) new_edge_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+          flatpak_collect_matches_for_path_pattern (edge_paths[j], edge_patterns[i], NULL, old_edge_ht);
+          builder_path_matcher_collect (edge_matcher, edge_paths[j], NULL, new_edge_ht);
+
+          if (flatpak_matches_path_pattern (edge_paths[j], edge_patterns[i]) !=
+              builder_path_matcher_matches (edge_matcher, edge_paths[j]) ||
+              !same_keys (old_edge_ht, new_edge_ht))
+            {
+              g_printerr ("Mismatch on %s for %s\n", edge_paths[j], edge_patterns[i]);
+              return 1;
+            }
+        }
+    }
+
+  return 0;
+}
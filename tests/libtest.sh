@@ -275,7 +275,7 @@ setup_sdk_repo () {
     GPGARGS="${GPGARGS:-${FL_GPGARGS}}" CREATE_SDK_CONFIG=${create_sdk_config_arg} \
     . $(dirname $0)/make-test-runtime.sh \
         ${REPONAME} ${SDK_ID} "${COLLECTION_ID}" \
-        bash ls cat echo readlink make mkdir cp touch > /dev/null
+        bash ls cat echo readlink make mkdir cp touch rm > /dev/null
 
     update_repo $REPONAME "${COLLECTION_ID}"
 }
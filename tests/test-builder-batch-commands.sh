@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..4"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-batch.json <<'EOF'
+{
+  "app-id": "org.test.Batch",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "batch",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/share",
+        "echo 'first command' > /app/share/log",
+        "BATCH_VAR=set",
+        "echo \"var ${BATCH_VAR:-unset}\" >> /app/share/log",
+        "echo 'quoted $HOME \"string\"' >> /app/share/log"
+      ],
+      "post-install": [
+        "echo post-install >> /app/share/log",
+        "echo post-install done >> /app/share/log"
+      ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --batch-commands appdir test-batch.json > build-output.txt
+
+assert_file_has_content appdir/files/share/log "^first command$"
+assert_file_has_content appdir/files/share/log "^post-install$"
+assert_file_has_content appdir/files/share/log "^post-install done$"
+
+echo "ok batched build and post-install commands run"
+
+assert_file_has_content appdir/files/share/log "^var unset$"
+assert_file_has_content appdir/files/share/log '^quoted \$HOME "string"$'
+
+echo "ok batched commands each run in their own shell"
+
+assert_file_has_content build-output.txt "^Running: echo 'first command' > /app/share/log$"
+assert_file_has_content build-output.txt "^Running: BATCH_VAR=set$"
+
+echo "ok batched commands are printed"
+
+cat > test-batch-fail.json <<'EOF'
+{
+  "app-id": "org.test.BatchFail",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "batch-fail",
+      "buildsystem": "simple",
+      "build-commands": [
+        "echo before > before",
+        "exit 3",
+        "echo after > after"
+      ]
+    }
+  ]
+}
+EOF
+
+BUILD_LOG=batch-fail.log run_build_fail --batch-commands --keep-build-dirs test-batch-fail.json
+
+assert_has_file .flatpak-builder/build/batch-fail/before
+assert_not_has_file .flatpak-builder/build/batch-fail/after
+
+echo "ok the first failing batched command stops the build"
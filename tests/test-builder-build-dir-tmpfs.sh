@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..5"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-tmpfs.json <<'EOF'
+{
+  "app-id": "org.test.Tmpfs",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "tmpfs-mod",
+      "buildsystem": "simple",
+      "build-commands": [
+        "echo built > built-here",
+        "mkdir -p /app/share",
+        "cat /proc/self/mountinfo > /app/share/mountinfo"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build --build-dir-tmpfs=1G test-tmpfs.json
+
+assert_has_file appdir/files/share/mountinfo
+ls .flatpak-builder/build-sizes/*-tmpfs-mod > /dev/null
+
+echo "ok build dir size is recorded"
+
+# The build dirs go below an existing tmpfs
+if [ "$(stat -f -c %T /dev/shm 2>/dev/null)" = tmpfs ]; then
+    TMPDIR=/dev/shm run_build --disable-cache --build-dir-tmpfs=1G test-tmpfs.json
+
+    assert_file_has_content appdir/files/share/mountinfo "/run/build/tmpfs-mod .* - tmpfs "
+
+    echo "ok module with a known size builds on tmpfs"
+else
+    echo "ok # SKIP /dev/shm is not a tmpfs"
+fi
+
+${FLATPAK_BUILDER} --force-clean --disable-cache --build-dir-tmpfs=1 \
+    appdir test-tmpfs.json > build-output.txt
+
+assert_file_has_content build-output.txt "Building tmpfs-mod on disk, it needs .* which exceeds the tmpfs budget"
+
+echo "ok module over the budget builds on disk"
+
+TMPDIR=/dev/shm run_build --disable-cache --keep-build-dirs --build-dir-tmpfs=1G test-tmpfs.json
+
+# Kept build dirs are moved out of the tmpfs
+build_link=$(readlink .flatpak-builder/build/tmpfs-mod)
+case "$build_link" in
+    /*) assert_not_reached "kept build dir $build_link was not moved to disk" ;;
+esac
+assert_file_has_content .flatpak-builder/build/tmpfs-mod/built-here "^built$"
+
+echo "ok kept build dirs are moved to disk"
+
+if ${FLATPAK_BUILDER} --force-clean --build-dir-tmpfs=99999999T \
+    appdir test-tmpfs.json 2> size-error.txt; then
+    assert_not_reached "an overflowing --build-dir-tmpfs size was accepted"
+fi
+assert_file_has_content size-error.txt "Size '99999999T' is too large"
+
+echo "ok sizes that overflow are rejected"
@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+git init -q gitsrc
+git -C gitsrc config --local user.email "test@flatpak.org"
+git -C gitsrc config --local user.name "test"
+for i in 1 2 3; do
+    echo $i > gitsrc/file$i
+    git -C gitsrc add file$i
+    git -C gitsrc commit -q -m "Add file$i"
+done
+git -C gitsrc tag -a -m "Version 1" v1 HEAD~1
+git -C gitsrc checkout -q -b other HEAD~2
+echo other > gitsrc/other
+git -C gitsrc add other
+git -C gitsrc commit -q -m "Add other"
+
+cat > org.test.BundleGit.json <<EOF
+{
+    "app-id": "org.test.BundleGit",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": ["mkdir -p /app"],
+        "sources": [{
+            "type": "git",
+            "path": "$TEST_DATA_DIR/gitsrc",
+            "tag": "v1"
+        }]
+    }]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --bundle-sources appdir org.test.BundleGit.json >&2
+
+MIRROR=$(echo appdir/sources/git/*)
+assert_has_dir "$MIRROR"
+
+COMMIT=$(git -C gitsrc rev-parse "v1^{commit}")
+assert_streq "$(git -C "$MIRROR" rev-parse "refs/tags/v1")" "$(git -C gitsrc rev-parse v1)"
+assert_streq "$(cat "$MIRROR/shallow")" "$COMMIT"
+assert_streq "$(git -C "$MIRROR" rev-list --all)" "$COMMIT"
+
+# The tag, the commit, its tree and two files
+assert_streq "$(git -C "$MIRROR" rev-list --objects --all | wc -l)" "5"
+git -C "$MIRROR" count-objects -v > count.txt
+assert_file_has_content count.txt "^in-pack: 5$"
+git -C "$MIRROR" fsck >&2
+
+echo "ok bundled git mirror only has the shallow history of the ref"
+
+git clone -q --branch v1 "$MIRROR" checkout >&2
+assert_has_file checkout/file1
+assert_has_file checkout/file2
+assert_not_has_file checkout/file3
+assert_not_has_file checkout/other
+
+echo "ok bundled git mirror can be cloned"
@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..5"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+mkdir -p no-copy-src/sub no-copy-src/skipped
+echo data > no-copy-src/sub/file
+echo skipped > no-copy-src/skipped/file
+ln -s no-copy-src no-copy-link
+
+cat > test-no-copy.json <<'EOF'
+{
+  "app-id": "org.test.NoCopy",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "no-copy",
+      "buildsystem": "simple",
+      "sources": [
+        { "type": "dir", "path": "no-copy-link", "no-copy": true, "skip": [ "skipped" ] }
+      ],
+      "build-commands": [
+        "echo output > sub/output",
+        "mkdir -p /app/share",
+        "cp sub/file /app/share/file",
+        "if test -e skipped; then echo yes; else echo no; fi > /app/share/has-skipped"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build --keep-build-dirs test-no-copy.json
+
+assert_has_symlink .flatpak-builder/build/no-copy/sub/file
+assert_file_has_content appdir/files/share/file "^data$"
+assert_not_has_symlink appdir/files/share/file
+
+echo "ok no-copy dir sources are linked into the build dir"
+
+assert_file_has_content .flatpak-builder/build/no-copy/sub/output "^output$"
+assert_not_has_file no-copy-src/sub/output
+
+echo "ok build outputs don't go into the no-copy dir"
+
+assert_file_has_content appdir/files/share/has-skipped "^no$"
+assert_not_has_dir .flatpak-builder/build/no-copy/skipped
+
+echo "ok skip applies to no-copy dirs reached through a symlink"
+
+sed -e 's/"cp sub\/file \/app\/share\/file"/"cp -a sub\/file \/app\/share\/file"/' \
+    test-no-copy.json > test-no-copy-symlink.json
+
+BUILD_LOG=symlink.log run_build_fail test-no-copy-symlink.json
+assert_file_has_content symlink.log "was installed as a symlink to .* in a no-copy dir source"
+
+echo "ok installing symlinks into the no-copy dir fails"
+
+cp $(dirname $0)/data1.patch .
+sed -e 's/"skip": \[ "skipped" \] }/"skip": [ "skipped" ] },\n        { "type": "patch", "path": "data1.patch" }/' \
+    test-no-copy.json > test-no-copy-patch.json
+
+BUILD_LOG=patch.log run_build_fail test-no-copy-patch.json
+assert_file_has_content patch.log "no-copy dir sources can't be combined with patch sources"
+
+echo "ok no-copy dirs can't be patched"
@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..3"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+echo first > first-source
+echo second > second-source
+
+cat > test-download-while-building.json <<'EOF'
+{
+  "app-id": "org.test.DownloadWhileBuilding",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "first",
+      "buildsystem": "simple",
+      "sources": [ { "type": "file", "path": "first-source" } ],
+      "build-commands": [ "mkdir -p /app/share", "cp first-source /app/share/" ]
+    },
+    {
+      "name": "second",
+      "buildsystem": "simple",
+      "sources": [ { "type": "file", "path": "second-source" } ],
+      "build-commands": [ "mkdir -p /app/share", "cp second-source /app/share/" ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --download-while-building \
+    appdir test-download-while-building.json > build-output.txt
+
+assert_file_has_content build-output.txt "Downloading sources in the background"
+assert_file_has_content appdir/files/share/first-source "^first$"
+assert_file_has_content appdir/files/share/second-source "^second$"
+
+echo "ok modules build with sources downloaded in the background"
+
+sed -e 's/"second-source"/"missing-source"/' test-download-while-building.json > test-download-missing.json
+
+if ${FLATPAK_BUILDER} --force-clean --disable-cache --download-while-building \
+       appdir test-download-missing.json > build-missing.txt 2>&1; then
+    assert_not_reached "build with a missing source unexpectedly succeeded"
+fi
+
+assert_file_has_content build-missing.txt "Building module first"
+assert_file_has_content build-missing.txt "Failed to download sources for second"
+
+echo "ok download errors are reported when the build reaches the module"
+
+sed -e 's/"first-source"/"missing-source"/' test-download-while-building.json > test-download-missing-first.json
+
+if ${FLATPAK_BUILDER} --force-clean --disable-cache --download-while-building \
+       appdir test-download-missing-first.json > build-missing-first.txt 2>&1; then
+    assert_not_reached "build with a missing source unexpectedly succeeded"
+fi
+
+assert_file_has_content build-missing-first.txt "Failed to download sources for first"
+assert_not_file_has_content build-missing-first.txt "Building module"
+
+echo "ok nothing is built when the first module's download fails"
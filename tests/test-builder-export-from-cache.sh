@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..7"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > org.test.ExportCache.json <<'EOF'
+{
+  "app-id": "org.test.ExportCache",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "command": "hello",
+  "modules": [
+    {
+      "name": "mod1",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/bin /app/share/data/sub /app/lib/debug/dbg",
+        "echo '#!/bin/sh' > /app/bin/hello",
+        "echo data > /app/share/data/file",
+        "echo data > /app/share/data/sub/file",
+        "echo debug > /app/lib/debug/dbg/file"
+      ]
+    }
+  ]
+}
+EOF
+
+APP_REF=app/org.test.ExportCache/$ARCH/master
+
+run_build --repo=repo-plain org.test.ExportCache.json
+ostree ls -R --repo=repo-plain $APP_REF > plain-files.txt
+
+run_build --repo=repo-cache --export-from-cache org.test.ExportCache.json
+ostree ls -R --repo=repo-cache $APP_REF > cache-files.txt
+
+assert_file_has_content cache-files.txt "/files/share/data/sub/file$"
+diff -u plain-files.txt cache-files.txt >&2
+
+echo "ok export from cache has the same files as a normal export"
+
+assert_not_file_has_content cache-files.txt "/files/lib/debug/dbg"
+
+echo "ok export from cache applies the export excludes"
+
+ostree summary --repo=repo-cache --view > summary.txt
+assert_file_has_content summary.txt "$APP_REF"
+
+echo "ok export from cache updates the repo summary"
+
+cat > org.test.ExportCacheBad.json <<'EOF'
+{
+  "app-id": "org.test.ExportCacheBad",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "command": "hello",
+  "modules": [
+    {
+      "name": "mod1",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/bin /app/share/dbus-1/services",
+        "echo '#!/bin/sh' > /app/bin/hello",
+        "echo '[D-BUS Service]' > /app/share/dbus-1/services/org.test.ExportCacheBad.service",
+        "echo 'Name=org.test.ExportCacheBad.Other' >> /app/share/dbus-1/services/org.test.ExportCacheBad.service",
+        "echo 'Exec=/app/bin/hello' >> /app/share/dbus-1/services/org.test.ExportCacheBad.service"
+      ]
+    }
+  ]
+}
+EOF
+
+BUILD_LOG=export-bad.log run_build_fail --repo=repo-cache --export-from-cache org.test.ExportCacheBad.json
+assert_file_has_content export-bad.log "does not match the file name"
+
+echo "ok export from cache validates exported service files"
+
+cat > org.test.ExportCacheExtra.json <<'EOF'
+{
+  "app-id": "org.test.ExportCacheExtra",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "command": "hello",
+  "finish-args": [
+    "--extra-data=extra.bin:0000000000000000000000000000000000000000000000000000000000000000:100:200:https://example.com/extra.bin"
+  ],
+  "modules": [
+    {
+      "name": "mod1",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/bin",
+        "echo '#!/bin/sh' > /app/bin/hello"
+      ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --repo=repo-cache --export-from-cache \
+    appdir org.test.ExportCacheExtra.json > export-extra.txt
+assert_file_has_content export-extra.txt "has extra data, using flatpak build-export"
+
+ostree show --repo=repo-cache --print-metadata-key=xa.extra-data-sources \
+    app/org.test.ExportCacheExtra/$ARCH/master > extra-data-sources.txt
+assert_file_has_content extra-data-sources.txt "https://example.com/extra.bin"
+
+echo "ok apps with extra data are exported with their extra data sources"
+
+cat > org.test.ExportRefs.json <<'EOF'
+{
+  "app-id": "org.test.ExportRefs",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "command": "hello",
+  "modules": [
+    {
+      "name": "mod1",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/bin /app/share/locale/de/LC_MESSAGES /app/lib/debug/dbg",
+        "echo '#!/bin/sh' > /app/bin/hello",
+        "echo shared > /app/bin/shared",
+        "echo shared > /app/share/locale/de/LC_MESSAGES/shared.mo",
+        "echo shared > /app/lib/debug/dbg/shared",
+        "echo debug > /app/lib/debug/dbg/file"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build --repo=repo-refs-plain org.test.ExportRefs.json
+run_build --repo=repo-refs-cache --export-from-cache org.test.ExportRefs.json
+
+for ref in app/org.test.ExportRefs/$ARCH/master \
+           runtime/org.test.ExportRefs.Locale/$ARCH/master \
+           runtime/org.test.ExportRefs.Debug/$ARCH/master; do
+    ostree ls -R --repo=repo-refs-plain $ref > refs-plain.txt
+    ostree ls -R --repo=repo-refs-cache $ref > refs-cache.txt
+    diff -u refs-plain.txt refs-cache.txt >&2
+done
+
+ostree ls -R --repo=repo-refs-cache runtime/org.test.ExportRefs.Locale/$ARCH/master > locale-files.txt
+assert_file_has_content locale-files.txt "/files/de/share/de/LC_MESSAGES/shared.mo$"
+ostree ls -R --repo=repo-refs-cache runtime/org.test.ExportRefs.Debug/$ARCH/master > debug-files.txt
+assert_file_has_content debug-files.txt "/files/dbg/file$"
+ostree ls -R --repo=repo-refs-cache app/org.test.ExportRefs/$ARCH/master > app-files.txt
+assert_not_file_has_content app-files.txt "LC_MESSAGES"
+assert_not_file_has_content app-files.txt "/files/lib/debug/dbg"
+
+echo "ok export from cache sorts the files into the app, locale and debug refs"
+
+csum_of () {
+    ostree ls -C --repo=repo-refs-cache "$1" "$2" | awk '{ print $5 }'
+}
+
+app_csum=$(csum_of app/org.test.ExportRefs/$ARCH/master /files/bin/shared)
+locale_csum=$(csum_of runtime/org.test.ExportRefs.Locale/$ARCH/master /files/de/share/de/LC_MESSAGES/shared.mo)
+debug_csum=$(csum_of runtime/org.test.ExportRefs.Debug/$ARCH/master /files/dbg/shared)
+assert_streq "$app_csum" "$locale_csum"
+assert_streq "$app_csum" "$debug_csum"
+ostree fsck --repo=repo-refs-cache >&2
+
+echo "ok refs exported from cache share their objects"
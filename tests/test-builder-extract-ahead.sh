@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..3"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cp $(dirname $0)/data1 .
+cp $(dirname $0)/data1.patch .
+
+cat > test-extract-ahead.json <<'EOF'
+{
+  "app-id": "org.test.ExtractAhead",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "first",
+      "buildsystem": "simple",
+      "build-commands": [ "mkdir -p /app/share", "echo first > /app/share/first" ]
+    },
+    {
+      "name": "second",
+      "buildsystem": "simple",
+      "sources": [
+        { "type": "file", "path": "data1" },
+        { "type": "patch", "path": "data1.patch" }
+      ],
+      "build-commands": [ "cp data1 /app/share/" ]
+    },
+    {
+      "name": "third",
+      "buildsystem": "simple",
+      "sources": [
+        { "type": "shell", "commands": [ "echo third > third" ] }
+      ],
+      "build-commands": [ "cp third /app/share/" ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --extract-ahead \
+    appdir test-extract-ahead.json > build-output.txt
+
+assert_file_has_content build-output.txt "Extracting sources of second in the background"
+assert_file_has_content appdir/files/share/first "^first$"
+assert_file_has_content appdir/files/share/data1 "^Some modified data1$"
+
+echo "ok sources extracted ahead are patched and built"
+
+assert_not_file_has_content build-output.txt "Extracting sources of third in the background"
+assert_file_has_content appdir/files/share/third "^third$"
+
+echo "ok modules with shell sources are not extracted ahead"
+
+${FLATPAK_BUILDER} --force-clean --disable-cache --extract-ahead --stop-at=second \
+    appdir test-extract-ahead.json > build-stop.txt
+
+assert_not_file_has_content build-stop.txt "Extracting sources of second in the background"
+assert_not_has_file appdir/files/share/data1
+
+echo "ok modules after --stop-at are not extracted ahead"
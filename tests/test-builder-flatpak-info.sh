@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+# Log the flatpak commands flatpak-builder runs
+REAL_FLATPAK=$(command -v flatpak)
+mkdir -p wrapper
+cat > wrapper/flatpak <<EOF
+#!/bin/sh
+echo "\$*" >> "$TEST_DATA_DIR/flatpak-calls.txt"
+exec "$REAL_FLATPAK" "\$@"
+EOF
+chmod +x wrapper/flatpak
+export PATH="$TEST_DATA_DIR/wrapper:$PATH"
+
+cat > org.test.FlatpakInfo.json <<'EOF'
+{
+    "app-id": "org.test.FlatpakInfo",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": ["mkdir -p /app/bin", "echo test > /app/bin/test"]
+    }]
+}
+EOF
+
+rm -f flatpak-calls.txt
+run_build org.test.FlatpakInfo.json
+
+assert_has_file appdir/files/bin/test
+
+# The commits and metadata come from the deploy dir, which is looked
+# up once per ref
+assert_not_file_has_content flatpak-calls.txt "--show-commit"
+assert_streq "$(grep -c -- '--show-location.* org.test.Sdk ' flatpak-calls.txt)" "1"
+assert_streq "$(grep -c -- '--show-location.* org.test.Platform ' flatpak-calls.txt)" "1"
+
+echo "ok sdk and runtime info is looked up once"
+
+cat > org.test.FlatpakInfoInherit.json <<'EOF'
+{
+    "app-id": "org.test.FlatpakInfoInherit",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "inherit-extensions": ["org.test.Missing"],
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": ["mkdir -p /app/bin", "echo test > /app/bin/test"]
+    }]
+}
+EOF
+
+rm -f flatpak-calls.txt
+BUILD_LOG=build.log run_build_fail org.test.FlatpakInfoInherit.json
+
+# The runtime metadata was read, without asking flatpak for it
+assert_file_has_content build.log "Can't find inherited extension point org.test.Missing"
+assert_not_file_has_content flatpak-calls.txt "--show-metadata"
+
+echo "ok runtime metadata is read from the deploy dir"
@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..3"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+echo one > one.txt
+echo two > two.txt
+
+cat > one.patch <<'EOF'
+--- a/one.txt
++++ b/one.txt
+@@ -1 +1 @@
+-one
++one modified
+EOF
+
+cat > two.patch <<'EOF'
+--- a/two.txt
++++ b/two.txt
+@@ -1 +1 @@
+-two
++two modified
+EOF
+
+cat > bad.patch <<'EOF'
+--- a/two.txt
++++ b/two.txt
+@@ -1 +1 @@
+-not two
++bad
+EOF
+
+cat > test-git-apply-batch.json <<'EOF'
+{
+  "app-id": "org.test.GitApplyBatch",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "patched",
+      "buildsystem": "simple",
+      "sources": [
+        { "type": "file", "path": "one.txt" },
+        { "type": "file", "path": "two.txt" },
+        { "type": "patch", "path": "one.patch", "use-git": true },
+        { "type": "patch", "path": "two.patch", "use-git": true }
+      ],
+      "build-commands": [ "mkdir -p /app/share", "cp one.txt two.txt /app/share/" ]
+    }
+  ]
+}
+EOF
+
+BUILD_LOG=batch.log run_build --verbose test-git-apply-batch.json
+
+assert_file_has_content appdir/files/share/one.txt "^one modified$"
+assert_file_has_content appdir/files/share/two.txt "^two modified$"
+assert_file_has_content batch.log "Running: git apply -v -p1 [^ ]*/one.patch [^ ]*/two.patch$"
+
+echo "ok consecutive git patch sources are applied in one git apply"
+
+sed -e 's/{ "type": "patch", "path": "one.patch", "use-git": true },//' \
+    -e 's/"path": "two.patch"/"paths": ["one.patch", "two.patch"]/' \
+    test-git-apply-batch.json > test-git-apply-paths.json
+
+BUILD_LOG=paths.log run_build --verbose test-git-apply-paths.json
+
+assert_file_has_content appdir/files/share/one.txt "^one modified$"
+assert_file_has_content appdir/files/share/two.txt "^two modified$"
+assert_file_has_content paths.log "Running: git apply -v -p1 [^ ]*/one.patch [^ ]*/two.patch$"
+
+echo "ok the paths of a git patch source are applied in one git apply"
+
+sed -e 's/"two.patch"/"bad.patch"/' test-git-apply-batch.json > test-git-apply-bad.json
+
+if ${FLATPAK_BUILDER} --force-clean appdir test-git-apply-bad.json > bad.log 2>&1; then
+    assert_not_reached "build with a bad patch unexpectedly succeeded"
+fi
+
+assert_file_has_content bad.log "Failed to apply the patches at once"
+assert_file_has_content bad.log "Failed to apply patch bad.patch"
+
+echo "ok a failing batch names the patch that doesn't apply"
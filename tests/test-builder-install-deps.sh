@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+setup_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+# Log the flatpak commands flatpak-builder runs
+REAL_FLATPAK=$(command -v flatpak)
+mkdir -p wrapper
+cat > wrapper/flatpak <<EOF
+#!/bin/sh
+echo "\$*" >> "$TEST_DATA_DIR/flatpak-calls.txt"
+exec "$REAL_FLATPAK" "\$@"
+EOF
+chmod +x wrapper/flatpak
+export PATH="$TEST_DATA_DIR/wrapper:$PATH"
+
+cat > org.test.InstallDeps.json <<'EOF'
+{
+    "app-id": "org.test.InstallDeps",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": ["mkdir -p /app"]
+    }]
+}
+EOF
+
+rm -f flatpak-calls.txt
+${FLATPAK_BUILDER} --user --install-deps-from=test-repo --install-deps-only \
+    appdir org.test.InstallDeps.json > install-deps.txt
+
+assert_file_has_content install-deps.txt "^Installing org.test.Sdk/.*/master from test-repo$"
+assert_file_has_content install-deps.txt "^Installing org.test.Platform/.*/master from test-repo$"
+${FLATPAK} ${U} info org.test.Sdk master >&2
+${FLATPAK} ${U} info org.test.Platform master >&2
+
+# Both are installed in a single transaction
+grep -E '(^| )install( |$)' flatpak-calls.txt > install-calls.txt
+assert_streq "$(wc -l < install-calls.txt)" "1"
+assert_file_has_content install-calls.txt "org.test.Sdk/.*/master"
+assert_file_has_content install-calls.txt "org.test.Platform/.*/master"
+
+echo "ok missing dependencies are installed in one transaction"
+
+rm -f flatpak-calls.txt
+${FLATPAK_BUILDER} --user --install-deps-from=test-repo --install-deps-only \
+    appdir org.test.InstallDeps.json > install-deps.txt
+
+assert_file_has_content install-deps.txt "^Updating org.test.Sdk/.*/master$"
+assert_file_has_content install-deps.txt "^Updating org.test.Platform/.*/master$"
+assert_not_file_has_content install-deps.txt "^Installing "
+
+grep -E '(^| )update( |$)' flatpak-calls.txt > update-calls.txt
+assert_streq "$(wc -l < update-calls.txt)" "1"
+assert_file_has_content update-calls.txt "org.test.Sdk/.*/master"
+assert_file_has_content update-calls.txt "org.test.Platform/.*/master"
+if grep -qE '(^| )install( |$)' flatpak-calls.txt; then
+    assert_not_reached "installed dependencies were installed again"
+fi
+
+echo "ok installed dependencies are updated in one transaction"
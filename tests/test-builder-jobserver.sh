@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..3"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-jobserver.json <<'EOF'
+{
+  "app-id": "org.test.Jobserver",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "parallel",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/share",
+        "echo \"MAKEFLAGS=${MAKEFLAGS:-}\" > /app/share/parallel",
+        "echo \"CARGO_MAKEFLAGS=${CARGO_MAKEFLAGS:-}\" >> /app/share/parallel",
+        "if test -p /run/jobserver/fifo; then echo fifo >> /app/share/parallel; fi"
+      ]
+    },
+    {
+      "name": "serial",
+      "buildsystem": "simple",
+      "no-parallel-make": true,
+      "build-commands": [
+        "echo \"MAKEFLAGS=${MAKEFLAGS:-}\" > /app/share/serial",
+        "if test -e /run/jobserver; then echo bound; else echo unbound; fi >> /app/share/serial"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build --jobserver --jobs=4 test-jobserver.json
+
+assert_file_has_content appdir/files/share/parallel "^MAKEFLAGS=-j4 --jobserver-auth=fifo:/run/jobserver/fifo$"
+assert_file_has_content appdir/files/share/parallel "^CARGO_MAKEFLAGS=-j4 --jobserver-auth=fifo:/run/jobserver/fifo$"
+assert_file_has_content appdir/files/share/parallel "^fifo$"
+
+echo "ok jobserver is shared with the build"
+
+assert_file_has_content appdir/files/share/serial "^MAKEFLAGS=$"
+assert_file_has_content appdir/files/share/serial "^unbound$"
+
+echo "ok no-parallel-make modules don't use the jobserver"
+
+run_build --disable-cache --jobs=4 test-jobserver.json
+
+assert_file_has_content appdir/files/share/parallel "^MAKEFLAGS=$"
+assert_not_file_has_content appdir/files/share/parallel "^fifo$"
+
+echo "ok no jobserver without --jobserver"
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_fuse
 
-echo "1..7"
+echo "1..8"
 
 setup_repo
 install_repo
@@ -246,3 +246,51 @@ run_build test-licence_subdir_itself_symlink.json
 assert_not_has_file appdir/files/share/licenses/org.test.licence_subdir_itself_symlink/test/LICENSES_environ
 
 echo "ok licence dir symlink is skipped"
+
+mkdir -p source_licence_8
+echo "LICENSE TEXT" > source_licence_8/LICENSE
+echo "COPYING TEXT" > source_licence_8/COPYING
+tar czf source_licence_8.tar.gz source_licence_8/
+
+cat > test-licence_remembered.json <<'EOF'
+{
+    "app-id": "org.test.licence_remembered",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": [],
+        "sources": [{
+            "type": "archive",
+            "path": "source_licence_8.tar.gz",
+            "dest-filename": "source_licence_8.tar.gz"
+        }]
+    }]
+}
+EOF
+
+LICENSE_DIR=appdir/files/share/licenses/org.test.licence_remembered/test
+
+run_build test-licence_remembered.json
+
+assert_has_file $LICENSE_DIR/LICENSE
+assert_has_file $LICENSE_DIR/COPYING
+assert_file_has_content .flatpak-builder/license-files/test '^checksum=1-'
+
+# A rebuild of the same stage only opens the remembered files
+sed -i 's/^paths=.*/paths=COPYING;/' .flatpak-builder/license-files/test
+run_build --disable-cache test-licence_remembered.json
+
+assert_not_has_file $LICENSE_DIR/LICENSE
+assert_has_file $LICENSE_DIR/COPYING
+
+# and scans again if one of them is gone
+sed -i 's/^paths=.*/paths=GONE;COPYING;/' .flatpak-builder/license-files/test
+run_build --disable-cache test-licence_remembered.json
+
+assert_has_file $LICENSE_DIR/LICENSE
+assert_has_file $LICENSE_DIR/COPYING
+assert_file_has_content .flatpak-builder/license-files/test '^paths=.*LICENSE'
+
+echo "ok license files of a stage are remembered"
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_fuse
 
-echo "1..4"
+echo "1..5"
 
 setup_repo
 install_repo
@@ -218,3 +218,43 @@ assert_has_file appdir/files/bin/test
 assert_not_has_dir appdir/files/share/runtime/locale
 
 echo "ok locale migration handles missing locale dirs"
+
+cat > test-locale-move.json <<'EOF'
+{
+    "app-id": "org.test.locale_move",
+    "runtime": "org.test.Platform",
+    "sdk": "org.test.Sdk",
+    "modules": [{
+        "name": "test",
+        "buildsystem": "simple",
+        "build-commands": [
+            "mkdir -p /app/share/locale/it/LC_MESSAGES /app/share/links",
+            "echo 'it translation' > /app/share/locale/it/LC_MESSAGES/test.mo",
+            "cp -l /app/share/locale/it/LC_MESSAGES/test.mo /app/share/links/it.mo",
+
+            "mkdir -p /app/share/locale/fr/LC_MESSAGES",
+            "echo 'fr translation' > /app/share/locale/fr/LC_MESSAGES/test.mo",
+            "cp -l /app/share/locale/fr/LC_MESSAGES/test.mo /app/share/links/fr.mo",
+            "mkdir -p /app/share/runtime/locale/fr/share/fr/LC_MESSAGES",
+            "echo 'fr other' > /app/share/runtime/locale/fr/share/fr/LC_MESSAGES/other.mo"
+        ]
+    }]
+}
+EOF
+
+run_build test-locale-move.json
+
+# A language dir with no target yet is moved as a whole
+assert_has_symlink appdir/files/share/locale/it
+assert_file_has_content appdir/files/share/runtime/locale/it/share/it/LC_MESSAGES/test.mo 'it translation'
+assert_streq "$(stat -c %i appdir/files/share/runtime/locale/it/share/it/LC_MESSAGES/test.mo)" \
+             "$(stat -c %i appdir/files/share/links/it.mo)"
+
+# One with an existing target is merged into it, still moving the files
+assert_has_symlink appdir/files/share/locale/fr
+assert_file_has_content appdir/files/share/runtime/locale/fr/share/fr/LC_MESSAGES/test.mo 'fr translation'
+assert_file_has_content appdir/files/share/runtime/locale/fr/share/fr/LC_MESSAGES/other.mo 'fr other'
+assert_streq "$(stat -c %i appdir/files/share/runtime/locale/fr/share/fr/LC_MESSAGES/test.mo)" \
+             "$(stat -c %i appdir/files/share/links/fr.mo)"
+
+echo "ok locale files are moved rather than copied"
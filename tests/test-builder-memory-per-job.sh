@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+# One PiB per job never fits, one MiB always does
+cat > test-memory-per-job.json <<'EOF'
+{
+  "app-id": "org.test.MemoryPerJob",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "huge",
+      "buildsystem": "simple",
+      "memory-per-job": 1073741824,
+      "build-commands": [
+        "mkdir -p /app/share",
+        "echo $FLATPAK_BUILDER_N_JOBS > /app/share/huge-jobs"
+      ]
+    },
+    {
+      "name": "small",
+      "buildsystem": "simple",
+      "memory-per-job": 1,
+      "build-commands": [
+        "echo $FLATPAK_BUILDER_N_JOBS > /app/share/small-jobs"
+      ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --jobs=4 appdir test-memory-per-job.json > build-output.txt
+
+assert_file_has_content build-output.txt "Limiting huge to 1 jobs"
+assert_file_has_content appdir/files/share/huge-jobs "^1$"
+
+echo "ok jobs are limited by memory-per-job"
+
+assert_not_file_has_content build-output.txt "Limiting small"
+assert_file_has_content appdir/files/share/small-jobs "^4$"
+
+echo "ok jobs are not limited when memory-per-job fits"
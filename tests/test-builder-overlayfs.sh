@@ -0,0 +1,126 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+# The overlayfs is mounted in a user namespace, using user xattrs
+if ! command -v nsenter >/dev/null || ! command -v unshare >/dev/null; then
+    echo "1..0 # SKIP this test requires nsenter and unshare"
+    exit 0
+fi
+
+overlay_check=$(mktemp -d)
+mkdir -p "$overlay_check"/{lower,upper,work,merged}
+if ! unshare -Urm mount -t overlay overlay \
+       -o lowerdir="$overlay_check/lower",upperdir="$overlay_check/upper",workdir="$overlay_check/work",userxattr \
+       "$overlay_check/merged" 2>/dev/null; then
+    rm -rf "$overlay_check"
+    echo "1..0 # SKIP this test requires unprivileged overlayfs"
+    exit 0
+fi
+rm -rf "$overlay_check"
+
+echo "1..5"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-overlayfs.json <<'EOF'
+{
+  "app-id": "org.test.Overlayfs",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "mod1",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p /app/share/data /app/share/tree/sub",
+        "echo keep > /app/share/data/keep",
+        "echo gone > /app/share/data/gone",
+        "echo old > /app/share/tree/old",
+        "echo old > /app/share/tree/sub/old",
+        "echo old > /app/share/changed"
+      ]
+    },
+    {
+      "name": "mod2",
+      "buildsystem": "simple",
+      "build-commands": [
+        "rm /app/share/data/gone",
+        "rm -rf /app/share/tree",
+        "mkdir -p /app/share/tree/sub",
+        "echo new > /app/share/tree/sub/new",
+        "echo new > /app/share/changed",
+        "mkdir -p /app/share/added/sub",
+        "echo added > /app/share/added/sub/file"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build --protection-backend=overlayfs test-overlayfs.json
+
+assert_has_file appdir/files/share/data/keep
+assert_not_has_file appdir/files/share/data/gone
+
+echo "ok overlayfs applies removed files"
+
+assert_not_has_file appdir/files/share/tree/old
+assert_not_has_file appdir/files/share/tree/sub/old
+assert_file_has_content appdir/files/share/tree/sub/new "^new$"
+assert_file_has_content appdir/files/share/changed "^new$"
+assert_file_has_content appdir/files/share/added/sub/file "^added$"
+
+echo "ok overlayfs replaces removed and recreated dirs"
+
+if command -v getfattr >/dev/null; then
+    getfattr -R -h -d -m '^user\.overlay\.' appdir/files > xattrs.txt 2>/dev/null || true
+    assert_not_file_has_content xattrs.txt "user\.overlay\."
+fi
+
+echo "ok overlayfs xattrs are not merged into the app"
+
+run_build --protection-backend=overlayfs test-overlayfs.json
+
+assert_not_has_file appdir/files/share/data/gone
+assert_not_has_file appdir/files/share/tree/sub/old
+assert_file_has_content appdir/files/share/tree/sub/new "^new$"
+
+echo "ok overlayfs results are reused from the cache"
+
+mkdir -p .flatpak-builder/overlay/overlay-stale/upper/files
+echo stale > .flatpak-builder/overlay/overlay-stale/upper/files/stale
+
+run_build --protection-backend=overlayfs test-overlayfs.json
+
+assert_not_has_dir .flatpak-builder/overlay/overlay-stale
+assert_not_has_file appdir/files/stale
+assert_streq "$(ls -A .flatpak-builder/overlay)" ""
+
+echo "ok stale overlayfs dirs are removed"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_fuse
 skip_without_python2
 
-echo "1..2"
+echo "1..3"
 
 setup_repo
 install_repo
@@ -46,6 +46,8 @@ chmod u+w *.py
 run_build org.test.Python.json
 
 assert_has_file appdir/files/bin/importme.pyc
+# Not linked anywhere else, so fixed up in place
+assert_streq "$(od -An -tx1 -j4 -N4 appdir/files/bin/importme.pyc | tr -d ' ')" "00000000"
 
 builder_run_app org.test.Python.json testpython.py > testpython.out
 
@@ -63,3 +65,50 @@ builder_run_app org.test.Python2.json testpython.py > testpython.out
 assert_file_has_content testpython.out "^first   $"
 
 echo "ok handled .pyc without .py"
+
+cat > org.test.PythonLinked.json <<'EOF'
+{
+    "app-id": "org.test.PythonLinked",
+    "runtime": "org.test.PythonPlatform",
+    "sdk": "org.test.PythonSdk",
+    "command": "testpython.py",
+    "modules": [
+        {
+            "name": "linked-python",
+            "buildsystem": "simple",
+            "build-commands": [
+                "mkdir /app/bin",
+                "cp testpython.py /app/bin",
+                "cp importme.py /app/bin",
+                "/app/bin/testpython.py",
+                "python2 -c \"import os; os.link('/app/bin/importme.pyc', '/app/bin/importme.pyc.link')\""
+            ],
+            "sources": [
+                {
+                    "type": "file",
+                    "path": "testpython.py"
+                },
+                {
+                    "type": "file",
+                    "path": "importme.py"
+                }
+            ]
+        }
+    ]
+}
+EOF
+
+run_build org.test.PythonLinked.json
+
+# The mtime in the header of the fixed up file is zeroed, while the
+# other link to the file is left alone
+assert_streq "$(od -An -tx1 -j4 -N4 appdir/files/bin/importme.pyc | tr -d ' ')" "00000000"
+if [ "$(od -An -tx1 -j4 -N4 appdir/files/bin/importme.pyc.link | tr -d ' ')" = "00000000" ]; then
+    assert_not_reached "hard link to the .pyc was modified"
+fi
+
+builder_run_app org.test.PythonLinked.json testpython.py > testpython.out
+
+assert_file_has_content testpython.out "^first   $"
+
+echo "ok pyc with other hard links is fixed up in a copy"
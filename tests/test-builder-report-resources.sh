@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-resources.json <<'EOF'
+{
+  "app-id": "org.test.Resources",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "io-mod",
+      "buildsystem": "simple",
+      "build-commands": [
+        "printf '%4194304s' x > big",
+        "cat big > big-copy",
+        "mkdir -p /app/share",
+        "echo built > /app/share/built"
+      ]
+    }
+  ]
+}
+EOF
+
+# Page cache reads and tmpfs writes don't show up as block IO
+TMPDIR=/dev/shm ${FLATPAK_BUILDER} --force-clean --build-dir-tmpfs=1G \
+    --report-resources appdir test-resources.json > report.txt
+
+grep "^io-mod " report.txt > io-mod.txt
+assert_file_has_content io-mod.txt " [0-9.]* [MG]B *[0-9.]* [MG]B$"
+
+echo "ok bytes read and written include page cache and tmpfs IO"
+
+${FLATPAK_BUILDER} --force-clean --report-resources appdir test-resources.json > report-cached.txt
+
+grep "^io-mod " report-cached.txt > io-mod-cached.txt
+diff -u io-mod.txt io-mod-cached.txt >&2
+
+echo "ok cached modules report the usage of their last build"
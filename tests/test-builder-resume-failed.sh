@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..4"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+echo data > resume-data
+
+# Fails the first time it runs in a build dir, succeeds the next time
+cat > test-resume.json <<'EOF'
+{
+  "app-id": "org.test.Resume",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "resume",
+      "buildsystem": "simple",
+      "sources": [ { "type": "file", "path": "resume-data" } ],
+      "build-commands": [
+        "echo run >> runs",
+        "test -e marker || { touch marker; exit 1; }",
+        "mkdir -p /app/share",
+        "cp runs /app/share/runs"
+      ]
+    }
+  ]
+}
+EOF
+
+if ${FLATPAK_BUILDER} --force-clean appdir test-resume.json > build-fail.txt 2>&1; then
+    assert_not_reached "first build unexpectedly succeeded"
+fi
+
+assert_has_file .flatpak-builder/failed-builds/$ARCH-resume
+
+echo "ok failed builds are recorded"
+
+${FLATPAK_BUILDER} --force-clean --resume-failed appdir test-resume.json > build-resume.txt
+
+assert_file_has_content build-resume.txt "Resuming failed build of resume"
+assert_streq "$(cat appdir/files/share/runs)" "$(printf 'run\nrun')"
+
+echo "ok resume-failed continues in the failed build dir"
+
+sed -e 's/marker/marker2/g' test-resume.json > test-resume-fresh.json
+
+if ${FLATPAK_BUILDER} --force-clean appdir test-resume-fresh.json > build-fail2.txt 2>&1; then
+    assert_not_reached "first build unexpectedly succeeded"
+fi
+if ${FLATPAK_BUILDER} --force-clean appdir test-resume-fresh.json > build-fail3.txt 2>&1; then
+    assert_not_reached "build without --resume-failed unexpectedly succeeded"
+fi
+
+assert_not_file_has_content build-fail3.txt "Resuming failed build"
+
+echo "ok failed builds are not resumed without resume-failed"
+
+sed -e 's/"echo run >> runs"/"echo changed >> runs"/' test-resume-fresh.json > test-resume-changed.json
+
+if ${FLATPAK_BUILDER} --force-clean --resume-failed appdir test-resume-changed.json > build-changed.txt 2>&1; then
+    assert_not_reached "changed build unexpectedly succeeded"
+fi
+
+assert_not_file_has_content build-changed.txt "Resuming failed build"
+
+echo "ok failed builds of a different stage are not resumed"
@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+cat > test-trash.json <<'EOF'
+{
+  "app-id": "org.test.Trash",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "trash-mod",
+      "buildsystem": "simple",
+      "build-commands": [
+        "mkdir -p many/a many/b",
+        "for i in 1 2 3 4 5 6 7 8 9 10; do echo $i > many/a/$i; echo $i > many/b/$i; done",
+        "mkdir -p /app/share",
+        "echo built > /app/share/built"
+      ]
+    }
+  ]
+}
+EOF
+
+run_build test-trash.json
+
+assert_file_has_content appdir/files/share/built "^built$"
+assert_not_has_dir .flatpak-builder/build/trash-mod-1
+assert_not_has_symlink .flatpak-builder/build/trash-mod
+
+echo "ok finished build dirs are moved out of the build dir"
+
+mkdir -p .flatpak-builder/build/.trash/leftover-XXXXXX/sub
+echo leftover > .flatpak-builder/build/.trash/leftover-XXXXXX/sub/file
+
+# Everything is cached, so this run doesn't trash anything new
+run_build test-trash.json
+
+assert_not_has_dir .flatpak-builder/build/.trash/leftover-XXXXXX
+assert_streq "$(ls -A .flatpak-builder/build/.trash)" ""
+
+echo "ok leftover trash is removed at the next startup"
@@ -0,0 +1,107 @@
+#!/bin/bash
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..4"
+
+setup_repo
+install_repo
+setup_sdk_repo
+install_sdk_repo
+
+cd "$TEST_DATA_DIR"
+
+# Waits until the watch log has at least $2 lines matching $1
+wait_for_log () {
+    for i in $(seq 1 250); do
+        if [ "$(grep -c -e "$1" watch.log || true)" -ge "$2" ]; then
+            return 0
+        fi
+        if ! kill -0 "$WATCH_PID" 2>/dev/null; then
+            sed -e 's/^/# /' < watch.log >&2
+            assert_not_reached "flatpak-builder --watch exited"
+        fi
+        sleep 0.2
+    done
+    sed -e 's/^/# /' < watch.log >&2
+    assert_not_reached "Timed out waiting for '$1'"
+}
+
+mkdir -p watched-src/data
+echo one > watched-src/data/file
+
+cat > test-watch.json <<'EOF'
+{
+  "app-id": "org.test.Watch",
+  "runtime": "org.test.Platform",
+  "sdk": "org.test.Sdk",
+  "modules": [
+    {
+      "name": "base",
+      "buildsystem": "simple",
+      "build-commands": [ "mkdir -p /app/share", "echo base > /app/share/base" ]
+    },
+    {
+      "name": "watched",
+      "buildsystem": "simple",
+      "sources": [ { "type": "dir", "path": "watched-src" } ],
+      "build-commands": [ "cp -r data /app/share/" ]
+    }
+  ]
+}
+EOF
+
+${FLATPAK_BUILDER} --force-clean --watch=watched appdir test-watch.json > watch.log 2>&1 &
+WATCH_PID=$!
+trap 'kill $WATCH_PID 2>/dev/null || true; cleanup' EXIT
+
+wait_for_log "Watching watched for changes" 1
+
+assert_file_has_content appdir/files/share/base "^base$"
+assert_file_has_content appdir/files/share/data/file "^one$"
+
+echo "ok watch builds up to the module"
+
+echo two > watched-src/data/file
+wait_for_log "Watching watched for changes" 2
+
+assert_file_has_content appdir/files/share/data/file "^two$"
+
+echo "ok changed files are rebuilt"
+
+echo new > watched-src/data/new
+wait_for_log "Watching watched for changes" 3
+
+assert_file_has_content appdir/files/share/data/new "^new$"
+assert_file_has_content appdir/files/share/data/file "^two$"
+
+echo "ok new files are rebuilt"
+
+kill $WATCH_PID
+wait $WATCH_PID || true
+
+BUILD_LOG=watch-stop-at.log run_build_fail --watch=watched --stop-at=base test-watch.json
+assert_file_has_content watch-stop-at.log "Can't use --watch with"
+
+echo "ok watch can't be combined with --stop-at"
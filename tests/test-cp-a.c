@@ -0,0 +1,280 @@
+/*
+ * Checks that flatpak_cp_a, which copies regular files on a thread
+ * pool, keeps its skip, merge and ownership semantics, and returns the
+ * errors of the copies.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "builder-flatpak-utils.h"
+
+/* More files than threads, so copies are still queued when the walk
+   finishes */
+#define N_FILES 64
+
+static char *
+make_tmpdir (void)
+{
+  g_autoptr(GError) error = NULL;
+  char *dir = g_dir_make_tmp ("test-cp-a-XXXXXX", &error);
+
+  g_assert_no_error (error);
+  return dir;
+}
+
+static void
+remove_tmpdir (const char *dir)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (dir);
+  g_autoptr(GError) error = NULL;
+
+  if (g_file_test (dir, G_FILE_TEST_EXISTS))
+    {
+      flatpak_rm_rf (file, NULL, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static void
+write_file (const char *dir,
+            const char *name,
+            const char *contents)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  g_autofree char *parent = g_path_get_dirname (path);
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (parent, 0755), ==, 0);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+static void
+assert_file_contents (const char *dir,
+                      const char *name,
+                      const char *expected)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  g_autofree char *contents = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_file_get_contents (path, &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (contents, ==, expected);
+}
+
+static void
+assert_not_exists (const char *dir,
+                   const char *name)
+{
+  g_autofree char *path = g_build_filename (dir, name, NULL);
+  struct stat st;
+
+  g_assert_cmpint (lstat (path, &st), ==, -1);
+}
+
+static void
+make_tree (const char *dir)
+{
+  g_autofree char *exec_path = g_build_filename (dir, "bin/tool", NULL);
+  g_autofree char *link_path = g_build_filename (dir, "lib/libfoo.so", NULL);
+  int i;
+
+  for (i = 0; i < N_FILES; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("share/data/%d/file%d", i % 4, i);
+      g_autofree char *contents = g_strdup_printf ("contents of %d\n", i);
+
+      write_file (dir, name, contents);
+    }
+
+  write_file (dir, "bin/tool", "#!/bin/sh\n");
+  g_assert_cmpint (chmod (exec_path, 0751), ==, 0);
+  write_file (dir, "lib/libfoo.so.1", "library\n");
+  g_assert_cmpint (symlink ("libfoo.so.1", link_path), ==, 0);
+}
+
+static void
+assert_tree (const char *dir)
+{
+  g_autofree char *exec_path = g_build_filename (dir, "bin/tool", NULL);
+  g_autofree char *link_path = g_build_filename (dir, "lib/libfoo.so", NULL);
+  g_autofree char *target = NULL;
+  struct stat st;
+  int i;
+
+  for (i = 0; i < N_FILES; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("share/data/%d/file%d", i % 4, i);
+      g_autofree char *contents = g_strdup_printf ("contents of %d\n", i);
+
+      assert_file_contents (dir, name, contents);
+    }
+
+  g_assert_cmpint (stat (exec_path, &st), ==, 0);
+  g_assert_cmpint (st.st_mode & 07777, ==, 0751);
+
+  target = g_file_read_link (link_path, NULL);
+  g_assert_cmpstr (target, ==, "libfoo.so.1");
+}
+
+static void
+test_copy (void)
+{
+  g_autofree char *tmp = make_tmpdir ();
+  g_autofree char *src = g_build_filename (tmp, "src", NULL);
+  g_autofree char *dest = g_build_filename (tmp, "dest", NULL);
+  g_autofree char *dest2 = g_build_filename (tmp, "dest2", NULL);
+  g_autoptr(GFile) src_file = g_file_new_for_path (src);
+  g_autoptr(GFile) dest_file = g_file_new_for_path (dest);
+  g_autoptr(GFile) dest2_file = g_file_new_for_path (dest2);
+  g_autoptr(GError) error = NULL;
+  g_autofree char *time_path = g_build_filename (src, "share/data/0/file0", NULL);
+  g_autofree char *dest_time_path = g_build_filename (dest2, "share/data/0/file0", NULL);
+  struct stat st;
+  struct utimbuf old_time = { 1000000000, 1000000000 };
+
+  make_tree (src);
+  g_assert_cmpint (g_utime (time_path, &old_time), ==, 0);
+
+  flatpak_cp_a (src_file, dest_file, NULL, FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, &error);
+  g_assert_no_error (error);
+  assert_tree (dest);
+
+  /* Without NO_CHOWN the metadata is kept as well */
+  flatpak_cp_a (src_file, dest2_file, NULL, FLATPAK_CP_FLAGS_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+  assert_tree (dest2);
+  g_assert_cmpint (stat (dest_time_path, &st), ==, 0);
+  g_assert_cmpint (st.st_mtime, ==, old_time.modtime);
+
+  remove_tmpdir (tmp);
+}
+
+static void
+test_skip (void)
+{
+  g_autofree char *tmp = make_tmpdir ();
+  g_autofree char *src = g_build_filename (tmp, "src", NULL);
+  g_autofree char *dest = g_build_filename (tmp, "dest", NULL);
+  g_autofree char *skip_dir = g_build_filename (src, "share/data/1", NULL);
+  g_autofree char *skip_file = g_build_filename (src, "bin/tool", NULL);
+  g_autoptr(GFile) src_file = g_file_new_for_path (src);
+  g_autoptr(GFile) dest_file = g_file_new_for_path (dest);
+  g_autoptr(GPtrArray) skip = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GError) error = NULL;
+
+  make_tree (src);
+  g_ptr_array_add (skip, g_file_new_for_path (skip_dir));
+  g_ptr_array_add (skip, g_file_new_for_path (skip_file));
+
+  flatpak_cp_a (src_file, dest_file, NULL, FLATPAK_CP_FLAGS_NO_CHOWN, skip, NULL, &error);
+  g_assert_no_error (error);
+
+  assert_not_exists (dest, "share/data/1");
+  assert_not_exists (dest, "bin/tool");
+  assert_file_contents (dest, "share/data/0/file0", "contents of 0\n");
+  assert_file_contents (dest, "share/data/2/file2", "contents of 2\n");
+  assert_file_contents (dest, "lib/libfoo.so.1", "library\n");
+
+  remove_tmpdir (tmp);
+}
+
+static void
+test_merge (void)
+{
+  g_autofree char *tmp = make_tmpdir ();
+  g_autofree char *src = g_build_filename (tmp, "src", NULL);
+  g_autofree char *dest = g_build_filename (tmp, "dest", NULL);
+  g_autofree char *outside = g_build_filename (tmp, "outside", NULL);
+  g_autofree char *escape = g_build_filename (dest, "share/data/3", NULL);
+  g_autoptr(GFile) src_file = g_file_new_for_path (src);
+  g_autoptr(GFile) dest_file = g_file_new_for_path (dest);
+  g_autoptr(GError) error = NULL;
+
+  make_tree (src);
+  write_file (dest, "share/data/0/file0", "old contents\n");
+  write_file (dest, "share/data/0/extra", "extra\n");
+
+  /* Existing dirs are only reused when merging */
+  g_assert_false (flatpak_cp_a (src_file, dest_file, dest_file,
+                                FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS);
+  g_clear_error (&error);
+
+  flatpak_cp_a (src_file, dest_file, dest_file,
+                FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, &error);
+  g_assert_no_error (error);
+  assert_tree (dest);
+  assert_file_contents (dest, "share/data/0/extra", "extra\n");
+
+  /* Merging must not follow a symlink out of the toplevel */
+  remove_tmpdir (escape);
+  g_assert_cmpint (g_mkdir_with_parents (outside, 0755), ==, 0);
+  g_assert_cmpint (symlink (outside, escape), ==, 0);
+
+  g_assert_false (flatpak_cp_a (src_file, dest_file, dest_file,
+                                FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_clear_error (&error);
+  assert_not_exists (outside, "file3");
+
+  remove_tmpdir (tmp);
+}
+
+static void
+test_error (void)
+{
+  g_autofree char *tmp = make_tmpdir ();
+  g_autofree char *src = g_build_filename (tmp, "src", NULL);
+  g_autofree char *dest = g_build_filename (tmp, "dest", NULL);
+  g_autofree char *dest2 = g_build_filename (tmp, "dest2", NULL);
+  g_autofree char *unreadable = g_build_filename (src, "share/data/2/file10", NULL);
+  g_autoptr(GFile) src_file = g_file_new_for_path (src);
+  g_autoptr(GFile) dest_file = g_file_new_for_path (dest);
+  g_autoptr(GFile) dest2_file = g_file_new_for_path (dest2);
+  g_autoptr(GError) error = NULL;
+
+  if (geteuid () == 0)
+    {
+      g_test_skip ("root can read any file");
+      return;
+    }
+
+  make_tree (src);
+  g_assert_cmpint (chmod (unreadable, 0), ==, 0);
+
+  /* The failure happens on a pool thread, and is still returned */
+  g_assert_false (flatpak_cp_a (src_file, dest_file, NULL,
+                                FLATPAK_CP_FLAGS_NO_CHOWN, NULL, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED);
+  g_clear_error (&error);
+
+  g_assert_false (flatpak_cp_a (src_file, dest2_file, NULL,
+                                FLATPAK_CP_FLAGS_NONE, NULL, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED);
+  g_clear_error (&error);
+
+  g_assert_cmpint (chmod (unreadable, 0644), ==, 0);
+  remove_tmpdir (tmp);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/cp-a/copy", test_copy);
+  g_test_add_func ("/cp-a/skip", test_skip);
+  g_test_add_func ("/cp-a/merge", test_merge);
+  g_test_add_func ("/cp-a/error", test_error);
+
+  return g_test_run ();
+}
@@ -0,0 +1,178 @@
+/*
+ * Checks that path tables survive a round trip through their on-disk
+ * format, and that corrupt tables are rejected.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "builder-path-table.h"
+
+static GPtrArray *
+table_to_paths (BuilderPathTable *table)
+{
+  g_auto(BuilderPathTableIter) iter = { 0 };
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+  const char *path;
+
+  builder_path_table_iter_init (&iter, table);
+  while (builder_path_table_iter_next (&iter, &path))
+    g_ptr_array_add (paths, g_strdup (path));
+
+  return paths;
+}
+
+static void
+assert_table_has_paths (BuilderPathTable   *table,
+                        const char * const *expected)
+{
+  g_autoptr(GPtrArray) paths = table_to_paths (table);
+  guint i;
+
+  g_assert_cmpuint (builder_path_table_get_length (table), ==, g_strv_length ((char **) expected));
+  g_assert_cmpuint (paths->len, ==, g_strv_length ((char **) expected));
+  for (i = 0; i < paths->len; i++)
+    g_assert_cmpstr (paths->pdata[i], ==, expected[i]);
+}
+
+static void
+test_round_trip (void)
+{
+  const char *paths[] = {
+    "share/icons/hicolor/64x64/apps/org.test.Hello.png",
+    "bin/hello",
+    "share/icons/hicolor/128x128/apps/org.test.Hello.png",
+    "share/icons",
+    "lib/libfoo.so.1",
+    "lib/libfoo.so",
+    "share/icons/hicolor/128x128",
+    "bin/hello-helper",
+  };
+  const char *sorted[] = {
+    "bin/hello",
+    "bin/hello-helper",
+    "lib/libfoo.so",
+    "lib/libfoo.so.1",
+    "share/icons",
+    "share/icons/hicolor/128x128",
+    "share/icons/hicolor/128x128/apps/org.test.Hello.png",
+    "share/icons/hicolor/64x64/apps/org.test.Hello.png",
+    NULL
+  };
+  g_autoptr(BuilderPathTable) table = NULL;
+  g_autoptr(BuilderPathTable) loaded = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  table = builder_path_table_new (paths, G_N_ELEMENTS (paths));
+  assert_table_has_paths (table, sorted);
+
+  bytes = builder_path_table_get_bytes (table);
+  loaded = builder_path_table_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (loaded);
+  assert_table_has_paths (loaded, sorted);
+}
+
+static void
+test_empty (void)
+{
+  const char *none[] = { NULL };
+  g_autoptr(BuilderPathTable) table = NULL;
+  g_autoptr(BuilderPathTable) loaded = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  table = builder_path_table_new (none, 0);
+  assert_table_has_paths (table, none);
+
+  bytes = builder_path_table_get_bytes (table);
+  loaded = builder_path_table_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  assert_table_has_paths (loaded, none);
+}
+
+static void
+test_long_paths (void)
+{
+  /* Lengths over 127 need multi-byte varints */
+  g_autofree char *dir = g_strnfill (300, 'd');
+  g_autofree char *a = g_strconcat (dir, "/a", NULL);
+  g_autofree char *b = g_strconcat (dir, "/b", NULL);
+  const char *paths[] = { b, a };
+  const char *sorted[] = { a, b, NULL };
+  g_autoptr(BuilderPathTable) table = NULL;
+  g_autoptr(BuilderPathTable) loaded = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  table = builder_path_table_new (paths, G_N_ELEMENTS (paths));
+  bytes = builder_path_table_get_bytes (table);
+  loaded = builder_path_table_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  assert_table_has_paths (loaded, sorted);
+}
+
+static void
+assert_invalid (const guint8 *data,
+                gsize         size)
+{
+  g_autoptr(GBytes) bytes = g_bytes_new (data, size);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(BuilderPathTable) table = NULL;
+
+  table = builder_path_table_new_from_bytes (bytes, &error);
+  g_assert_null (table);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+}
+
+static void
+test_corrupt (void)
+{
+  /* 2 paths: "ab", then "ac" sharing 1 byte */
+  const guint8 valid[] = { 2, 0, 2, 'a', 'b', 1, 1, 'c' };
+  const guint8 too_many[] = { 3, 0, 2, 'a', 'b', 1, 1, 'c' };
+  const guint8 bad_shared[] = { 2, 0, 2, 'a', 'b', 3, 1, 'c' };
+  const guint8 bad_suffix[] = { 2, 0, 2, 'a', 'b', 1, 5, 'c' };
+  const guint8 nul[] = { 2, 0, 2, 'a', 0, 1, 1, 'c' };
+  const guint8 trailing[] = { 2, 0, 2, 'a', 'b', 1, 1, 'c', 'x' };
+  const guint8 unterminated_varint[] = { 0x80, 0x80 };
+  const guint8 huge_count[] = { 0xff, 0xff, 0xff, 0xff, 0x0f };
+  g_autoptr(GBytes) bytes = g_bytes_new (valid, sizeof (valid));
+  g_autoptr(BuilderPathTable) table = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *expected[] = { "ab", "ac", NULL };
+  gsize i;
+
+  table = builder_path_table_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  assert_table_has_paths (table, expected);
+
+  assert_invalid (NULL, 0);
+  assert_invalid (too_many, sizeof (too_many));
+  assert_invalid (bad_shared, sizeof (bad_shared));
+  assert_invalid (bad_suffix, sizeof (bad_suffix));
+  assert_invalid (nul, sizeof (nul));
+  assert_invalid (trailing, sizeof (trailing));
+  assert_invalid (unterminated_varint, sizeof (unterminated_varint));
+  assert_invalid (huge_count, sizeof (huge_count));
+
+  /* Every truncation of a valid table is invalid */
+  for (i = 0; i < sizeof (valid); i++)
+    assert_invalid (valid, i);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/path-table/round-trip", test_round_trip);
+  g_test_add_func ("/path-table/empty", test_empty);
+  g_test_add_func ("/path-table/long-paths", test_long_paths);
+  g_test_add_func ("/path-table/corrupt", test_corrupt);
+
+  return g_test_run ();
+}